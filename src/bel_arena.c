@@ -0,0 +1,127 @@
+/* bel_arena - Region-based allocator for per-request buffers  */
+
+#include "bel_arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* Every allocation is rounded up to a multiple of this  */
+#define ARENA_ALIGN 16
+#define ALIGN_UP(n) (((n) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+
+struct ArenaBlock {
+    ArenaBlock *next;
+    size_t size;    /* usable bytes, header excluded  */
+    size_t used;
+};
+#define BLOCK_HEADER_SIZE ALIGN_UP(sizeof(ArenaBlock))
+
+
+static ArenaBlock* new_block_or_die(const size_t);
+static void* block_data(ArenaBlock*);
+static void free_chain(ArenaBlock*);
+
+
+void
+bel_arena_init_or_die(Arena *arena, const size_t block_size)
+{
+    *arena = empty_arena;
+    arena->block_size = ALIGN_UP(block_size);
+    arena->first = new_block_or_die(arena->block_size);
+    arena->current = arena->first;
+}
+
+
+void*
+bel_arena_alloc_or_die(Arena *arena, const size_t size)
+{
+    size_t aligned_size;
+    ArenaBlock *block = NULL;
+
+    aligned_size = ALIGN_UP(size);
+    if (aligned_size > arena->block_size) {
+        block = new_block_or_die(aligned_size);
+        block->next = arena->oversized;
+        arena->oversized = block;
+        block->used = aligned_size;
+        return block_data(block);
+    }
+
+    /* move along the chain (growing it if needed) until something fits  */
+    while (arena->current->size - arena->current->used < aligned_size) {
+        if (arena->current->next == NULL) {
+            arena->current->next = new_block_or_die(arena->block_size);
+        }
+        arena->current = arena->current->next;
+    }
+    block = arena->current;
+    block->used += aligned_size;
+    return (char*) block_data(block) + block->used - aligned_size;
+}
+
+void*
+bel_arena_zalloc_or_die(Arena *arena, const size_t size)
+{
+    void *ptr;
+
+    ptr = bel_arena_alloc_or_die(arena, size);
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+
+void
+bel_arena_reset(Arena *arena)
+{
+    ArenaBlock *block;
+
+    for (block = arena->first; block != NULL; block = block->next) {
+        block->used = 0;
+    }
+    arena->current = arena->first;
+    free_chain(arena->oversized);
+    arena->oversized = NULL;
+}
+
+void
+bel_arena_destroy(Arena *arena)
+{
+    free_chain(arena->first);
+    free_chain(arena->oversized);
+    *arena = empty_arena;
+}
+
+
+static ArenaBlock*
+new_block_or_die(const size_t size)
+{
+    ArenaBlock *block;
+
+    block = malloc(BLOCK_HEADER_SIZE + size);
+    if (block == NULL) {
+        perror("[FATAL] malloc()");
+        exit(EXIT_FAILURE);
+    }
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+static void*
+block_data(ArenaBlock *block)
+{
+    return (char*) block + BLOCK_HEADER_SIZE;
+}
+
+static void
+free_chain(ArenaBlock *block)
+{
+    ArenaBlock *next;
+
+    for (; block != NULL; block = next) {
+        next = block->next;
+        free(block);
+    }
+}
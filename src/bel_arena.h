@@ -0,0 +1,52 @@
+#ifndef BELARENA_H_INCLUDED
+#define BELARENA_H_INCLUDED
+
+#include <stddef.h>
+
+
+/* Size of the blocks an arena carves its allocations from  */
+#define ARENA_BLOCK_SIZE 65536
+
+
+typedef struct ArenaBlock ArenaBlock;
+
+/*
+ * Region-based allocator: memory is handed out sequentially from big blocks
+ * and given back all at once by bel_arena_reset(). Meant for buffers whose
+ * lifetime is a single request, so that the hot path never hits malloc()
+ * and big buffers stay off the stack
+ */
+typedef struct {
+    ArenaBlock *first;      /* chain of regular blocks, kept across resets  */
+    ArenaBlock *current;    /* block currently being filled  */
+    ArenaBlock *oversized;  /* one-off blocks for huge requests  */
+    size_t block_size;
+} Arena;
+static const Arena empty_arena;
+
+
+/*
+ * Prepares <arena> for use, allocating its first block of <block_size> bytes
+ * upfront. Exits on failure
+ */
+extern void bel_arena_init_or_die(Arena*, const size_t block_size);
+
+/*
+ * Returns a block of <size> bytes, suitably aligned for any type, which stays
+ * valid until the next reset of <arena>. Exits on failure
+ */
+extern void* bel_arena_alloc_or_die(Arena*, const size_t size);
+
+/* Same as bel_arena_alloc_or_die(), but the memory is zero-filled  */
+extern void* bel_arena_zalloc_or_die(Arena*, const size_t size);
+
+/*
+ * Makes all the memory handed out by <arena> available again. Regular blocks
+ * are kept for reuse, oversized ones are given back to the system
+ */
+extern void bel_arena_reset(Arena*);
+
+/* Gives all the memory held by <arena> back to the system  */
+extern void bel_arena_destroy(Arena*);
+
+#endif	/* BELARENA_H_INCLUDED */
@@ -0,0 +1,698 @@
+/*
+ * bel_async - Asynchronous client library, over a pool of connections
+ *
+ * General considerations:
+ * - sockets are non-blocking: requests are encoded into the output buffer of
+ *      their connection, sent as far as the socket takes them, and the rest
+ *      goes out from bel_async_run()
+ * - answers come back in the order of the requests on each connection, so
+ *      every connection keeps a queue of what it is waiting for; an answer is
+ *      only parsed once it has all arrived, straight from the input buffer
+ * - the login is the first request of every connection, pipelined with the
+ *      ones behind it, so opening a connection never waits for the server
+ */
+
+#include "bel_async.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+/* Bytes read from a connection at a time  */
+#define RECV_CHUNK 65536
+
+/* Maximum number of characters (digits) a port can have  */
+#define PORT_MAXCHARS 5
+
+
+/* What a connection is waiting an answer for  */
+#define REQ_LOGIN   0
+#define REQ_READ    1
+#define REQ_SEND    2
+#define REQ_DELETE  3
+#define REQ_STATS   4
+
+typedef struct {
+    int kind;
+    AsyncCallback callback;
+    void *arg;
+} Request;
+
+/* Growable byte buffer, consumed from <off>  */
+typedef struct {
+    char *data;
+    size_t off;
+    size_t len;
+    size_t size;
+} Buffer;
+
+typedef struct {
+    int fd;             /* -1 when closed  */
+    Buffer out;
+    Buffer in;
+    Request *queue;     /* circular, <count> requests from <head>  */
+    size_t head;
+    size_t count;
+    size_t size;
+} Connection;
+static const Connection empty_connection;
+
+struct AsyncPool {
+    char *address;
+    u_short port;
+    char uname[UNAME_MSGLEN];
+    char pword[PWORD_MSGLEN];
+    int no_of_conns;
+    Connection *conns;
+    struct pollfd *fds;
+    int next;           /* where to start looking for a connection  */
+    int pending;        /* requests waiting for an answer, logins excluded  */
+};
+
+
+static int open_connection(AsyncPool*, Connection*);
+static int connect_to(const char* const, const u_short);
+static int connect_local(const char* const);
+static void fail_connection(AsyncPool*, Connection*, const int);
+static Connection* choose_connection(AsyncPool*);
+
+static int submit(AsyncPool*, const int, const char* const, const size_t,
+        const char* const, const size_t, const char* const, const size_t,
+        AsyncCallback, void*);
+static int push_request(Connection*, const Request);
+static int put(Buffer*, const char* const, const size_t);
+static int put_field(Buffer*, const char* const, const size_t);
+static int reserve(Buffer*, const size_t);
+
+static Connection* find_connection(AsyncPool*, const int);
+static int flush(Connection*);
+static int receive(AsyncPool*, Connection*);
+static void dispatch_replies(AsyncPool*, Connection*);
+static size_t parse_reply(const int, char*, const size_t, AsyncReply*);
+static size_t parse_field(char*, const size_t, const size_t, AsyncReply*);
+static int answer_status(const char* const);
+
+
+AsyncPool*
+bel_async_open(const char* const address, const u_short port,
+        const char* const uname, const char* const pword,
+        const int connections)
+{
+    int i, opened = 0;
+    AsyncPool *pool;
+
+    if (connections < 1 || strlen(uname) >= UNAME_MSGLEN
+            || strlen(pword) >= PWORD_MSGLEN) {
+        errno = EINVAL;
+        return NULL;
+    }
+    pool = calloc(1, sizeof(AsyncPool));
+    if (pool == NULL) return NULL;
+    pool->address = malloc(strlen(address) + 1);
+    pool->conns = malloc(sizeof(Connection) * connections);
+    pool->fds = malloc(sizeof(struct pollfd) * connections);
+    if (pool->address == NULL || pool->conns == NULL || pool->fds == NULL) {
+        bel_async_close(pool);
+        return NULL;
+    }
+    strcpy(pool->address, address);
+    pool->port = port;
+    strcpy(pool->uname, uname);     /* calloc() did the padding  */
+    strcpy(pool->pword, pword);
+    pool->no_of_conns = connections;
+    for (i = 0; i < connections; ++i) {
+        pool->conns[i] = empty_connection;
+        pool->conns[i].fd = -1;
+    }
+    for (i = 0; i < connections; ++i) {
+        if (open_connection(pool, pool->conns + i) == 0) ++opened;
+    }
+    if (opened == 0) {
+        bel_async_close(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void
+bel_async_close(AsyncPool *pool)
+{
+    int i;
+    Connection *conn;
+
+    if (pool == NULL) return;
+    for (i = 0; pool->conns != NULL && i < pool->no_of_conns; ++i) {
+        conn = pool->conns + i;
+        if (conn->fd != -1) close(conn->fd);
+        free(conn->out.data);
+        free(conn->in.data);
+        free(conn->queue);
+    }
+    free(pool->conns);
+    free(pool->fds);
+    free(pool->address);
+    free(pool);
+}
+
+
+/*
+ * Connects <conn> and queues the login on it.
+ * Returns 0 on success, -1 on failure
+ */
+static int
+open_connection(AsyncPool *pool, Connection *conn)
+{
+    Request login;
+
+    conn->fd = connect_to(pool->address, pool->port);
+    if (conn->fd == -1) return -1;
+    if (fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK)
+            == -1) {
+        fail_connection(pool, conn, ASYNC_ERROR);
+        return -1;
+    }
+    login.kind = REQ_LOGIN;
+    login.callback = NULL;
+    login.arg = NULL;
+    if (put(&conn->out, pool->uname, UNAME_MSGLEN) == -1
+            || put(&conn->out, pool->pword, PWORD_MSGLEN) == -1
+            || push_request(conn, login) == -1) {
+        fail_connection(pool, conn, ASYNC_ERROR);
+        return -1;
+    }
+    flush(conn);
+    return 0;
+}
+
+/*
+ * Like bel_connect_or_die(), without exiting nor logging.
+ * Returns the file descriptor of the connected socket, or -1
+ */
+static int
+connect_to(const char* const address, const u_short port)
+{
+    int sockfd = -1, nodelay = 1;
+    char port_str[PORT_MAXCHARS + 1];
+    struct addrinfo hints, *servinfo, *currinfo;
+
+    if (strchr(address, '/') != NULL) return connect_local(address);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    sprintf(port_str, "%u", (unsigned) port);
+    if (getaddrinfo(address, port_str, &hints, &servinfo) != 0) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    for (currinfo = servinfo; currinfo != NULL; currinfo = currinfo->ai_next) {
+        sockfd = socket(currinfo->ai_family, currinfo->ai_socktype,
+                currinfo->ai_protocol);
+        if (sockfd == -1) continue;
+        if (connect(sockfd, currinfo->ai_addr, currinfo->ai_addrlen) == 0) {
+            break;
+        }
+        close(sockfd);
+        sockfd = -1;
+    }
+    freeaddrinfo(servinfo);
+    if (sockfd != -1) {
+        /* pipelined requests are made of small writes too  */
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(int));
+    }
+    return sockfd;
+}
+
+static int
+connect_local(const char* const path)
+{
+    int sockfd;
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd == -1) return -1;
+    if (connect(sockfd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/*
+ * Closes <conn> and reports <status> to every request it was waiting for. The
+ * queue is detached first, since the callbacks can queue new requests, even
+ * on this very connection
+ */
+static void
+fail_connection(AsyncPool *pool, Connection *conn, const int status)
+{
+    Request *queue, request;
+    size_t i, head, count, size;
+    AsyncReply reply = empty_async_reply;
+
+    if (conn->fd != -1) close(conn->fd);
+    conn->fd = -1;
+    conn->out.off = conn->out.len = 0;
+    conn->in.off = conn->in.len = 0;
+    queue = conn->queue;
+    head = conn->head;
+    count = conn->count;
+    size = conn->size;
+    conn->queue = NULL;
+    conn->head = conn->count = conn->size = 0;
+
+    reply.status = status;
+    for (i = 0; i < count; ++i) {
+        request = queue[(head + i) % size];
+        if (request.kind == REQ_LOGIN) continue;
+        --pool->pending;
+        request.callback(&reply, request.arg);
+    }
+    free(queue);
+}
+
+/*
+ * Picks the open connection with the fewest requests in flight, opening a
+ * closed one instead if they are all busy.
+ * Returns NULL if there is no connection to use
+ */
+static Connection*
+choose_connection(AsyncPool *pool)
+{
+    int i;
+    Connection *conn, *best = NULL;
+
+    for (i = 0; i < pool->no_of_conns; ++i) {
+        conn = pool->conns + (pool->next + i) % pool->no_of_conns;
+        if (conn->fd != -1 && (best == NULL || conn->count < best->count)) {
+            best = conn;
+        }
+    }
+    pool->next = (pool->next + 1) % pool->no_of_conns;
+    if (best != NULL && best->count == 0) return best;
+    for (i = 0; i < pool->no_of_conns; ++i) {
+        conn = pool->conns + i;
+        if (conn->fd != -1) continue;
+        if (open_connection(pool, conn) == 0) return conn;
+        break;  /* the others would not do any better  */
+    }
+    return best;
+}
+
+
+int
+bel_async_read(AsyncPool *pool, AsyncCallback callback, void *arg)
+{
+    return submit(pool, REQ_READ, CMD_READ, CMD_MSGLEN, NULL, 0, NULL, 0,
+            callback, arg);
+}
+
+int
+bel_async_stats(AsyncPool *pool, AsyncCallback callback, void *arg)
+{
+    return submit(pool, REQ_STATS, CMD_STATS, CMD_MSGLEN, NULL, 0, NULL, 0,
+            callback, arg);
+}
+
+int
+bel_async_delete(AsyncPool *pool, const unsigned long id,
+        AsyncCallback callback, void *arg)
+{
+    char msg[CMD_MSGLEN + ID_MSGLEN];
+
+    memset(msg, 0, sizeof(msg));
+    strcpy(msg, CMD_DELETE);
+    sprintf(msg + CMD_MSGLEN, "%lu", id);
+    return submit(pool, REQ_DELETE, msg, sizeof(msg), NULL, 0, NULL, 0,
+            callback, arg);
+}
+
+int
+bel_async_send(AsyncPool *pool,
+        const char* const subject, const size_t subject_len,
+        const char* const body, const size_t body_len, const unsigned long ttl,
+        AsyncCallback callback, void *arg)
+{
+    char msg[CMD_MSGLEN + ID_MSGLEN];
+
+    if (subject_len > TXT_MAXLEN_LIMIT || body_len > TXT_MAXLEN_LIMIT) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(msg, 0, sizeof(msg));
+    if (ttl == 0) {
+        strcpy(msg, CMD_SEND);
+        return submit(pool, REQ_SEND, msg, CMD_MSGLEN, subject, subject_len,
+                body, body_len, callback, arg);
+    }
+    strcpy(msg, CMD_SENDEX);
+    sprintf(msg + CMD_MSGLEN, "%lu", ttl);
+    return submit(pool, REQ_SEND, msg, sizeof(msg), subject, subject_len,
+            body, body_len, callback, arg);
+}
+
+/*
+ * Queues a request of the given kind, made of the <head_len> bytes of <head>
+ * and then, if <subject> is not NULL, of the subject and body fields.
+ * Returns 0 on success, -1 on failure
+ */
+static int
+submit(AsyncPool *pool, const int kind,
+        const char* const head, const size_t head_len,
+        const char* const subject, const size_t subject_len,
+        const char* const body, const size_t body_len,
+        AsyncCallback callback, void *arg)
+{
+    Connection *conn;
+    Request request;
+    size_t rollback;
+
+    if (callback == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    conn = choose_connection(pool);
+    if (conn == NULL) return -1;
+    rollback = conn->out.len;
+    request.kind = kind;
+    request.callback = callback;
+    request.arg = arg;
+    if (put(&conn->out, head, head_len) == -1
+            || (subject != NULL
+                && (put_field(&conn->out, subject, subject_len) == -1
+                    || put_field(&conn->out, body, body_len) == -1))
+            || push_request(conn, request) == -1) {
+        conn->out.len = rollback;   /* nothing half-queued goes out  */
+        return -1;
+    }
+    ++pool->pending;
+    flush(conn);    /* errors show up in bel_async_run()  */
+    return 0;
+}
+
+static int
+push_request(Connection *conn, const Request request)
+{
+    size_t i, new_size;
+    Request *queue;
+
+    if (conn->count == conn->size) {
+        new_size = conn->size == 0 ? 16 : conn->size * 2;
+        queue = malloc(sizeof(Request) * new_size);
+        if (queue == NULL) return -1;
+        for (i = 0; i < conn->count; ++i) {
+            queue[i] = conn->queue[(conn->head + i) % conn->size];
+        }
+        free(conn->queue);
+        conn->queue = queue;
+        conn->head = 0;
+        conn->size = new_size;
+    }
+    conn->queue[(conn->head + conn->count) % conn->size] = request;
+    ++conn->count;
+    return 0;
+}
+
+static int
+put(Buffer *buf, const char* const data, const size_t len)
+{
+    if (reserve(buf, len) == -1) return -1;
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+static int
+put_field(Buffer *buf, const char* const data, const size_t len)
+{
+    char lenbuf[FIELDLEN_MSGLEN];
+
+    bel_put_fieldlen(lenbuf, len);
+    if (put(buf, lenbuf, FIELDLEN_MSGLEN) == -1) return -1;
+    return put(buf, data, len);
+}
+
+/*
+ * Makes room for <len> more bytes at the end of <buf>, plus one that
+ * parse_field() can borrow for a terminator, moving what was already consumed
+ * out of the way first.
+ * Returns 0 on success, -1 on failure
+ */
+static int
+reserve(Buffer *buf, const size_t len)
+{
+    size_t new_size;
+    char *data;
+
+    if (buf->off > 0) {
+        memmove(buf->data, buf->data + buf->off, buf->len - buf->off);
+        buf->len -= buf->off;
+        buf->off = 0;
+    }
+    if (buf->len + len < buf->size) return 0;
+    new_size = buf->size == 0 ? RECV_CHUNK : buf->size;
+    while (buf->len + len >= new_size) new_size *= 2;
+    data = realloc(buf->data, new_size);
+    if (data == NULL) return -1;
+    buf->data = data;
+    buf->size = new_size;
+    return 0;
+}
+
+
+int
+bel_async_run(AsyncPool *pool, const int timeout_ms)
+{
+    int i, nfds = 0, ready;
+    Connection *conn;
+
+    for (i = 0; i < pool->no_of_conns; ++i) {
+        conn = pool->conns + i;
+        if (conn->fd == -1) continue;
+        pool->fds[nfds].fd = conn->fd;
+        pool->fds[nfds].events = POLLIN;
+        if (conn->out.len > conn->out.off) pool->fds[nfds].events |= POLLOUT;
+        pool->fds[nfds].revents = 0;
+        ++nfds;
+    }
+    if (nfds == 0) return pool->pending;
+    ready = poll(pool->fds, nfds, timeout_ms);
+    if (ready == -1) return errno == EINTR ? pool->pending : -1;
+
+    /* callbacks can open connections: walk the ones that were polled  */
+    for (i = 0; i < nfds && ready > 0; ++i) {
+        if (pool->fds[i].revents == 0) continue;
+        --ready;
+        conn = find_connection(pool, pool->fds[i].fd);
+        if (conn == NULL) continue;
+        if ((pool->fds[i].revents & POLLOUT) && flush(conn) == -1) {
+            fail_connection(pool, conn, ASYNC_ERROR);
+            continue;
+        }
+        if (pool->fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+            receive(pool, conn);
+        }
+    }
+    return pool->pending;
+}
+
+int
+bel_async_pending(const AsyncPool* const pool)
+{
+    return pool->pending;
+}
+
+static Connection*
+find_connection(AsyncPool *pool, const int fd)
+{
+    int i;
+
+    for (i = 0; i < pool->no_of_conns; ++i) {
+        if (pool->conns[i].fd == fd) return pool->conns + i;
+    }
+    return NULL;
+}
+
+
+/*
+ * Sends as much of the output of <conn> as the socket takes.
+ * Returns 0 on success (including when the socket is full), -1 on failure
+ */
+static int
+flush(Connection *conn)
+{
+    ssize_t sent;
+    Buffer *out = &conn->out;
+
+    while (out->off < out->len) {
+        sent = send(conn->fd, out->data + out->off, out->len - out->off,
+                MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        out->off += sent;
+    }
+    out->off = out->len = 0;
+    return 0;
+}
+
+/*
+ * Reads whatever arrived on <conn> and dispatches the answers that are
+ * complete. Fails the connection when it is over.
+ * Returns 0 if the connection is still open, -1 otherwise
+ */
+static int
+receive(AsyncPool *pool, Connection *conn)
+{
+    ssize_t received;
+    int closed = 0;
+
+    for (;;) {
+        if (reserve(&conn->in, RECV_CHUNK) == -1) {
+            closed = 1;
+            break;
+        }
+        received = recv(conn->fd, conn->in.data + conn->in.len, RECV_CHUNK,
+                0);
+        if (received == -1 && errno == EINTR) continue;
+        if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (received <= 0) {
+            closed = 1;
+            break;
+        }
+        conn->in.len += received;
+        if (received < RECV_CHUNK) break;
+    }
+    dispatch_replies(pool, conn);
+    if (conn->fd == -1) return -1;  /* a failed login closed it already  */
+    if (closed) {
+        fail_connection(pool, conn, ASYNC_ERROR);
+        return -1;
+    }
+    return 0;
+}
+
+/* Hands every complete answer in the input of <conn> to its callback  */
+static void
+dispatch_replies(AsyncPool *pool, Connection *conn)
+{
+    size_t used;
+    char *end, saved = '\0';
+    Request request;
+    AsyncReply reply;
+    Buffer *in = &conn->in;
+
+    while (conn->count > 0) {
+        request = conn->queue[conn->head];
+        reply = empty_async_reply;
+        used = parse_reply(request.kind, in->data + in->off,
+                in->len - in->off, &reply);
+        if (used == 0) return;
+        conn->head = (conn->head + 1) % conn->size;
+        --conn->count;
+        if (request.kind == REQ_LOGIN) {
+            in->off += used;
+            if (reply.status != ASYNC_OK) {
+                fail_connection(pool, conn, reply.status);
+                return;
+            }
+            continue;
+        }
+        --pool->pending;
+
+        /*
+         * <reply.data> points into the input, and is followed by the next
+         * answer, if any: borrow its first byte for the terminator (reserve()
+         * keeps one spare at the end of the buffer, for the last answer)
+         */
+        end = reply.data == NULL ? NULL : in->data + in->off + used;
+        if (end != NULL) {
+            saved = *end;
+            *end = '\0';
+        }
+        request.callback(&reply, request.arg);
+        if (end != NULL) *end = saved;
+        in->off += used;
+    }
+}
+
+/*
+ * Parses the answer to a request of kind <kind> at the start of <buf>, which
+ * holds <len> bytes, into <reply>.
+ * Returns the length of the answer, or 0 if it did not all arrive yet
+ */
+static size_t
+parse_reply(const int kind, char *buf, const size_t len, AsyncReply *reply)
+{
+    size_t used;
+
+    if (len < ANSWER_MSGLEN) return 0;
+    reply->status = answer_status(buf);
+    if (reply->status != ASYNC_OK || kind == REQ_LOGIN) return ANSWER_MSGLEN;
+    switch (kind) {
+    case REQ_READ:
+    case REQ_STATS:
+        return parse_field(buf, len, ANSWER_MSGLEN, reply);
+    case REQ_DELETE:
+        /* the list is meant for humans choosing what to delete  */
+        used = parse_field(buf, len, ANSWER_MSGLEN, reply);
+        if (used == 0) return 0;
+        reply->data = NULL;
+        reply->len = 0;
+        break;
+    default:
+        used = ANSWER_MSGLEN;
+    }
+    if (len < used + ANSWER_MSGLEN) return 0;
+    reply->status = answer_status(buf + used);
+    return used + ANSWER_MSGLEN;
+}
+
+/*
+ * Parses the variable-length field at offset <off> of <buf> into the data of
+ * <reply>.
+ * Returns the offset past the field, or 0 if it did not all arrive yet
+ */
+static size_t
+parse_field(char *buf, const size_t len, const size_t off, AsyncReply *reply)
+{
+    unsigned long field_len;
+    const unsigned char *lenbuf = (const unsigned char*) buf + off;
+
+    if (len < off + FIELDLEN_MSGLEN) return 0;
+    field_len = (unsigned long) lenbuf[0] << 24 | (unsigned long) lenbuf[1] << 16
+            | (unsigned long) lenbuf[2] << 8 | lenbuf[3];
+    if (len - off - FIELDLEN_MSGLEN < field_len) return 0;
+    reply->data = buf + off + FIELDLEN_MSGLEN;
+    reply->len = field_len;
+    return off + FIELDLEN_MSGLEN + field_len;
+}
+
+static int
+answer_status(const char* const answer)
+{
+    if (strncmp(answer, ANSWER_OK, ANSWER_MSGLEN) == 0) return ASYNC_OK;
+    if (strncmp(answer, ANSWER_THROTTLED, ANSWER_MSGLEN) == 0) {
+        return ASYNC_THROTTLED;
+    }
+    if (strncmp(answer, ANSWER_BUSY, ANSWER_MSGLEN) == 0) return ASYNC_BUSY;
+    return ASYNC_KO;
+}
@@ -0,0 +1,93 @@
+#ifndef BELASYNC_H_INCLUDED
+#define BELASYNC_H_INCLUDED
+
+#include "bel_common.h"
+#include <stddef.h>
+
+
+/*
+ * Asynchronous client library (libbel). A pool keeps a few authenticated
+ * connections to a server; requests are queued on the least busy one and
+ * pipelined, and never block: their outcome is handed to a callback, from
+ * bel_async_run(), once the answer has arrived. A single thread can thus keep
+ * many requests in flight without one connection, or one thread, each.
+ *
+ * Unlike the rest of the code base, nothing in here exits the process: errors
+ * are returned, with errno set, or reported to the callbacks
+ */
+
+
+/* Outcomes of a request  */
+#define ASYNC_OK         0
+#define ASYNC_KO         1     /* refused by the server  */
+#define ASYNC_THROTTLED  2     /* refused by rate limiting  */
+#define ASYNC_BUSY       3     /* the server had no room for the connection  */
+#define ASYNC_ERROR     -1     /* the connection failed before the answer  */
+
+
+typedef struct AsyncPool AsyncPool;
+
+/*
+ * What a callback gets. <data> is the message list of a read or the report
+ * of a stats request, '\0'-terminated, and only lives until the callback
+ * returns; it is NULL for the other requests and for failed ones
+ */
+typedef struct {
+    int status;         /* one of the ASYNC_* above  */
+    const char *data;
+    size_t len;
+} AsyncReply;
+static const AsyncReply empty_async_reply;
+
+/*
+ * Called once per request with its outcome and the <arg> it was submitted
+ * with. Callbacks can submit further requests, but must not close the pool
+ */
+typedef void (*AsyncCallback)(const AsyncReply* const reply, void *arg);
+
+
+/*
+ * Opens a pool of <connections> connections to the server at <address> and
+ * <port> (<address> can also be the path of a local socket), logging in with
+ * the given credentials. Logins are pipelined like any request: wrong
+ * credentials are reported to the requests queued behind them.
+ * Returns NULL if the pool could not be set up or no connection could be
+ * opened
+ */
+extern AsyncPool* bel_async_open(const char* const address, const u_short port,
+        const char* const uname, const char* const pword,
+        const int connections);
+
+/*
+ * Closes all the connections of <pool> and frees it. Requests still pending
+ * are dropped, without calling their callbacks
+ */
+extern void bel_async_close(AsyncPool *pool);
+
+/*
+ * Queue a request. A failed connection is opened again when a request needs
+ * it. Return 0 on success, -1 if the request could not be queued (no memory,
+ * no connection, invalid arguments)
+ */
+extern int bel_async_read(AsyncPool *pool, AsyncCallback callback, void *arg);
+extern int bel_async_stats(AsyncPool *pool, AsyncCallback callback, void *arg);
+extern int bel_async_delete(AsyncPool *pool, const unsigned long id,
+        AsyncCallback callback, void *arg);
+
+/* A message living <ttl> seconds, or for ever if <ttl> is 0  */
+extern int bel_async_send(AsyncPool *pool,
+        const char* const subject, const size_t subject_len,
+        const char* const body, const size_t body_len, const unsigned long ttl,
+        AsyncCallback callback, void *arg);
+
+/*
+ * Sends what is queued and dispatches the answers that arrived, waiting up to
+ * <timeout_ms> milliseconds (-1: for ever) for something to happen.
+ * Returns the number of requests still pending, or -1 on error
+ */
+extern int bel_async_run(AsyncPool *pool, const int timeout_ms);
+
+/* Returns the number of requests still waiting for their answer  */
+extern int bel_async_pending(const AsyncPool* const pool);
+
+#endif	/* BELASYNC_H_INCLUDED */
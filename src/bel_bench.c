@@ -0,0 +1,366 @@
+/*
+ * bel_bench.c - Load generator and latency benchmark for bel_server
+ *
+ * General considerations:
+ * - every connection is driven by its own process, which authenticates and
+ *      then issues a random mix of READ, SEND and DELETE commands until time
+ *      is up
+ * - with a target rate, commands are scheduled at fixed intervals and
+ *      latency is measured from the scheduled time rather than from the
+ *      actual send, so that a stalling server is not under-reported
+ * - with channels, connections are spread among them in turn, so that the
+ *      load can be compared with the same load on a single board
+ * - latencies go into histograms shared among all the processes, which the
+ *      parent summarizes at the end
+ */
+
+#include "bel_arena.h"
+#include "bel_common.h"
+#include "bel_loadgen.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define NO_OF_OPS 3
+#define OP_READ     0
+#define OP_SEND     1
+#define OP_DELETE   2
+
+#define NS_PER_SEC 1000000000UL
+
+
+/* Settings coming from the command line  */
+typedef struct {
+    int connections;
+    double duration;        /* seconds  */
+    double rate;            /* commands per second, all connections; 0: max  */
+    int mix[NO_OF_OPS];     /* relative weight of each command  */
+    int mix_total;
+    size_t text_len;        /* length of the subject and body of SENDs  */
+    int channels;           /* to spread connections on, 0 for the default */
+    const char *uname;
+    const char *pword;
+    const char *address;
+    u_short port;
+} Config;
+
+
+static void parse_options_or_die(int, char**);
+static void parse_mix_or_die(const char*);
+static void usage_and_die(void);
+
+static void run_connection(const int);
+static void authenticate_or_die(void);
+static void select_channel_or_die(const int);
+static int pick_op(void);
+
+static int do_read(void);
+static int do_send(void);
+static int do_delete(void);
+static unsigned long find_own_message(const char*, const size_t);
+static int ok_from_server(void);
+
+
+static const char* const op_names[NO_OF_OPS] = {"READ", "SEND", "DELETE"};
+
+static Config config;
+static LoadResults *results;
+
+/* Per-process state of a connection  */
+static int sockfd;
+static Arena arena;
+static char *text;      /* subject and body of SENDs  */
+
+
+/* Benchmark entry point  */
+int
+main(int argc, char **argv)
+{
+    int i, failed = 0, status;
+    unsigned long start;
+
+    parse_options_or_die(argc, argv);
+    results = bel_loadgen_map_results_or_die();
+    printf("benchmarking %s: %d connections, %.1f s, rate %s, mix %d:%d:%d\n",
+            config.address, config.connections, config.duration,
+            config.rate > 0 ? "limited" : "unlimited",
+            config.mix[OP_READ], config.mix[OP_SEND], config.mix[OP_DELETE]);
+    fflush(stdout);
+
+    start = bel_clock_ns();
+    for (i = 0; i < config.connections; ++i) {
+        switch (fork()) {
+        case -1:
+            perror("[FATAL] fork()");
+            exit(EXIT_FAILURE);
+        case 0:
+            run_connection(i);
+            exit(EXIT_SUCCESS);
+        default:
+            break;
+        }
+    }
+    for (i = 0; i < config.connections; ++i) {
+        if (wait(&status) == -1) break;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            ++failed;
+        }
+    }
+    bel_loadgen_print_report(results, op_names, NO_OF_OPS, 0, failed,
+            (double) (bel_clock_ns() - start) / NS_PER_SEC);
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/* Fills the global configuration from the command line options  */
+static void
+parse_options_or_die(int argc, char **argv)
+{
+    int opt;
+
+    config.connections = 4;
+    config.duration = 10.0;
+    config.rate = 0.0;
+    parse_mix_or_die("80:15:5");
+    config.text_len = 64;
+    config.uname = "test";
+    config.pword = "test1234";
+    config.port = COMM_PORT;
+    while ((opt = getopt(argc, argv, "c:C:d:r:m:t:u:p:P:")) != -1) {
+        switch (opt) {
+        case 'c': config.connections = atoi(optarg);            break;
+        case 'C': config.channels = atoi(optarg);               break;
+        case 'd': config.duration = atof(optarg);               break;
+        case 'r': config.rate = atof(optarg);                   break;
+        case 'm': parse_mix_or_die(optarg);                     break;
+        case 't': config.text_len = strtoul(optarg, NULL, 10);  break;
+        case 'u': config.uname = optarg;                        break;
+        case 'p': config.pword = optarg;                        break;
+        case 'P': config.port = atoi(optarg);                   break;
+        default:  usage_and_die();
+        }
+    }
+    if (optind != argc - 1 || config.connections < 1 || config.port == 0
+            || config.channels < 0
+            || config.duration <= 0 || config.rate < 0
+            || config.text_len > TXT_MAXLEN_LIMIT
+            || strlen(config.uname) >= UNAME_MSGLEN
+            || strlen(config.pword) >= PWORD_MSGLEN) {
+        usage_and_die();
+    }
+    config.address = argv[optind];
+}
+
+/* Parses a "<read>:<send>:<delete>" weight specification  */
+static void
+parse_mix_or_die(const char *spec)
+{
+    int i;
+
+    if (sscanf(spec, "%d:%d:%d", &config.mix[OP_READ], &config.mix[OP_SEND],
+            &config.mix[OP_DELETE]) != NO_OF_OPS) {
+        usage_and_die();
+    }
+    config.mix_total = 0;
+    for (i = 0; i < NO_OF_OPS; ++i) {
+        if (config.mix[i] < 0) usage_and_die();
+        config.mix_total += config.mix[i];
+    }
+    if (config.mix_total == 0) usage_and_die();
+}
+
+static void
+usage_and_die(void)
+{
+    printf("usage: bench [options] <remote address or local socket path>\n"
+            "  -c  number of concurrent connections (default 4)\n"
+            "  -C  number of channels to spread the connections on, named\n"
+            "      bench0, bench1 and so on (default 0: the default one)\n"
+            "  -d  duration of the run, in seconds (default 10)\n"
+            "  -r  target rate in commands per second, across all the\n"
+            "      connections (default 0: as fast as possible)\n");
+    printf("  -m  READ:SEND:DELETE weights of the command mix"
+            " (default 80:15:5)\n"
+            "  -t  length of subjects and bodies sent (default 64)\n"
+            "  -u  user name (default test)\n"
+            "  -p  password (default test1234)\n"
+            "  -P  port of the server (default %d)\n", COMM_PORT);
+    exit(EXIT_FAILURE);
+}
+
+
+/*
+ * Body of the <conn_no>-th connection process. Its standard output is thrown
+ * away, since it would be flooded by the traces of bel_common
+ */
+static void
+run_connection(const int conn_no)
+{
+    int op, ok;
+    unsigned long now, begin, next, deadline, interval = 0;
+
+    if (freopen("/dev/null", "w", stdout) == NULL) {
+        perror("[FATAL] freopen()");
+        exit(EXIT_FAILURE);
+    }
+    srand(getpid() ^ (unsigned) time(NULL));
+    bel_arena_init_or_die(&arena, ARENA_BLOCK_SIZE);
+    text = malloc(config.text_len);
+    if (text == NULL) {
+        perror("[FATAL] malloc()");
+        exit(EXIT_FAILURE);
+    }
+    memset(text, 'a' + conn_no % 26, config.text_len);
+
+    sockfd = bel_connect_or_die(config.address, config.port);
+    authenticate_or_die();
+    if (config.channels > 0) select_channel_or_die(conn_no % config.channels);
+
+    if (config.rate > 0) {
+        interval = config.connections * NS_PER_SEC / config.rate;
+    }
+    now = bel_clock_ns();
+    deadline = now + (unsigned long) (config.duration * NS_PER_SEC);
+    for (next = now; now < deadline; now = bel_clock_ns()) {
+        if (interval > 0) {
+            bel_loadgen_sleep_until(next);
+            begin = next;
+            next += interval;
+        } else {
+            begin = now;
+        }
+        op = pick_op();
+        switch (op) {
+        case OP_READ:   ok = do_read();     break;
+        case OP_SEND:   ok = do_send();     break;
+        default:        ok = do_delete();   break;
+        }
+        bel_hist_record(&results->latency[op], bel_clock_ns() - begin);
+        if (!ok) __sync_fetch_and_add(&results->ko[op], 1UL);
+        bel_arena_reset(&arena);
+    }
+    bel_close_or_die(sockfd);
+}
+
+static void
+authenticate_or_die(void)
+{
+    char uname[UNAME_MSGLEN] = "", pword[PWORD_MSGLEN] = "";
+
+    strcpy(uname, config.uname);
+    strcpy(pword, config.pword);
+    bel_sendall_or_die(sockfd, uname, UNAME_MSGLEN);
+    bel_sendall_or_die(sockfd, pword, PWORD_MSGLEN);
+    if (!ok_from_server()) {
+        fprintf(stderr, "[FATAL] authentication failed\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Moves the connection to the channel bench<index>  */
+static void
+select_channel_or_die(const int index)
+{
+    char name[CHANNEL_MSGLEN] = "";
+
+    sprintf(name, "bench%d", index);
+    bel_sendall_or_die(sockfd, CMD_CHANNEL, CMD_MSGLEN);
+    if (ok_from_server()) {
+        bel_sendall_or_die(sockfd, name, CHANNEL_MSGLEN);
+        if (ok_from_server()) return;
+    }
+    fprintf(stderr, "[FATAL] cannot select channel '%s'\n", name);
+    exit(EXIT_FAILURE);
+}
+
+/* Picks a random command, according to the weights of the mix  */
+static int
+pick_op(void)
+{
+    int op, roll;
+
+    roll = rand() % config.mix_total;
+    for (op = 0; op < NO_OF_OPS - 1; ++op) {
+        if (roll < config.mix[op]) break;
+        roll -= config.mix[op];
+    }
+    return op;
+}
+
+static int
+do_read(void)
+{
+    size_t len;
+
+    bel_sendall_or_die(sockfd, CMD_READ, CMD_MSGLEN);
+    if (!ok_from_server()) return 0;
+    return bel_recvfield_or_die(sockfd, &arena, MSG_LIST_MAXLEN, &len)
+            != NULL;
+}
+
+static int
+do_send(void)
+{
+    bel_sendall_or_die(sockfd, CMD_SEND, CMD_MSGLEN);
+    if (!ok_from_server()) return 0;
+    bel_sendfield_or_die(sockfd, text, config.text_len);
+    bel_sendfield_or_die(sockfd, text, config.text_len);
+    return ok_from_server();
+}
+
+/* Deletes one of our own messages among the listed ones, if any  */
+static int
+do_delete(void)
+{
+    char *list;
+    size_t len;
+    char id_buf[ID_MSGLEN] = "";
+
+    bel_sendall_or_die(sockfd, CMD_DELETE, CMD_MSGLEN);
+    if (!ok_from_server()) return 0;
+    list = bel_recvfield_or_die(sockfd, &arena, MSG_LIST_MAXLEN, &len);
+    sprintf(id_buf, "%lu", list != NULL ? find_own_message(list, len) : 0);
+    bel_sendall_or_die(sockfd, id_buf, ID_MSGLEN);
+    return ok_from_server();
+}
+
+/*
+ * Looks for a "[<id>] <from>" line with our user name in a message list.
+ * Returns the ID of the first message found, or 0 if there is none
+ */
+static unsigned long
+find_own_message(const char *list, const size_t len)
+{
+    const char *ptr, *end, *from;
+    char *id_end;
+    unsigned long id;
+    size_t uname_len;
+
+    uname_len = strlen(config.uname);
+    end = list + len;
+    for (ptr = list; ptr < end && *ptr == '['; ) {
+        id = strtoul(ptr + 1, &id_end, 10);
+        from = id_end + 2;  /* skip "] "  */
+        if (from + uname_len < end && from[uname_len] == '\n'
+                && strncmp(from, config.uname, uname_len) == 0) {
+            return id;
+        }
+        ptr = strstr(from, "\n\n");     /* the list is '\0'-terminated  */
+        if (ptr == NULL) break;
+        ptr += 2;
+    }
+    return 0;
+}
+
+static int
+ok_from_server(void)
+{
+    char answer[ANSWER_MSGLEN] = "";
+
+    bel_recvall_or_die(sockfd, answer, ANSWER_MSGLEN);
+    return strcmp(answer, ANSWER_OK) == 0;
+}
@@ -2,22 +2,33 @@
  * bel_client.c - Client part of the OS1 assignment
  *
  * General considerations:
- * - the communication protocol is based on fixed-length messages
+ * - the communication protocol is based on fixed-length messages, except for
+ *      the message text and lists, which are sent as length-prefixed fields
  * - every communication failure or server "KO" answer will shutdown the
  *      program
+ * - in batch mode (-b) commands are read from a file or stdin, one per line,
+ *      and pipelined over a single connection: a child process writes them
+ *      out, in 64KB batches, while the parent reads and prints the answers
+ * - messages with a time to live can only be sent in batch mode
  */
 
+#include "bel_arena.h"
 #include "bel_common.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 
-/* Exact number of the arguments required by the program  */
-#define ARGC_OK 2
+#define NO_OF_MENUITEMS 6
 
-#define NO_OF_MENUITEMS 4
+/* Separator of the fields of a batch command  */
+#define BATCH_SEP '\t'
+
+/* Commands are sent to the server in chunks of this many bytes  */
+#define BATCH_BUFLEN 65536
 
 
 typedef struct {
@@ -36,11 +47,46 @@ typedef struct {
     Action action;
 } MenuItem;
 
+/* Settings coming from the command line  */
+typedef struct {
+    const char *address;
+    u_short port;
+    int batch;
+    const char *username;
+    const char *password;
+    const char *batch_file;     /* NULL for stdin  */
+} Config;
 
-static void connect_to(const char* const, const u_short);
-static int do_connect(struct addrinfo*);
+/*
+ * Last message list received from the server, kept across menu actions so
+ * that reads can be conditional on the board having changed
+ */
+typedef struct {
+    int valid;
+    char version[VERSION_MSGLEN];
+    char *list;         /* malloc()ed  */
+    size_t list_len;
+} BoardCache;
+
+/* What the batch writer tells the reader about every command it has sent  */
+typedef struct {
+    int kind;           /* one of the BATCH_* below  */
+        #define BATCH_READ      0
+        #define BATCH_SEND      1
+        #define BATCH_DELETE    2
+        #define BATCH_STATS     3
+        #define BATCH_SENDEX    4
+        #define BATCH_CHANNEL   5
+    long line;          /* where the command comes from  */
+} BatchItem;
+
+
+static void parse_options_or_die(int, char**);
+static void usage_and_die(void);
 
 static void authenticate(void);
+static void exit_if_server_busy(void);
+static int login_accepted(void);
 static void run_client(void);
 static void show_menu(void);
 static Action read_action_from_user(void);
@@ -48,24 +94,55 @@ static Action read_action_from_user(void);
 static void read_all_messages(void);
 static void send_new_message(void);
 static void delete_message(void);
+static void show_stats(void);
+static void select_channel(void);
 static void user_quit(void);
 
+static void update_cache(const char* const, const char*, const size_t);
 static int ok_from_server(void);
 static void send_user_input_to_server(const char* const, const int);
+static void send_user_text_to_server(const char* const);
+static char* read_user_input(const char* const, const int);
 static void reset_stdin(void);
 
+static int run_batch(void);
+static void authenticate_batch(void);
+static void write_batch_or_die(const int);
+static int parse_batch_line(char*, const long, BatchItem*);
+static void batch_put_or_die(const char* const, const size_t);
+static void batch_put_field_or_die(const char* const, const size_t);
+static void batch_flush_or_die(void);
+static int read_batch_answers(const int);
+static int read_batch_item(const int, BatchItem*);
+
 
 const MenuItem menu[NO_OF_MENUITEMS] = {
         {"read",    "read all messages",            read_all_messages},
         {"send",    "send new message",             send_new_message},
         {"delete",  "deletes a message of yours",   delete_message},
+        {"stats",   "shows server statistics",      show_stats},
+        {"channel", "switches to another channel",  select_channel},
         {"quit",    "quits this program",           user_quit}
         };
 
 
+static Config config;
+
 /* (file descriptor of) the socket used to communicate with server  */
 static int sockfd;
 
+static BoardCache cache;
+
+/* Last answer received by ok_from_server()  */
+static char last_answer[ANSWER_MSGLEN];
+
+/* Commands not yet sent to the server, in batch mode  */
+static char batch_buf[BATCH_BUFLEN];
+static size_t batch_len;
+
+/* Memory for the buffers of a single menu action, reset after each of them  */
+static Arena arena;
+
 
 /*
  * Explicitly closes the resources acquired by the current process. Called on
@@ -76,6 +153,7 @@ cleanup(void)
 {
     printf("[DEBUG] resource cleanup\n");
     if (sockfd != 0) bel_close_or_die(sockfd);
+    free(cache.list);
 }
 
 
@@ -83,65 +161,65 @@ cleanup(void)
 int
 main(int argc, char **argv)
 {    
-    if (argc != ARGC_OK) {
-        printf("usage: client <remote address>\n");
-        exit(EXIT_FAILURE);
-    }
+    parse_options_or_die(argc, argv);
     printf("[INFO] program started with pid = '%ld'\n", (long) getpid());
     atexit(cleanup);
-    connect_to(argv[1], COMM_PORT);
+    bel_arena_init_or_die(&arena, ARENA_BLOCK_SIZE);
+    sockfd = bel_connect_or_die(config.address, config.port);
     printf("connected to server\n");
+    if (config.batch) return run_batch();
     authenticate();
     run_client();
     return EXIT_SUCCESS;
 }
 
 
-/*
- * Gets all the addresses associated to the given ip and port and connects to
- * the first available one
- */
+/* Fills the global configuration from the command line options  */
 static void
-connect_to(const char* const ip, const u_short port)
+parse_options_or_die(int argc, char **argv)
 {
-    int do_connect_res = 0;
-    struct addrinfo *servinfo = NULL, *currinfo = NULL;
-    
-    bel_getaddrinfo_or_die(ip, AF_UNSPEC, port, &servinfo);
-    for(currinfo = servinfo; currinfo != NULL; currinfo = currinfo->ai_next) {
-        do_connect_res = do_connect(currinfo);
-        if (do_connect_res != -1) break;
+    int opt;
+
+    config.port = COMM_PORT;
+    while ((opt = getopt(argc, argv, "bu:p:f:P:")) != -1) {
+        switch (opt) {
+        case 'b': config.batch = 1;             break;
+        case 'u': config.username = optarg;     break;
+        case 'p': config.password = optarg;     break;
+        case 'f': config.batch_file = optarg;   break;
+        case 'P': config.port = atoi(optarg);   break;
+        default:  usage_and_die();
+        }
     }
-    if (currinfo == NULL) {
-        fprintf(stderr, "[FATAL] failed to connect: exiting\n");
-        exit(EXIT_FAILURE);
+    if (optind != argc - 1 || config.port == 0) usage_and_die();
+    config.address = argv[optind];
+    if (config.password == NULL) config.password = getenv("BEL_PASSWORD");
+    if (config.batch && (config.username == NULL || config.password == NULL)) {
+        usage_and_die();
     }
-    freeaddrinfo(servinfo);
 }
 
-/*
- * Performs the actual connection logic: creates a socket and uses it to
- * connect to the specified address.
- * Saves the file descriptor of the newly-created socket into sockfd.
- * Returns the file descriptor, or -1 on error.
- */
-static int
-do_connect(struct addrinfo *ainfo)
+static void
+usage_and_die(void)
 {
-	int connect_res = 0;
-	const char* const conn_msg  = "[INFO] connecting to ";
-    
-    sockfd = bel_new_sock(*ainfo);
-    if (sockfd == -1) return -1;
-    
-    bel_print_address(conn_msg, ainfo->ai_addr);
-    connect_res = connect(sockfd, ainfo->ai_addr, ainfo->ai_addrlen);
-    if (connect_res == -1) {
-        perror("[WARN] connect()");
-        bel_close_or_die(sockfd);
-        return -1;
-    }
-    return sockfd;
+    fprintf(stderr, "usage: client [-P port] [-b -u user [-p password]"
+            " [-f file]] <remote address>\n"
+            "  -P  port of the server (default %d)\n"
+            "  the address can also be the path of the local socket of the\n"
+            "  server (anything with a '/' in it, like ./bel.sock)\n",
+            COMM_PORT);
+    fprintf(stderr, "  -b  batch mode: run the commands in <file> (default stdin),\n"
+            "      one per line, with tab-separated arguments:\n"
+            "          read\n"
+            "          send <subject> <body>\n"
+            "          sendex <seconds to live> <subject> <body>\n"
+            "          delete <id>\n"
+            "          stats\n"
+            "          channel [<name>]     (no name: the default channel)\n"
+            "      empty lines and lines starting with '#' are skipped\n"
+            "  -u  username, for batch mode\n"
+            "  -p  password, for batch mode (default $BEL_PASSWORD)\n");
+    exit(EXIT_FAILURE);
 }
 
 
@@ -152,14 +230,55 @@ do_connect(struct addrinfo *ainfo)
 static void
 authenticate(void)
 {
-    send_user_input_to_server("insert your username", UNAME_MSGLEN);
-    send_user_input_to_server("insert your password", PWORD_MSGLEN);
-    if (!ok_from_server()) {
+    char *uname, *pword;
+
+    uname = read_user_input("insert your username", UNAME_MSGLEN);
+    pword = read_user_input("insert your password", PWORD_MSGLEN);
+    exit_if_server_busy();
+    bel_sendall_or_die(sockfd, uname, UNAME_MSGLEN);
+    bel_sendall_or_die(sockfd, pword, PWORD_MSGLEN);
+    if (!login_accepted()) {
         printf("wrong username and/or password: exiting\n");
         exit(EXIT_SUCCESS);
     }
 }
 
+/*
+ * A full server turns connections away as soon as it accepts them, without
+ * waiting for the credentials: checks for that answer, if it already came,
+ * so that we do not write to a closed connection. Exits if the server is busy
+ */
+static void
+exit_if_server_busy(void)
+{
+    char answer[ANSWER_MSGLEN] = "";
+
+    if (recv(sockfd, answer, ANSWER_MSGLEN, MSG_PEEK | MSG_DONTWAIT)
+                == ANSWER_MSGLEN
+            && strcmp(answer, ANSWER_BUSY) == 0) {
+        fprintf(stderr, "server busy, try again later: exiting\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Waits for the answer to the credentials just sent. Exits if the server is
+ * too busy to serve us.
+ * Returns 1 (true) if the login succeeded, 0 (false) otherwise
+ */
+static int
+login_accepted(void)
+{
+    char answer[ANSWER_MSGLEN] = "";
+
+    bel_recvall_or_die(sockfd, answer, ANSWER_MSGLEN);
+    if (strcmp(answer, ANSWER_BUSY) == 0) {
+        fprintf(stderr, "server busy, try again later: exiting\n");
+        exit(EXIT_FAILURE);
+    }
+    return strcmp(answer, ANSWER_OK) == 0;
+}
+
 
 /* Actual business logic of the client  */
 static void
@@ -176,6 +295,7 @@ run_client(void)
         } else {
             menu_action();
         }
+        bel_arena_reset(&arena);
     }
 }
 
@@ -209,20 +329,61 @@ read_action_from_user(void)
 }
 
 
+/*
+ * Shows the messages on the board, downloading them only if the board changed
+ * since the last time
+ */
 static void
 read_all_messages(void)
 {
-    char all_messages[LIST_MSGLEN] = "";
+    char *version, *all_messages;
+    size_t len;
     const char* const no_msgs = "There are no messages to read.\n";
     
     printf("[TRACE] inside read_all_messages\n");
-    bel_sendall_or_die(sockfd, CMD_READ, CMD_MSGLEN);
+    bel_sendall_or_die(sockfd, CMD_READIF, CMD_MSGLEN);
     if(!ok_from_server()) {
         printf("KO answer from server: cannot read");
         return;
     }
-    bel_recvall_or_die(sockfd, all_messages, LIST_MSGLEN);
-    printf("%s", strcmp("", all_messages) != 0 ? all_messages : no_msgs);
+    version = bel_arena_zalloc_or_die(&arena, VERSION_MSGLEN);
+    if (cache.valid) strcpy(version, cache.version);
+    bel_sendall_or_die(sockfd, version, VERSION_MSGLEN);
+    if (!ok_from_server()
+            && strcmp(last_answer, ANSWER_NOT_MODIFIED) == 0) {
+        printf("[DEBUG] board not modified, using cached copy\n");
+    } else if (strcmp(last_answer, ANSWER_OK) == 0) {
+        bel_recvall_or_die(sockfd, version, VERSION_MSGLEN);
+        all_messages =
+                bel_recvfield_or_die(sockfd, &arena, MSG_LIST_MAXLEN, &len);
+        if (all_messages == NULL) {
+            printf("Message list too long: discarded\n");
+            return;
+        }
+        update_cache(version, all_messages, len);
+    } else {
+        printf("KO answer from server: cannot read");
+        return;
+    }
+    printf("%s", cache.list_len > 0 ? cache.list : no_msgs);
+}
+
+/* Replaces the cached message list with <list>, at the given version  */
+static void
+update_cache(const char* const version, const char *list, const size_t len)
+{
+    char *copy;
+
+    copy = realloc(cache.list, len + 1);
+    if (copy == NULL) {
+        perror("[FATAL] realloc()");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(copy, list, len + 1);    /* fields come '\0'-terminated  */
+    cache.list = copy;
+    cache.list_len = len;
+    strcpy(cache.version, version);
+    cache.valid = 1;
 }
 
 static void
@@ -234,8 +395,8 @@ send_new_message(void)
         printf("KO answer from server: cannot send");
         return;
     }
-    send_user_input_to_server("Subject", TXT_MSGLEN);
-    send_user_input_to_server("Body", TXT_MSGLEN);
+    send_user_text_to_server("Subject");
+    send_user_text_to_server("Body");
     printf(ok_from_server()
             ? "Message was successfully saved\n"
             : "Could not save the message\n");
@@ -244,7 +405,8 @@ send_new_message(void)
 static void
 delete_message(void)
 {
-    char messages[LIST_MSGLEN] = "";
+    char *messages;
+    size_t len;
     
     printf("[TRACE] inside delete_message\n");
     bel_sendall_or_die(sockfd, CMD_DELETE, CMD_MSGLEN);
@@ -252,8 +414,8 @@ delete_message(void)
         printf("KO answer from server: cannot delete");
         return;
     }
-    bel_recvall_or_die(sockfd, messages, LIST_MSGLEN);
-    printf("%s", messages);
+    messages = bel_recvfield_or_die(sockfd, &arena, MSG_LIST_MAXLEN, &len);
+    printf("%s", messages != NULL ? messages : "Message list too long\n");
     send_user_input_to_server(
             "Enter the ID of the message to delete", ID_MSGLEN);
     printf(ok_from_server()
@@ -261,6 +423,43 @@ delete_message(void)
             : "Message was NOT deleted. Are you authorized?\n");
 }
 
+static void
+show_stats(void)
+{
+    char *stats;
+    size_t len;
+    
+    printf("[TRACE] inside show_stats\n");
+    bel_sendall_or_die(sockfd, CMD_STATS, CMD_MSGLEN);
+    if(!ok_from_server()) {
+        printf("KO answer from server: cannot get statistics");
+        return;
+    }
+    stats = bel_recvfield_or_die(sockfd, &arena, STATS_MSGLEN, &len);
+    printf("%s", stats != NULL ? stats : "Statistics too long\n");
+}
+
+/* Makes the commands that follow work on the channel chosen by the user  */
+static void
+select_channel(void)
+{
+    printf("[TRACE] inside select_channel\n");
+    bel_sendall_or_die(sockfd, CMD_CHANNEL, CMD_MSGLEN);
+    if(!ok_from_server()) {
+        printf("KO answer from server: cannot switch channel");
+        return;
+    }
+    send_user_input_to_server(
+            "Enter the channel, or nothing for the default one",
+            CHANNEL_MSGLEN);
+    if (!ok_from_server()) {
+        printf("Could not switch channel. Is the name valid?\n");
+        return;
+    }
+    cache.valid = 0;    /* versions of different channels do not compare  */
+    printf("Switched channel\n");
+}
+
 static void
 user_quit(void)
 {
@@ -270,44 +469,59 @@ user_quit(void)
 
 
 /*
- * Waits for an answer from the server. Returns 1 for a positive answer ("OK")
- * and 0 for a negative one (should be "KO", but does not check for it)
+ * Waits for an answer from the server, and keeps it in <last_answer>.
+ * Returns 1 for a positive answer ("OK") and 0 for a negative one (should be
+ * "KO" or "TH", but does not check for it)
  */
 static int
 ok_from_server(void)
 {
-    char answer[ANSWER_MSGLEN] = "";
-    
-    bel_recvall_or_die(sockfd, answer, ANSWER_MSGLEN);
-    return strcmp(answer, ANSWER_OK) == 0;
+    bel_recvall_or_die(sockfd, last_answer, ANSWER_MSGLEN);
+    if (strcmp(last_answer, ANSWER_THROTTLED) == 0) {
+        printf("Too many requests: the server refused this one, slow down\n");
+    }
+    return strcmp(last_answer, ANSWER_OK) == 0;
 }
 
 
 /*
- * Prompts the user with the given message plus a size indication, then reads
- * at most <msglen> bytes from stdin until it encounters a newline character
- * ('\n'), and finally removes it and sends the result to the server
+ * Prompts the user for a fixed-length message, and sends it to the server
+ * padded to <buf_len> bytes
  */
 static void
 send_user_input_to_server(const char* const prompt_msg, const int buf_len)
+{
+    bel_sendall_or_die(sockfd, read_user_input(prompt_msg, buf_len), buf_len);
+}
+
+/* Prompts the user for a subject or body, and sends it to the server  */
+static void
+send_user_text_to_server(const char* const prompt_msg)
+{
+    char *input_buf;
+
+    input_buf = read_user_input(prompt_msg, TXT_MAXLEN_LIMIT + 1);
+    bel_sendfield_or_die(sockfd, input_buf, strlen(input_buf));
+}
+
+/*
+ * Prompts the user with the given message plus a size indication, then reads
+ * at most <buf_len> - 1 bytes from stdin until it encounters a newline
+ * character ('\n'), and finally removes it.
+ * Returns the zero-padded input, in a buffer of <buf_len> bytes
+ */
+static char*
+read_user_input(const char* const prompt_msg, const int buf_len)
 {
     char *input_buf = NULL;
-    char *full_template;
-    const char* const size_template = " (max %d characters): ";
         
-    full_template = bel_concat(prompt_msg, size_template);
-    printf(full_template, buf_len - 1); /* -1 for '\0'  */
-    free(full_template);
-
-    input_buf = calloc(buf_len + 1, 1); /* +1 for '\n'  */
-    if (input_buf == NULL) {
-        perror("[FATAL] calloc()");
-        exit(EXIT_FAILURE);
+    printf("%s (max %d characters): ", prompt_msg, buf_len - 1); /* '\0'  */
+    input_buf = bel_arena_zalloc_or_die(&arena, buf_len + 1); /* +1 for \n  */
+    if (fgets(input_buf, buf_len + 1, stdin) != NULL) {
+        bel_chop_newline(input_buf);
     }
-    bel_chop_newline(fgets(input_buf, buf_len + 1, stdin));
     reset_stdin();
-    bel_sendall_or_die(sockfd, input_buf, buf_len);
-    free(input_buf);
+    return input_buf;
 }
 
 
@@ -320,3 +534,275 @@ reset_stdin(void)
 {
     fseek(stdin, 0, SEEK_END);
 }
+
+
+/*
+ * Runs the batch of commands over the current connection. The commands are
+ * pipelined: a child process parses and sends them without waiting for the
+ * answers, and for every command sent tells this process what to expect
+ * through a pipe.
+ * Returns the exit status of the program: failure if any command could not
+ * be parsed or got a negative answer
+ */
+static int
+run_batch(void)
+{
+    int fds[2], status, failures;
+    pid_t writer;
+
+    authenticate_batch();
+    if (pipe(fds) == -1) {
+        perror("[FATAL] pipe()");
+        exit(EXIT_FAILURE);
+    }
+    fflush(stdout);     /* or the writer would print it again  */
+    writer = fork();
+    switch (writer) {
+    case -1:
+        perror("[FATAL] fork()");
+        exit(EXIT_FAILURE);
+    case 0:
+        bel_close_or_die(fds[0]);
+        write_batch_or_die(fds[1]);     /* never returns  */
+    }
+    bel_close_or_die(fds[1]);
+    failures = read_batch_answers(fds[0]);
+    bel_close_or_die(fds[0]);
+    if (waitpid(writer, &status, 0) == -1 || !WIFEXITED(status)
+            || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        ++failures;
+    }
+    printf("[INFO] batch completed with '%d' failures\n", failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Sends the credentials given on the command line. Exits if they are wrong  */
+static void
+authenticate_batch(void)
+{
+    char *uname, *pword;
+
+    if (strlen(config.username) >= UNAME_MSGLEN
+            || strlen(config.password) >= PWORD_MSGLEN) {
+        fprintf(stderr, "[ERROR] username or password too long\n");
+        exit(EXIT_FAILURE);
+    }
+    uname = bel_arena_zalloc_or_die(&arena, UNAME_MSGLEN);
+    pword = bel_arena_zalloc_or_die(&arena, PWORD_MSGLEN);
+    strcpy(uname, config.username);
+    strcpy(pword, config.password);
+    exit_if_server_busy();
+    bel_sendall_or_die(sockfd, uname, UNAME_MSGLEN);
+    bel_sendall_or_die(sockfd, pword, PWORD_MSGLEN);
+    if (!login_accepted()) {
+        fprintf(stderr, "[ERROR] wrong username and/or password\n");
+        exit(EXIT_FAILURE);
+    }
+    bel_arena_reset(&arena);
+}
+
+/*
+ * Body of the writer process: sends every command of the batch, reporting it
+ * to <itemfd>, then closes its side of the connection so that the server
+ * knows no more commands are coming. Exits with failure if any line could not
+ * be parsed
+ */
+static void
+write_batch_or_die(const int itemfd)
+{
+    FILE *in = stdin;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t line_len;
+    long line_no = 0;
+    int failed = 0;
+    BatchItem item;
+
+    /* the answers are printed by the parent: keep its output readable  */
+    if (freopen("/dev/null", "w", stdout) == NULL) {
+        perror("[FATAL] freopen()");
+        exit(EXIT_FAILURE);
+    }
+    if (config.batch_file != NULL) {
+        in = fopen(config.batch_file, "r");
+        if (in == NULL) {
+            perror("[FATAL] fopen()");
+            exit(EXIT_FAILURE);
+        }
+    }
+    while ((line_len = getline(&line, &line_size, in)) != -1) {
+        ++line_no;
+        bel_chop_newline(line);
+        if (line[0] == '\0' || line[0] == '#') continue;
+        if (!parse_batch_line(line, line_no, &item)) {
+            failed = 1;
+            continue;
+        }
+        if (write(itemfd, &item, sizeof(item)) != sizeof(item)) {
+            perror("[FATAL] write()");
+            exit(EXIT_FAILURE);
+        }
+    }
+    batch_flush_or_die();
+    if (shutdown(sockfd, SHUT_WR) == -1) perror("[ERROR] shutdown()");
+    free(line);
+    exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/*
+ * Parses a line of the batch and queues the matching request to the server,
+ * filling <item>.
+ * Returns 0 if the line is not a valid command
+ */
+static int
+parse_batch_line(char *line, const long line_no, BatchItem *item)
+{
+    char *args[4] = {NULL, NULL, NULL, NULL};
+    char id[ID_MSGLEN], channel[CHANNEL_MSGLEN];
+    int no_of_args = 0, max_args;
+    char *sep;
+
+    args[no_of_args++] = line;
+    max_args = strncmp(line, "sendex\t", 7) == 0 ? 4 : 3;
+    while ((sep = strchr(args[no_of_args - 1], BATCH_SEP)) != NULL) {
+        if (no_of_args == max_args) break;  /* the body can contain tabs  */
+        *sep = '\0';
+        args[no_of_args++] = sep + 1;
+    }
+    item->line = line_no;
+    if (strcmp(args[0], "read") == 0 && no_of_args == 1) {
+        item->kind = BATCH_READ;
+        batch_put_or_die(CMD_READ, CMD_MSGLEN);
+    } else if (strcmp(args[0], "stats") == 0 && no_of_args == 1) {
+        item->kind = BATCH_STATS;
+        batch_put_or_die(CMD_STATS, CMD_MSGLEN);
+    } else if (strcmp(args[0], "send") == 0 && no_of_args == 3
+            && strlen(args[1]) <= TXT_MAXLEN_LIMIT
+            && strlen(args[2]) <= TXT_MAXLEN_LIMIT) {
+        item->kind = BATCH_SEND;
+        batch_put_or_die(CMD_SEND, CMD_MSGLEN);
+        batch_put_field_or_die(args[1], strlen(args[1]));
+        batch_put_field_or_die(args[2], strlen(args[2]));
+    } else if (strcmp(args[0], "sendex") == 0 && no_of_args == 4
+            && strlen(args[1]) < ID_MSGLEN
+            && strlen(args[2]) <= TXT_MAXLEN_LIMIT
+            && strlen(args[3]) <= TXT_MAXLEN_LIMIT) {
+        item->kind = BATCH_SENDEX;
+        memset(id, 0, ID_MSGLEN);
+        strcpy(id, args[1]);
+        batch_put_or_die(CMD_SENDEX, CMD_MSGLEN);
+        batch_put_or_die(id, ID_MSGLEN);
+        batch_put_field_or_die(args[2], strlen(args[2]));
+        batch_put_field_or_die(args[3], strlen(args[3]));
+    } else if (strcmp(args[0], "delete") == 0 && no_of_args == 2
+            && strlen(args[1]) < ID_MSGLEN) {
+        item->kind = BATCH_DELETE;
+        memset(id, 0, ID_MSGLEN);
+        strcpy(id, args[1]);
+        batch_put_or_die(CMD_DELETE, CMD_MSGLEN);
+        batch_put_or_die(id, ID_MSGLEN);
+    } else if (strcmp(args[0], "channel") == 0 && no_of_args <= 2
+            && (no_of_args == 1 || strlen(args[1]) < CHANNEL_MSGLEN)) {
+        item->kind = BATCH_CHANNEL;
+        memset(channel, 0, CHANNEL_MSGLEN);
+        if (no_of_args == 2) strcpy(channel, args[1]);
+        batch_put_or_die(CMD_CHANNEL, CMD_MSGLEN);
+        batch_put_or_die(channel, CHANNEL_MSGLEN);
+    } else {
+        fprintf(stderr, "[ERROR] line %ld: invalid command '%s'\n",
+                line_no, args[0]);
+        return 0;
+    }
+    return 1;
+}
+
+/* Queues <len> bytes for the server, sending the queue when it fills up  */
+static void
+batch_put_or_die(const char* const buf, const size_t len)
+{
+    if (batch_len + len > BATCH_BUFLEN) batch_flush_or_die();
+    if (len > BATCH_BUFLEN) {
+        bel_sendall_or_die(sockfd, buf, len);
+        return;
+    }
+    memcpy(batch_buf + batch_len, buf, len);
+    batch_len += len;
+}
+
+static void
+batch_put_field_or_die(const char* const buf, const size_t len)
+{
+    char lenbuf[FIELDLEN_MSGLEN];
+
+    bel_put_fieldlen(lenbuf, len);
+    batch_put_or_die(lenbuf, FIELDLEN_MSGLEN);
+    batch_put_or_die(buf, len);
+}
+
+static void
+batch_flush_or_die(void)
+{
+    if (batch_len > 0) bel_sendall_or_die(sockfd, batch_buf, batch_len);
+    batch_len = 0;
+}
+
+/*
+ * Reads the answer to every command reported on <itemfd>, in order, and
+ * prints it.
+ * Returns the number of negative answers
+ */
+static int
+read_batch_answers(const int itemfd)
+{
+    BatchItem item;
+    char *field;
+    size_t len;
+    int ok, failures = 0;
+    const char* const names[] =
+            {"read", "send", "delete", "stats", "sendex", "channel"};
+
+    while (read_batch_item(itemfd, &item)) {
+        ok = ok_from_server();
+        if (ok) {
+            switch (item.kind) {
+            case BATCH_READ:
+            case BATCH_STATS:
+                field = bel_recvfield_or_die(sockfd, &arena,
+                        item.kind == BATCH_READ ? MSG_LIST_MAXLEN
+                        : STATS_MSGLEN, &len);
+                ok = field != NULL;
+                if (ok) printf("%s", field);
+                break;
+            case BATCH_SEND:
+            case BATCH_SENDEX:
+            case BATCH_CHANNEL:
+                ok = ok_from_server();
+                break;
+            case BATCH_DELETE:
+                /* the list is meant for humans choosing what to delete  */
+                bel_recvfield_or_die(sockfd, &arena, MSG_LIST_MAXLEN, &len);
+                ok = ok_from_server();
+                break;
+            }
+        }
+        printf("[RESULT] line %ld: %s %s\n",
+                item.line, names[item.kind], last_answer);
+        if (!ok) ++failures;
+        bel_arena_reset(&arena);
+    }
+    return failures;
+}
+
+/* Reads the next item from <itemfd>. Returns 0 once the writer is done  */
+static int
+read_batch_item(const int itemfd, BatchItem *item)
+{
+    ssize_t bytes_read;
+
+    bytes_read = read(itemfd, item, sizeof(*item));
+    if (bytes_read == -1) {
+        perror("[FATAL] read()");
+        exit(EXIT_FAILURE);
+    }
+    return bytes_read == sizeof(*item);
+}
@@ -2,23 +2,43 @@
 
 #include "bel_common.h"
 #include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 
 /* Maximum number of characters (digits) a port can have  */
 #define PORT_MAXCHARS 5
 
+/* Discarded fields are read in chunks of this size  */
+#define DISCARD_BUFLEN 4096
+
 
 static struct addrinfo make_hints(const int);
+static int do_connect(struct addrinfo*);
+static int connect_local_or_die(const char* const);
 
 static void* get_inaddr(const struct sockaddr*);
 static const char* afamily_tostring(const int);
 
+static void recv_exactly_or_die(const int, char*, const size_t);
 static ssize_t do_recv_or_die(const int, char*, const size_t);
 static ssize_t do_send_or_die(const int, const char* const, const size_t);
+static void disconnected(const int);
+
+
+/* Where to count the traffic, if anywhere  */
+static unsigned long *bytes_in_counter;
+static unsigned long *bytes_out_counter;
+
+/* Called instead of exiting when a connection is over, if set  */
+static void (*disconnect_handler)(void);
 
 
 void
@@ -81,17 +101,122 @@ make_hints(const int protocol)
 }
 
 
+int
+bel_connect_or_die(const char* const ip, const u_short port)
+{
+    int sockfd = -1;
+    struct addrinfo *servinfo = NULL, *currinfo = NULL;
+    
+    if (strchr(ip, '/') != NULL) return connect_local_or_die(ip);
+    bel_getaddrinfo_or_die(ip, AF_UNSPEC, port, &servinfo);
+    for(currinfo = servinfo; currinfo != NULL; currinfo = currinfo->ai_next) {
+        sockfd = do_connect(currinfo);
+        if (sockfd != -1) break;
+    }
+    if (currinfo == NULL) {
+        fprintf(stderr, "[FATAL] failed to connect: exiting\n");
+        exit(EXIT_FAILURE);
+    }
+    freeaddrinfo(servinfo);
+    
+    /* requests are made of small writes: do not hold them back  */
+    bel_setsockopt_or_die(sockfd, IPPROTO_TCP, TCP_NODELAY, 1);
+    return sockfd;
+}
+
+/*
+ * Performs the actual connection logic: creates a socket and uses it to
+ * connect to the specified address.
+ * Returns the file descriptor of the new socket, or -1 on error.
+ */
+static int
+do_connect(struct addrinfo *ainfo)
+{
+	int sockfd, connect_res = 0;
+	const char* const conn_msg  = "[INFO] connecting to ";
+    
+    sockfd = bel_new_sock(*ainfo);
+    if (sockfd == -1) return -1;
+    
+    bel_print_address(conn_msg, ainfo->ai_addr);
+    connect_res = connect(sockfd, ainfo->ai_addr, ainfo->ai_addrlen);
+    if (connect_res == -1) {
+        perror("[WARN] connect()");
+        bel_close_or_die(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/*
+ * Connects to the local (AF_UNIX) socket at <path>. No Nagle to disable
+ * here: local sockets never hold writes back.
+ * Returns the file descriptor of the connected socket. Exits on failure
+ */
+static int
+connect_local_or_die(const char* const path)
+{
+    int sockfd;
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "[FATAL] socket path too long: '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+    sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd == -1) {
+        perror("[FATAL] socket()");
+        exit(EXIT_FAILURE);
+    }
+    printf("[INFO] connecting to local socket %s\n", path);
+    if (connect(sockfd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        perror("[FATAL] connect()");
+        exit(EXIT_FAILURE);
+    }
+    return sockfd;
+}
+
+
+void
+bel_setsockopt_or_die(
+        const int sockfd, const int level, const int optname, const int value)
+{
+    if (setsockopt(sockfd, level, optname, &value, sizeof(int)) == -1) {
+        perror("[FATAL] setsockopt()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+void
+bel_address_tostring(const struct sockaddr *sa, char *ipstr)
+{
+    const void *in_addr;
+
+    if (sa->sa_family == AF_UNIX) {
+        strcpy(ipstr, "local");
+        return;
+    }
+    in_addr = get_inaddr(sa);
+    if (in_addr == NULL
+            || inet_ntop(sa->sa_family, in_addr, ipstr, INET6_ADDRSTRLEN)
+                    == NULL) {
+        strcpy(ipstr, "?");
+    }
+}
+
+
 void
 bel_print_address(const char* const prefix, const struct sockaddr *sa)
 {
     char ipstr[INET6_ADDRSTRLEN] = "";
-    char *full_template = NULL;
-    const char* const addr_template = "%s address %s\n";
     
-    inet_ntop(sa->sa_family, get_inaddr(sa), ipstr, sizeof(ipstr));
-    full_template = bel_concat(prefix, addr_template);
-    printf(full_template, afamily_tostring(sa->sa_family), ipstr);
-    free(full_template);
+    bel_address_tostring(sa, ipstr);
+    printf("%s%s address %s\n",
+            prefix, afamily_tostring(sa->sa_family), ipstr);
 }
 
 /*
@@ -130,6 +255,7 @@ afamily_tostring(const int afamily)
     switch (afamily) {
     case AF_INET:   return "IPv4";
     case AF_INET6:  return "IPv6";
+    case AF_UNIX:   return "UNIX";
     default:        return "????";
     }
 }
@@ -138,42 +264,101 @@ afamily_tostring(const int afamily)
 void
 bel_recvall_or_die(const int sockfd, char *buf, const size_t len)
 {
-    char *ptr = NULL;
+    printf("[TRACE] bel_recvall_or_die - len = '%lu'\n", (unsigned long) len);
+    recv_exactly_or_die(sockfd, buf, len);
+    buf[len - 1] = '\0';    /* must add the null terminator after reading  */
+    printf("[DEBUG] message received: '%s'\n", buf);
+}
+
+
+void
+bel_set_disconnect_handler(void (*handler)(void))
+{
+    disconnect_handler = handler;
+}
+
+
+void
+bel_set_io_counters(unsigned long *bytes_in, unsigned long *bytes_out)
+{
+    bytes_in_counter = bytes_in;
+    bytes_out_counter = bytes_out;
+}
+
+
+char*
+bel_recvfield_or_die(
+        const int sockfd, Arena *arena, const size_t maxlen, size_t *len)
+{
+    unsigned char lenbuf[FIELDLEN_MSGLEN];
+    char *buf;
+    size_t chunk_len;
+
+    recv_exactly_or_die(sockfd, (char*) lenbuf, FIELDLEN_MSGLEN);
+    *len = (size_t) lenbuf[0] << 24 | (size_t) lenbuf[1] << 16
+            | (size_t) lenbuf[2] << 8 | (size_t) lenbuf[3];
+    printf("[TRACE] bel_recvfield_or_die - len = '%lu', maxlen = '%lu'\n",
+            (unsigned long) *len, (unsigned long) maxlen);
+    if (*len <= maxlen) {
+        buf = bel_arena_alloc_or_die(arena, *len + 1);
+        recv_exactly_or_die(sockfd, buf, *len);
+        buf[*len] = '\0';
+        return buf;
+    }
+
+    fprintf(stderr, "[WARN] discarding field of '%lu' bytes\n",
+            (unsigned long) *len);
+    buf = bel_arena_alloc_or_die(arena, DISCARD_BUFLEN);
+    for (; *len > 0; *len -= chunk_len) {
+        chunk_len = *len < DISCARD_BUFLEN ? *len : DISCARD_BUFLEN;
+        recv_exactly_or_die(sockfd, buf, chunk_len);
+    }
+    return NULL;
+}
+
+/* Reads exactly <len> bytes into <buf>, without adding any terminator  */
+static void
+recv_exactly_or_die(const int sockfd, char *buf, const size_t len)
+{
     size_t  bytes_left = 0;
     ssize_t bytes_read = 0;
     
-    printf("[TRACE] bel_recvall_or_die - buf = '%s', len = '%lu'\n",
-            buf, (unsigned long) len);
-    ptr = buf;
     bytes_left = len;
     while (bytes_left > 0) {
         bytes_read =
-                do_recv_or_die(sockfd, ptr + len - bytes_left, bytes_left);
+                do_recv_or_die(sockfd, buf + len - bytes_left, bytes_left);
         bytes_left -= bytes_read;
     }
-    buf[len - 1] = '\0';    /* must add the null terminator after reading  */
-    printf("[DEBUG] message received: '%s'\n", buf);
 }
 
 /*
- * Performs the recv() system call, and exits the program on failure or
- * disconnection
+ * Performs the recv() system call, and exits the program on failure,
+ * disconnection or timeout (see SO_RCVTIMEO). Calls interrupted by a signal
+ * are retried
  */
 static ssize_t
 do_recv_or_die(const int sockfd, char *buf, const size_t len) {
     ssize_t bytes_read = 0;
     
-    printf("[TRACE] do_recv_or_die - buf = '%s', len = '%lu'\n",
-            buf, (unsigned long) len);
-    bytes_read = recv(sockfd, buf, len, 0);
+    printf("[TRACE] do_recv_or_die - len = '%lu'\n", (unsigned long) len);
+    do {
+        bytes_read = recv(sockfd, buf, len, 0);
+    } while (bytes_read == -1 && errno == EINTR);
     printf("[TRACE] recv() syscall returned '%ld'\n", (long) bytes_read);
+    if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        printf("[INFO] socket '%d': idle for too long, closing\n", sockfd);
+        disconnected(EXIT_SUCCESS);
+    }
     if (bytes_read == -1) {
         perror("[ERROR] recv()");
-        exit(EXIT_FAILURE);
+        disconnected(EXIT_FAILURE);
     }
     if (bytes_read == 0) {
         printf("[DEBUG] socket '%d': connection reset by peer\n", sockfd);
-        exit(EXIT_SUCCESS);
+        disconnected(EXIT_SUCCESS);
+    }
+    if (bytes_in_counter != NULL) {
+        __sync_fetch_and_add(bytes_in_counter, (unsigned long) bytes_read);
     }
     return bytes_read;
 }
@@ -185,8 +370,8 @@ bel_sendall_or_die(const int sockfd, const char* const buf, const size_t len)
     size_t  bytes_left = 0;
     ssize_t bytes_sent = 0;
 
-    printf("[TRACE] bel_sendall_or_die - buf = '%s', len = '%lu'\n",
-            buf, (unsigned long) len);    
+    printf("[TRACE] bel_sendall_or_die - buf = '%.*s', len = '%lu'\n",
+            (int) len, buf, (unsigned long) len);    
     bytes_left = len;
     while (bytes_left > 0) {
         bytes_sent =
@@ -195,9 +380,30 @@ bel_sendall_or_die(const int sockfd, const char* const buf, const size_t len)
     }
 }
 
+
+void
+bel_sendfield_or_die(const int sockfd, const char* const buf, const size_t len)
+{
+    char lenbuf[FIELDLEN_MSGLEN];
+
+    bel_put_fieldlen(lenbuf, len);
+    bel_sendall_or_die(sockfd, lenbuf, FIELDLEN_MSGLEN);
+    bel_sendall_or_die(sockfd, buf, len);
+}
+
+void
+bel_put_fieldlen(char *buf, const size_t len)
+{
+    buf[0] = (char) ((len >> 24) & 0xff);
+    buf[1] = (char) ((len >> 16) & 0xff);
+    buf[2] = (char) ((len >> 8) & 0xff);
+    buf[3] = (char) (len & 0xff);
+}
+
 /*
- * Performs the send() system call, and exits the program on failure or
- * disconnection.
+ * Performs the send() system call, and exits the program on failure,
+ * disconnection or timeout (see SO_SNDTIMEO), retrying it when interrupted
+ * by a signal.
  * The MSG_NOSIGNAL flag is used during the call, in order to make send()
  * return a 'Broken Pipe' error instead of a SIGPIPE, which would crash the
  * application if unhandled (it exits anyway, but at least an error message is
@@ -207,39 +413,49 @@ static ssize_t
 do_send_or_die(const int sockfd, const char* const buf, const size_t len) {
     ssize_t bytes_sent = 0;
     
-    printf("[TRACE] do_send_or_die - buf = '%s', len = '%lu'\n",
-            buf, (unsigned long) len);
-    bytes_sent = send(sockfd, buf, len, MSG_NOSIGNAL);
+    printf("[TRACE] do_send_or_die - buf = '%.*s', len = '%lu'\n",
+            (int) len, buf, (unsigned long) len);
+    do {
+        bytes_sent = send(sockfd, buf, len, MSG_NOSIGNAL);
+    } while (bytes_sent == -1 && errno == EINTR);
     printf("[TRACE] send() syscall returned '%ld'\n", (long) bytes_sent);
+    if (bytes_sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        printf("[INFO] socket '%d': peer not reading, closing\n", sockfd);
+        disconnected(EXIT_SUCCESS);
+    }
     if (bytes_sent == -1) {
         perror("[ERROR] send()");
-        exit(EXIT_FAILURE);
+        disconnected(EXIT_FAILURE);
     }
     if (bytes_sent == 0) {
         printf("[DEBUG] socket '%d': connection reset by peer\n", sockfd);
-        exit(EXIT_SUCCESS);
+        disconnected(EXIT_SUCCESS);
+    }
+    if (bytes_out_counter != NULL) {
+        __sync_fetch_and_add(bytes_out_counter, (unsigned long) bytes_sent);
     }
     return bytes_sent;
 }
 
+/*
+ * Ends the current connection, and with it the process unless a disconnect
+ * handler is set
+ */
+static void
+disconnected(const int status)
+{
+    if (disconnect_handler != NULL) disconnect_handler();
+    exit(status);
+}
 
-char*
-bel_concat(const char* const s1, const char* const s2)
+
+unsigned long
+bel_clock_ns(void)
 {
-    size_t len1, len2;
-    char *result = NULL;
-    
-    len1 = strlen(s1);
-    len2 = strlen(s2);
-    result = malloc(len1 + len2 + 1);  /* +1 for the zero terminator  */
-    if (result == NULL) return NULL;
-    
-    memcpy(result, s1, len1);
-    
-    /* +1 in order to also copy the zero terminator  */
-    memcpy(result + len1, s2, len2 + 1);
-    
-    return result;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long) ts.tv_sec * 1000000000UL + ts.tv_nsec;
 }
 
 
@@ -1,6 +1,7 @@
 #ifndef BELCOMMON_H_INCLUDED
 #define BELCOMMON_H_INCLUDED
 
+#include "bel_arena.h"
 #include <netdb.h>
 
 
@@ -17,22 +18,72 @@
 
 #define CMD_MSGLEN 7
 #define CMD_READ	"READ"
+#define CMD_READIF	"READIF"
 #define CMD_SEND	"SEND"
 #define CMD_DELETE	"DELETE"
+#define CMD_STATS	"STATS"
 
-#define ID_MSGLEN 7
+/*
+ * Like SEND, but the subject is preceded by the number of seconds the message
+ * has to live, as a decimal string in a message of ID_MSGLEN bytes
+ */
+#define CMD_SENDEX	"SENDEX"
+
+/* Turns the connection into a replication stream, see bel_repl.h  */
+#define CMD_REPL	"REPL"
+
+/*
+ * Selects the channel that the commands which follow on the connection work
+ * on: its name, up to 31 letters, digits, '-' and '_', comes in a message of
+ * CHANNEL_MSGLEN bytes, and the empty name is the default channel. Answered
+ * KO if the channel cannot be selected
+ */
+#define CMD_CHANNEL	"CHAN"
+#define CHANNEL_MSGLEN 32
+
+/* Message IDs keep growing, so make room for any unsigned long  */
+#define ID_MSGLEN 21
 
 #define ANSWER_MSGLEN 3
 #define ANSWER_OK "OK"
 #define ANSWER_KO "KO"
+#define ANSWER_NOT_MODIFIED "NM"
+
+/* Sent instead of the login answer when the server is full  */
+#define ANSWER_BUSY "BY"
 
-#define TXT_MSGLEN 128
+/*
+ * Sent instead of the outcome of a request refused by rate limiting. The
+ * payload of the request is still read, so that the outcome comes in the
+ * usual place: instead of the first answer for requests without payload
+ * (READ), instead of the final one for all the others
+ */
+#define ANSWER_THROTTLED "TH"
 
 /*
- * This one must be big enough to contain the full message list, so we set it
- * to over nine thousand
+ * Board versions, for conditional reads (READIF), travel as decimal strings
+ * in messages of ID_MSGLEN bytes. An empty string never matches
  */
-#define LIST_MSGLEN 9001
+#define VERSION_MSGLEN ID_MSGLEN
+
+/*
+ * Subjects, bodies and message lists are variable-length fields instead:
+ * a 4-byte length in network byte order followed by that many bytes, with no
+ * terminator. Subjects and bodies are never longer than TXT_MAXLEN_LIMIT
+ */
+#define FIELDLEN_MSGLEN 4
+#define FIELD_MAXLEN 0xffffffffUL
+#define TXT_MAXLEN_LIMIT 65536
+
+/*
+ * Message lists hold up to MSG_LIST_SIZE messages, each one as
+ * "[<id>] <from>\n<subject>\n<body>\n\n", so that they are never longer than
+ * MSG_LIST_MAXLEN. STATS reports are never longer than STATS_MSGLEN
+ */
+#define MSG_LIST_SIZE 10
+#define MSG_LIST_MAXLEN \
+        (MSG_LIST_SIZE * (ID_MSGLEN + UNAME_MSGLEN + 2 * TXT_MAXLEN_LIMIT + 7))
+#define STATS_MSGLEN 4096
 
 
 typedef void (*Action)();
@@ -58,6 +109,28 @@ extern int bel_new_sock(const struct addrinfo);
 extern void bel_getaddrinfo_or_die(
 		const char* const, const int, const u_short, struct addrinfo**);
 
+/*
+ * Gets all the addresses associated to the given ip and port and connects to
+ * the first available one. An "ip" containing a '/' is the path of a local
+ * (AF_UNIX) socket instead, and the port is ignored.
+ * Returns the file descriptor of the connected socket. Exits on failure
+ */
+extern int bel_connect_or_die(const char* const, const u_short);
+
+/*
+ * Sets the integer socket option <optname> at the given <level> to <value>.
+ * Exits on error
+ */
+extern void bel_setsockopt_or_die(
+        const int sockfd, const int level, const int optname, const int value);
+
+/*
+ * Writes the numeric form of the given (IPv4 or IPv6) socket address into
+ * <ipstr>, which must hold INET6_ADDRSTRLEN bytes. Local (AF_UNIX) addresses
+ * are all written as "local"
+ */
+extern void bel_address_tostring(const struct sockaddr*, char *ipstr);
+
 /*
  * Prints a string representation of the given socket address, prepending the
  * given prefix
@@ -67,27 +140,60 @@ extern void bel_print_address(const char* const, const struct sockaddr*);
 
 /*
  * Reads <len> bytes of data to <buf> from the socket <sockfd>.
- * Exits the process on failure or disconnection
+ * Exits the process on failure, disconnection or timeout
  */
 extern void
 bel_recvall_or_die(const int sockfd, char* buf, const size_t len);
 
 /*
  * Sends <len> bytes of data from <buf> to the socket <sockfd>.
- * Exits the process on failure or disconnection
+ * Exits the process on failure, disconnection or timeout
  */
 extern void
 bel_sendall_or_die(const int sockfd, const char* const buf, const size_t len);
 
+/*
+ * From now on, calls <handler> instead of exiting the process when the
+ * functions below fail, get disconnected or time out. The handler must not
+ * return (it can longjmp() out, for instance)
+ */
+extern void bel_set_disconnect_handler(void (*handler)(void));
+
+/*
+ * From now on, adds the number of bytes received and sent through the
+ * functions below to the given counters (which can be NULL). The counters are
+ * updated atomically, so they can be shared among processes
+ */
+extern void
+bel_set_io_counters(unsigned long *bytes_in, unsigned long *bytes_out);
+
+/*
+ * Reads a variable-length field from the socket <sockfd> into memory taken
+ * from <arena>, adding a '\0' terminator, and saves its length into <len>.
+ * Fields longer than <maxlen> are read and thrown away, and NULL is returned.
+ * Exits the process on failure or disconnection
+ */
+extern char* bel_recvfield_or_die(
+        const int sockfd, Arena*, const size_t maxlen, size_t *len);
 
 /*
- * Concatenates the two given strings on a newly-allocated block of memory.
- * It is responsibility of the caller to free the memory when it is no longer
- * needed.
- * Returns NULL if malloc() fails
+ * Sends the <len> bytes of data in <buf> as a variable-length field to the
+ * socket <sockfd>.
+ * Exits the process on failure or disconnection
  */
-extern char*
-bel_concat(const char* const, const char* const);
+extern void
+bel_sendfield_or_die(const int sockfd, const char* const buf, const size_t len);
+
+
+/*
+ * Writes the length prefix of a variable-length field of <len> bytes into the
+ * first FIELDLEN_MSGLEN bytes of <buf>
+ */
+extern void bel_put_fieldlen(char *buf, const size_t len);
+
+
+/* Returns the time elapsed from an arbitrary point, in nanoseconds  */
+extern unsigned long bel_clock_ns(void);
 
 
 /* Removes the last character of the given string if it is a newline  */
@@ -0,0 +1,338 @@
+/* bel_handoff - Passing listening sockets and connections to a new server  */
+
+#define _GNU_SOURCE     /* for struct ucred  */
+
+#include "bel_handoff.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+/* Kind, whether local, user, address and channel  */
+#define SESSION_MSGLEN (2 + UNAME_MSGLEN + INET6_ADDRSTRLEN + CHANNEL_MSGLEN)
+
+/* Where the channel starts in a session message  */
+#define SESSION_CHANNEL (2 + UNAME_MSGLEN + INET6_ADDRSTRLEN)
+
+/* Connections queueing on the handoff socket: a whole server comes at once */
+#define HANDOFF_BACKLOG 128
+
+
+static int connect_to(const char* const);
+static int is_same_user(const int);
+static int fill_address(const char* const, struct sockaddr_un*);
+static int send_message(const int, const char*, const size_t, const int*,
+        const int);
+static ssize_t recv_message(const int, char*, const size_t, int*, int*);
+static int recv_ready(const int);
+static void close_all(const int*, const int);
+
+
+int
+bel_handoff_listen_or_die(const char* const path)
+{
+    int fd;
+    struct sockaddr_un addr;
+    struct stat st;
+
+    if (!fill_address(path, &addr)) {
+        fprintf(stderr, "[FATAL] handoff socket path too long\n");
+        exit(EXIT_FAILURE);
+    }
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+    fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd == -1) {
+        perror("[FATAL] socket()");
+        exit(EXIT_FAILURE);
+    }
+    /* connecting takes write permission: only the owner has it  */
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1
+            || chmod(path, S_IRUSR | S_IWUSR) == -1
+            || listen(fd, HANDOFF_BACKLOG) == -1) {
+        perror("[FATAL] cannot create the handoff socket");
+        exit(EXIT_FAILURE);
+    }
+    printf("[INFO] handoff socket at %s\n", path);
+    return fd;
+}
+
+int
+bel_handoff_accept(const int listener, int *conn, int *fd,
+        HandoffSession *session)
+{
+    int fds[HANDOFF_MAX_FDS], count = 0;
+    char msg[SESSION_MSGLEN];
+    ssize_t len;
+
+    *conn = accept(listener, NULL, NULL);
+    if (*conn == -1) {
+        if (errno != EINTR) perror("[ERROR] accept()");
+        return -1;
+    }
+    if (!is_same_user(*conn)) {
+        bel_close_or_die(*conn);
+        return -1;
+    }
+    len = recv_message(*conn, msg, SESSION_MSGLEN, fds, &count);
+    if (len == 1 && msg[0] == HANDOFF_LISTENERS && count == 0) {
+        return HANDOFF_LISTENERS;
+    }
+    if (len == SESSION_MSGLEN && msg[0] == HANDOFF_CONNECTION && count == 1) {
+        *fd = fds[0];
+        *session = empty_handoff_session;
+        session->is_local = msg[1];
+        memcpy(session->user, msg + 2, UNAME_MSGLEN - 1);
+        memcpy(session->ip, msg + 2 + UNAME_MSGLEN, INET6_ADDRSTRLEN - 1);
+        memcpy(session->channel, msg + SESSION_CHANNEL, CHANNEL_MSGLEN - 1);
+        return HANDOFF_CONNECTION;
+    }
+    fprintf(stderr, "[WARN] invalid request on the handoff socket\n");
+    close_all(fds, count);
+    bel_close_or_die(*conn);
+    return -1;
+}
+
+/*
+ * Returns 1 (true) if the peer of <conn> runs as the same user as this
+ * process: the others are not to be handed sockets, nor logged in users
+ */
+static int
+is_same_user(const int conn)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+        perror("[ERROR] getsockopt()");
+        return 0;
+    }
+    if (cred.uid != getuid()) {
+        fprintf(stderr, "[WARN] refusing handoff request of pid '%ld',"
+                " user '%ld'\n", (long) cred.pid, (long) cred.uid);
+        return 0;
+    }
+    return 1;
+}
+
+
+int
+bel_handoff_request_or_die(const char* const path, int *fds, int *count)
+{
+    int conn;
+    char kind = HANDOFF_LISTENERS;
+
+    conn = connect_to(path);
+    if (conn == -1) return -1;
+    printf("[INFO] taking over from the server at %s\n", path);
+    *count = 0;
+    if (!send_message(conn, &kind, 1, NULL, 0)
+            || recv_message(conn, &kind, 1, fds, count) != 1
+            || kind != HANDOFF_LISTENERS || *count == 0) {
+        fprintf(stderr, "[FATAL] the server at %s did not hand over\n", path);
+        exit(EXIT_FAILURE);
+    }
+    return conn;
+}
+
+void
+bel_handoff_confirm(const int conn)
+{
+    char kind = HANDOFF_READY;
+
+    if (!send_message(conn, &kind, 1, NULL, 0)) {
+        fprintf(stderr, "[WARN] the old server went away\n");
+    }
+    bel_close_or_die(conn);
+}
+
+int
+bel_handoff_give_listeners(const int conn, const int *fds, const int count)
+{
+    char kind = HANDOFF_LISTENERS;
+
+    if (!send_message(conn, &kind, 1, fds, count)) return 0;
+    return recv_ready(conn);
+}
+
+
+int
+bel_handoff_connection(const char* const path, const int fd,
+        const HandoffSession* const session)
+{
+    int conn, adopted;
+    char msg[SESSION_MSGLEN];
+
+    conn = connect_to(path);
+    if (conn == -1) return 0;
+    memset(msg, 0, SESSION_MSGLEN);
+    msg[0] = HANDOFF_CONNECTION;
+    msg[1] = session->is_local != 0;
+    strncpy(msg + 2, session->user, UNAME_MSGLEN - 1);
+    strncpy(msg + 2 + UNAME_MSGLEN, session->ip, INET6_ADDRSTRLEN - 1);
+    strncpy(msg + SESSION_CHANNEL, session->channel, CHANNEL_MSGLEN - 1);
+    adopted = send_message(conn, msg, SESSION_MSGLEN, &fd, 1)
+            && recv_ready(conn);
+    bel_close_or_die(conn);
+    return adopted;
+}
+
+void
+bel_handoff_adopted(const int conn)
+{
+    char kind = HANDOFF_READY;
+
+    if (!send_message(conn, &kind, 1, NULL, 0)) {
+        fprintf(stderr, "[WARN] the old server went away\n");
+    }
+}
+
+
+/*
+ * Connects to the handoff socket at <path>.
+ * Returns the connection, or -1 if nobody is listening there
+ */
+static int
+connect_to(const char* const path)
+{
+    int fd;
+    struct sockaddr_un addr;
+
+    if (!fill_address(path, &addr)) return -1;
+    fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd == -1) {
+        perror("[ERROR] socket()");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        if (errno != ENOENT && errno != ECONNREFUSED) {
+            perror("[WARN] cannot reach the handoff socket");
+        }
+        bel_close_or_die(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Returns 0 (false) if <path> does not fit into <addr>  */
+static int
+fill_address(const char* const path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) return 0;
+    strcpy(addr->sun_path, path);
+    return 1;
+}
+
+/*
+ * Sends the message in buf[0..len), along with the <count> file descriptors
+ * in <fds>.
+ * Returns 0 (false) on failure
+ */
+static int
+send_message(const int sockfd, const char *buf, const size_t len,
+        const int *fds, const int count)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    } control;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (char*) buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (count > 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+    }
+    while (sendmsg(sockfd, &msg, MSG_NOSIGNAL) == -1) {
+        if (errno == EINTR) continue;
+        perror("[WARN] sendmsg()");
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Receives a message of at most <cap> bytes into <buf>, saving the file
+ * descriptors passed along into <fds> and their number into <count>.
+ * Returns the length of the message, 0 if the peer is gone, -1 on errors
+ */
+static ssize_t
+recv_message(const int sockfd, char *buf, const size_t cap, int *fds,
+        int *count)
+{
+    ssize_t len;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    } control;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = cap;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    while ((len = recvmsg(sockfd, &msg, 0)) == -1 && errno == EINTR) continue;
+    if (len == -1) perror("[WARN] recvmsg()");
+    *count = 0;
+    for (cmsg = CMSG_FIRSTHDR(&msg); len != -1 && cmsg != NULL;
+            cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        *count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * *count);
+    }
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        fprintf(stderr, "[WARN] truncated message on the handoff socket\n");
+        close_all(fds, *count);
+        *count = 0;
+        return -1;
+    }
+    return len;
+}
+
+/* Returns 1 (true) if the peer answers HANDOFF_READY  */
+static int
+recv_ready(const int conn)
+{
+    int fds[HANDOFF_MAX_FDS], count;
+    char kind = 0;
+
+    if (recv_message(conn, &kind, 1, fds, &count) != 1) {
+        close_all(fds, count);
+        return 0;
+    }
+    close_all(fds, count);
+    return kind == HANDOFF_READY;
+}
+
+static void
+close_all(const int *fds, const int count)
+{
+    int i;
+
+    for (i = 0; i < count; ++i) bel_close_or_die(fds[i]);
+}
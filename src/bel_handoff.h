@@ -0,0 +1,95 @@
+#ifndef BELHANDOFF_H_INCLUDED
+#define BELHANDOFF_H_INCLUDED
+
+#include "bel_common.h"
+#include <netinet/in.h>
+
+
+/*
+ * Handing a running server over to a new one (a new version, say) without
+ * dropping anything. A server listens on a local seqpacket socket, the
+ * handoff socket, and a new server started with the same path connects to it
+ * and is passed the listening sockets, with SCM_RIGHTS: connection attempts
+ * keep queueing on them, and are never refused. Once it is ready, the new
+ * server takes over the path of the handoff socket and confirms; the old one
+ * stops accepting, and every process of it serving a connection passes the
+ * connection on, along with its session, as soon as it is between two
+ * commands. Messages are a HANDOFF_* byte, followed by:
+ *
+ *      HANDOFF_LISTENERS   nothing; answered with the listening sockets
+ *                          (TCP first), then confirmed with HANDOFF_READY
+ *      HANDOFF_CONNECTION  the session, and the socket of the connection;
+ *                          answered with HANDOFF_READY once adopted
+ */
+
+
+#define HANDOFF_LISTENERS   'L'
+#define HANDOFF_CONNECTION  'C'
+#define HANDOFF_READY       'R'
+
+/* Most sockets in a single message  */
+#define HANDOFF_MAX_FDS 2
+
+
+/* What a connection needs to go on being served by another process  */
+typedef struct {
+    int is_local;                   /* came through the local socket  */
+    char user[UNAME_MSGLEN];        /* already logged in  */
+    char ip[INET6_ADDRSTRLEN];
+    char channel[CHANNEL_MSGLEN];   /* selected, "" for the default one  */
+} HandoffSession;
+static const HandoffSession empty_handoff_session;
+
+
+/*
+ * Creates the handoff socket at <path>, replacing whatever socket is there,
+ * and listens on it. Only its owner can connect to it.
+ * Returns its file descriptor. Exits on failure
+ */
+extern int bel_handoff_listen_or_die(const char* const path);
+
+/*
+ * Waits for the next request on the handoff socket <listener>, saving the
+ * connection it came through into <conn>, to be closed by the caller. For a
+ * HANDOFF_CONNECTION, saves the socket and the session passed along too.
+ * Requests from processes of another user are refused.
+ * Returns the HANDOFF_* kind of the request, or -1 on error
+ */
+extern int bel_handoff_accept(const int listener, int *conn, int *fd,
+        HandoffSession*);
+
+
+/*
+ * New server: asks the server with a handoff socket at <path>, if any, for
+ * its listening sockets, saving them into <fds> and their number into
+ * <count>.
+ * Returns the connection to confirm on, or -1 if no server is listening
+ * there. Exits on failure
+ */
+extern int bel_handoff_request_or_die(const char* const path, int *fds,
+        int *count);
+
+/* New server, once ready: tells the old one to hand over, through <conn>  */
+extern void bel_handoff_confirm(const int conn);
+
+/*
+ * Old server: answers a HANDOFF_LISTENERS request on <conn> with the <count>
+ * listening sockets in <fds>, and waits for the confirmation.
+ * Returns 1 (true) if the new server confirmed, 0 if it went away first
+ */
+extern int bel_handoff_give_listeners(const int conn, const int *fds,
+        const int count);
+
+
+/*
+ * Old server: passes the connection on <fd>, and its <session>, to the
+ * server with a handoff socket at <path>.
+ * Returns 1 (true) if it was adopted, 0 (false) if it has to be kept
+ */
+extern int bel_handoff_connection(const char* const path, const int fd,
+        const HandoffSession* const session);
+
+/* New server: tells the process that passed a connection that it is adopted */
+extern void bel_handoff_adopted(const int conn);
+
+#endif	/* BELHANDOFF_H_INCLUDED */
@@ -0,0 +1,101 @@
+/* bel_histogram - Lock-free log-linear histograms for latency measurements  */
+
+#include "bel_histogram.h"
+
+
+static unsigned int bucket_of(const unsigned long);
+static unsigned long bucket_upper_bound(const unsigned int);
+static void update_max(unsigned long*, const unsigned long);
+
+
+void
+bel_hist_record(Histogram *hist, const unsigned long value)
+{
+    __sync_fetch_and_add(&hist->counts[bucket_of(value)], 1UL);
+    __sync_fetch_and_add(&hist->total, 1UL);
+    __sync_fetch_and_add(&hist->sum, value);
+    update_max(&hist->max, value);
+}
+
+
+void
+bel_hist_merge(Histogram *dst, const Histogram* const src)
+{
+    unsigned int i;
+
+    for (i = 0; i < HIST_BUCKETS; ++i) {
+        if (src->counts[i] != 0) {
+            __sync_fetch_and_add(&dst->counts[i], src->counts[i]);
+        }
+    }
+    __sync_fetch_and_add(&dst->total, src->total);
+    __sync_fetch_and_add(&dst->sum, src->sum);
+    update_max(&dst->max, src->max);
+}
+
+
+unsigned long
+bel_hist_percentile(const Histogram* const hist, const double percent)
+{
+    unsigned int i;
+    unsigned long threshold, seen = 0, bound;
+
+    if (hist->total == 0) return 0;
+    threshold = (unsigned long) (hist->total * percent / 100.0 + 0.5);
+    if (threshold == 0) threshold = 1;
+    for (i = 0; i < HIST_BUCKETS; ++i) {
+        seen += hist->counts[i];
+        if (seen >= threshold) break;
+    }
+    bound = bucket_upper_bound(i);
+    return bound < hist->max ? bound : hist->max;
+}
+
+
+unsigned long
+bel_hist_mean(const Histogram* const hist)
+{
+    return hist->total == 0 ? 0 : hist->sum / hist->total;
+}
+
+
+/*
+ * Values below HIST_SUB_COUNT get a bucket each. Above that, the position of
+ * the most significant bit selects a group of buckets, and the HIST_SUB_BITS
+ * bits right after it select the bucket within the group
+ */
+static unsigned int
+bucket_of(const unsigned long value)
+{
+    unsigned int msb, shift;
+
+    if (value < HIST_SUB_COUNT) return value;
+    msb = HIST_VALUE_BITS - 1 - __builtin_clzl(value);
+    shift = msb - HIST_SUB_BITS;
+    return HIST_SUB_COUNT * (shift + 1)
+            + ((value >> shift) & (HIST_SUB_COUNT - 1));
+}
+
+/* Returns the highest value that falls into the given bucket  */
+static unsigned long
+bucket_upper_bound(const unsigned int bucket)
+{
+    unsigned int shift;
+    unsigned long sub;
+
+    if (bucket < HIST_SUB_COUNT) return bucket;
+    shift = bucket / HIST_SUB_COUNT - 1;
+    sub = bucket % HIST_SUB_COUNT + HIST_SUB_COUNT;
+    return ((sub + 1) << shift) - 1;
+}
+
+static void
+update_max(unsigned long *max, const unsigned long value)
+{
+    unsigned long current;
+
+    current = *max;
+    while (value > current) {
+        current = __sync_val_compare_and_swap(max, current, value);
+    }
+}
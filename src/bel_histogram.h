@@ -0,0 +1,44 @@
+#ifndef BELHISTOGRAM_H_INCLUDED
+#define BELHISTOGRAM_H_INCLUDED
+
+#include <limits.h>
+
+
+/*
+ * Log-linear histogram in the style of HdrHistogram: every power of two is
+ * split into HIST_SUB_COUNT equal buckets, so any recorded value is known
+ * within a relative error of 1 / HIST_SUB_COUNT (about 3%), whatever its
+ * magnitude. Recording is lock-free, so a histogram can sit in memory shared
+ * among processes
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_VALUE_BITS (sizeof(unsigned long) * CHAR_BIT)
+#define HIST_BUCKETS (HIST_SUB_COUNT * (HIST_VALUE_BITS - HIST_SUB_BITS + 1))
+
+typedef struct {
+    unsigned long counts[HIST_BUCKETS];
+    unsigned long total;    /* number of recorded values  */
+    unsigned long sum;
+    unsigned long max;
+} Histogram;
+static const Histogram empty_histogram;
+
+
+/* Records <value> into <hist>. Safe to call concurrently  */
+extern void bel_hist_record(Histogram*, const unsigned long value);
+
+/* Adds all the values recorded in <src> to <dst>  */
+extern void bel_hist_merge(Histogram *dst, const Histogram* const src);
+
+/*
+ * Returns the value below which <percent>% of the recorded values fall (an
+ * upper bound, within the histogram's precision), or 0 if it is empty
+ */
+extern unsigned long
+bel_hist_percentile(const Histogram* const, const double percent);
+
+/* Returns the average of the recorded values, or 0 if it is empty  */
+extern unsigned long bel_hist_mean(const Histogram* const);
+
+#endif	/* BELHISTOGRAM_H_INCLUDED */
@@ -0,0 +1,73 @@
+/* bel_loadgen - Measurements shared by the load generators  */
+
+#include "bel_loadgen.h"
+#include "bel_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#define NS_PER_SEC 1000000000UL
+#define NS_PER_USEC 1000UL
+
+
+LoadResults*
+bel_loadgen_map_results_or_die(void)
+{
+    LoadResults *res;
+
+    res = mmap(NULL, sizeof(LoadResults), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (res == MAP_FAILED) {
+        perror("[FATAL] mmap()");
+        exit(EXIT_FAILURE);
+    }
+    return res;
+}
+
+
+void
+bel_loadgen_sleep_until(const unsigned long when)
+{
+    unsigned long now;
+    struct timespec ts;
+
+    now = bel_clock_ns();
+    if (now >= when) return;    /* running late: no sleep  */
+    ts.tv_sec = (when - now) / NS_PER_SEC;
+    ts.tv_nsec = (when - now) % NS_PER_SEC;
+    nanosleep(&ts, NULL);
+}
+
+
+void
+bel_loadgen_print_report(const LoadResults* const res,
+        const char* const *op_names, const int no_of_ops, const int hide_idle,
+        const int failed, const double elapsed)
+{
+    int op;
+    unsigned long total = 0;
+    const Histogram *hist;
+
+    printf("%-7s %10s %8s %10s %10s %10s %10s %10s %10s\n", "command",
+            "count", "ko", "cmd/s", "mean_us", "p50_us", "p99_us", "p999_us",
+            "max_us");
+    for (op = 0; op < no_of_ops; ++op) {
+        hist = &res->latency[op];
+        if (hide_idle && hist->total == 0) continue;
+        total += hist->total;
+        printf("%-7s %10lu %8lu %10.1f %10lu %10lu %10lu %10lu %10lu\n",
+                op_names[op], hist->total, res->ko[op],
+                hist->total / elapsed,
+                bel_hist_mean(hist) / NS_PER_USEC,
+                bel_hist_percentile(hist, 50.0) / NS_PER_USEC,
+                bel_hist_percentile(hist, 99.0) / NS_PER_USEC,
+                bel_hist_percentile(hist, 99.9) / NS_PER_USEC,
+                hist->max / NS_PER_USEC);
+    }
+    printf("total: %lu commands in %.2f s, %.1f cmd/s", total, elapsed,
+            total / elapsed);
+    if (res->skipped > 0) printf(", %lu skipped", res->skipped);
+    if (failed > 0) printf(", %d connections failed", failed);
+    printf("\n");
+}
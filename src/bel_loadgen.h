@@ -0,0 +1,46 @@
+#ifndef BELLOADGEN_H_INCLUDED
+#define BELLOADGEN_H_INCLUDED
+
+#include "bel_histogram.h"
+
+
+/*
+ * What the load generators (bench and replay) have in common: a process per
+ * connection, each one recording the latency of the commands it issues into
+ * histograms shared with the others, and the parent summarizing them all at
+ * the end. Latency is measured from the time a command was scheduled for,
+ * so that a stalling server is not under-reported
+ */
+
+
+/* Most kinds of commands a load generator tells apart  */
+#define LOADGEN_MAX_OPS 8
+
+/* Measurements, shared among all the connection processes  */
+typedef struct {
+    Histogram latency[LOADGEN_MAX_OPS];
+    unsigned long ko[LOADGEN_MAX_OPS];  /* commands answered negatively  */
+    unsigned long skipped;              /* connections and commands  */
+} LoadResults;
+
+
+/*
+ * Maps zero-filled results shared with children forked later.
+ * Exits on failure
+ */
+extern LoadResults* bel_loadgen_map_results_or_die(void);
+
+/* Sleeps until <when>, as given by bel_clock_ns(), unless it is past  */
+extern void bel_loadgen_sleep_until(const unsigned long when);
+
+/*
+ * Prints a table of the <no_of_ops> kinds of commands in <res>, named after
+ * <op_names>, leaving out those never issued if <hide_idle>, followed by the
+ * totals over the <elapsed> seconds of the run and the number of connections
+ * that <failed>
+ */
+extern void bel_loadgen_print_report(const LoadResults* const res,
+        const char* const *op_names, const int no_of_ops, const int hide_idle,
+        const int failed, const double elapsed);
+
+#endif	/* BELLOADGEN_H_INCLUDED */
@@ -0,0 +1,177 @@
+/* bel_metrics - Counters and latency histograms shared by server processes  */
+
+#include "bel_metrics.h"
+#include "bel_common.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define NS_PER_SEC 1000000000UL
+#define NS_PER_USEC 1000UL
+
+
+typedef struct {
+    unsigned long ko;
+    unsigned long throttled;
+    Histogram latency;
+} CommandMetrics;
+
+typedef struct {
+    unsigned long start_ns;
+    long connections_active;
+    unsigned long connections_total;
+    unsigned long connections_rejected;
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+    unsigned long unknown_commands;
+    CommandMetrics commands[NO_OF_METRIC_COMMANDS];
+    Histogram storage[NO_OF_METRIC_STORAGE_OPS];
+} Metrics;
+
+
+static size_t append_histogram(char*, const size_t, size_t,
+        const char* const, const char* const, const Histogram* const);
+static size_t append(char*, const size_t, size_t, const char* const, ...);
+
+
+static const char* const command_names[NO_OF_METRIC_COMMANDS] =
+        {CMD_READ, CMD_SEND, CMD_DELETE, CMD_STATS, CMD_READIF, CMD_REPL,
+        CMD_CHANNEL};
+static const char* const storage_names[NO_OF_METRIC_STORAGE_OPS] =
+        {"store", "retrieve", "delete"};
+
+static Metrics *metrics;
+
+
+void
+bel_metrics_init_or_die(void)
+{
+    metrics = mmap(NULL, sizeof(Metrics), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (metrics == MAP_FAILED) {
+        perror("[FATAL] mmap()");
+        exit(EXIT_FAILURE);
+    }
+    metrics->start_ns = bel_clock_ns();
+    bel_set_io_counters(&metrics->bytes_in, &metrics->bytes_out);
+}
+
+
+void
+bel_metrics_command(const int command, const unsigned long ns)
+{
+    bel_hist_record(&metrics->commands[command].latency, ns);
+}
+
+void
+bel_metrics_command_ko(const int command)
+{
+    __sync_fetch_and_add(&metrics->commands[command].ko, 1UL);
+}
+
+void
+bel_metrics_command_throttled(const int command)
+{
+    __sync_fetch_and_add(&metrics->commands[command].throttled, 1UL);
+}
+
+void
+bel_metrics_unknown_command(void)
+{
+    __sync_fetch_and_add(&metrics->unknown_commands, 1UL);
+}
+
+void
+bel_metrics_storage(const int op, const unsigned long ns)
+{
+    bel_hist_record(&metrics->storage[op], ns);
+}
+
+void
+bel_metrics_connection_opened(void)
+{
+    __sync_fetch_and_add(&metrics->connections_active, 1L);
+    __sync_fetch_and_add(&metrics->connections_total, 1UL);
+}
+
+void
+bel_metrics_connection_closed(void)
+{
+    __sync_fetch_and_sub(&metrics->connections_active, 1L);
+}
+
+void
+bel_metrics_connection_rejected(void)
+{
+    __sync_fetch_and_add(&metrics->connections_rejected, 1UL);
+}
+
+
+size_t
+bel_metrics_tostring(char *buf, const size_t size)
+{
+    int i;
+    size_t len = 0;
+    char label[64];
+
+    len = append(buf, size, len, "uptime_s %lu\n",
+            (bel_clock_ns() - metrics->start_ns) / NS_PER_SEC);
+    len = append(buf, size, len, "connections_active %ld\n",
+            metrics->connections_active);
+    len = append(buf, size, len, "connections_total %lu\n",
+            metrics->connections_total);
+    len = append(buf, size, len, "connections_rejected %lu\n",
+            metrics->connections_rejected);
+    len = append(buf, size, len, "bytes_in %lu\n", metrics->bytes_in);
+    len = append(buf, size, len, "bytes_out %lu\n", metrics->bytes_out);
+    len = append(buf, size, len, "commands_unknown %lu\n",
+            metrics->unknown_commands);
+    for (i = 0; i < NO_OF_METRIC_COMMANDS; ++i) {
+        sprintf(label, "ko=%lu throttled=%lu ", metrics->commands[i].ko,
+                metrics->commands[i].throttled);
+        len = append_histogram(buf, size, len, command_names[i], label,
+                &metrics->commands[i].latency);
+    }
+    for (i = 0; i < NO_OF_METRIC_STORAGE_OPS; ++i) {
+        sprintf(label, "storage_%s", storage_names[i]);
+        len = append_histogram(buf, size, len, label, "",
+                &metrics->storage[i]);
+    }
+    return len;
+}
+
+/* Appends one line summarizing <hist>, with the given name and extra info  */
+static size_t
+append_histogram(char *buf, const size_t size, size_t len,
+        const char* const name, const char* const extra,
+        const Histogram* const hist)
+{
+    return append(buf, size, len, "%s count=%lu %smean_us=%lu p50_us=%lu "
+            "p99_us=%lu p999_us=%lu max_us=%lu\n", name, hist->total, extra,
+            bel_hist_mean(hist) / NS_PER_USEC,
+            bel_hist_percentile(hist, 50.0) / NS_PER_USEC,
+            bel_hist_percentile(hist, 99.0) / NS_PER_USEC,
+            bel_hist_percentile(hist, 99.9) / NS_PER_USEC,
+            hist->max / NS_PER_USEC);
+}
+
+/*
+ * printf()s at position <len> of <buf>, without ever going past <size>.
+ * Returns the new length of the content of <buf>
+ */
+static size_t
+append(char *buf, const size_t size, size_t len, const char* const format, ...)
+{
+    int written;
+    char line[512];
+    va_list args;
+
+    va_start(args, format);
+    written = vsprintf(line, format, args);
+    va_end(args);
+    if (written < 0 || len + written >= size) return len;
+    memcpy(buf + len, line, written + 1);
+    return len + written;
+}
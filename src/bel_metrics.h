@@ -0,0 +1,66 @@
+#ifndef BELMETRICS_H_INCLUDED
+#define BELMETRICS_H_INCLUDED
+
+#include "bel_histogram.h"
+#include <stddef.h>
+
+
+/*
+ * Server instrumentation: counters and latency histograms living in memory
+ * shared by the server and all of its children, updated with atomic
+ * operations only, so that recording costs a handful of instructions and
+ * never blocks
+ */
+
+
+/* Commands whose latency is tracked  */
+#define METRIC_READ     0
+#define METRIC_SEND     1
+#define METRIC_DELETE   2
+#define METRIC_STATS    3
+#define METRIC_READIF   4
+#define METRIC_REPL     5
+#define METRIC_CHANNEL  6
+#define NO_OF_METRIC_COMMANDS 7
+
+/* Storage operations whose latency is tracked  */
+#define METRIC_STORE    0
+#define METRIC_RETRIEVE 1
+#define METRIC_REMOVE   2
+#define NO_OF_METRIC_STORAGE_OPS 3
+
+
+/*
+ * Maps the shared memory holding the metrics. To be called once, before
+ * forking any child. Exits on failure
+ */
+extern void bel_metrics_init_or_die(void);
+
+/* Records the time taken to serve one command  */
+extern void bel_metrics_command(const int command, const unsigned long ns);
+
+/* Counts a negative answer to the given command  */
+extern void bel_metrics_command_ko(const int command);
+
+/* Counts a command refused by rate limiting  */
+extern void bel_metrics_command_throttled(const int command);
+
+/* Counts a command the server did not recognize  */
+extern void bel_metrics_unknown_command(void);
+
+/* Records the time taken by one storage operation  */
+extern void bel_metrics_storage(const int op, const unsigned long ns);
+
+/* Tracks the number of connections being served  */
+extern void bel_metrics_connection_opened(void);
+extern void bel_metrics_connection_closed(void);
+extern void bel_metrics_connection_rejected(void);
+
+/*
+ * Writes a textual report of all the metrics into <buf>, which can hold
+ * <size> bytes.
+ * Returns the length of the report (truncated to fit <buf>)
+ */
+extern size_t bel_metrics_tostring(char *buf, const size_t size);
+
+#endif	/* BELMETRICS_H_INCLUDED */
@@ -0,0 +1,255 @@
+/* bel_pagecache - Memory-bounded cache of file pages, with CLOCK eviction  */
+
+#include "bel_pagecache.h"
+#include "bel_placement.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+struct PageFrame {
+    int fd;             /* -1 for a free frame  */
+    unsigned long gen;
+    off_t page;         /* index of the page within the file  */
+    size_t len;         /* bytes read, short for the last page of a file  */
+    int referenced;     /* read since the hand last passed by  */
+    long next;          /* next frame in the same bucket, -1 for none  */
+};
+
+
+static PageFrame* get_page(PageCache*, const int, const unsigned long,
+        const off_t, const size_t);
+static int fill_page(PageCache*, PageFrame*);
+static long find_page(const PageCache* const, const int, const unsigned long,
+        const off_t);
+static long evict_page(PageCache*);
+static void unlink_page(PageCache*, const long);
+static size_t bucket_of(const PageCache* const, const int,
+        const unsigned long, const off_t);
+static int pread_full(const int, char*, const size_t, const off_t);
+static void* malloc_or_die(const size_t);
+
+
+void
+bel_pagecache_init_or_die(PageCache *cache, const size_t budget)
+{
+    size_t i;
+
+    *cache = empty_page_cache;
+    cache->no_of_frames = budget / PAGECACHE_PAGE_SIZE;
+    if (cache->no_of_frames == 0) cache->no_of_frames = 1;
+    cache->no_of_buckets = 1;
+    while (cache->no_of_buckets < 2 * cache->no_of_frames) {
+        cache->no_of_buckets *= 2;
+    }
+    cache->frames = malloc_or_die(cache->no_of_frames * sizeof(PageFrame));
+    cache->data = malloc_or_die(cache->no_of_frames * PAGECACHE_PAGE_SIZE);
+    cache->buckets = malloc_or_die(cache->no_of_buckets * sizeof(long));
+    bel_hugepages_advise(cache->data,
+            cache->no_of_frames * PAGECACHE_PAGE_SIZE);
+    for (i = 0; i < cache->no_of_frames; ++i) {
+        cache->frames[i].fd = -1;
+        cache->frames[i].next = -1;
+    }
+    for (i = 0; i < cache->no_of_buckets; ++i) cache->buckets[i] = -1;
+}
+
+void
+bel_pagecache_destroy(PageCache *cache)
+{
+    free(cache->frames);
+    free(cache->data);
+    free(cache->buckets);
+    *cache = empty_page_cache;
+}
+
+
+int
+bel_pagecache_read(PageCache *cache, const int fd, const unsigned long gen,
+        const off_t offset, const size_t len, char *buf)
+{
+    off_t page;
+    size_t start, chunk, done = 0;
+    PageFrame *frame;
+
+    if (len > cache->no_of_frames * PAGECACHE_PAGE_SIZE / 4) {
+        ++cache->misses;
+        return pread_full(fd, buf, len, offset);
+    }
+    while (done < len) {
+        page = (offset + done) / PAGECACHE_PAGE_SIZE;
+        start = (offset + done) % PAGECACHE_PAGE_SIZE;
+        chunk = PAGECACHE_PAGE_SIZE - start;
+        if (chunk > len - done) chunk = len - done;
+        frame = get_page(cache, fd, gen, page, start + chunk);
+        if (frame == NULL) return 0;
+        memcpy(buf + done, cache->data
+                + (frame - cache->frames) * PAGECACHE_PAGE_SIZE + start,
+                chunk);
+        done += chunk;
+    }
+    return 1;
+}
+
+/*
+ * Returns the frame holding the given page, with at least its first <need>
+ * bytes, reading it from the file if needed.
+ * Returns NULL on errors and on end of file
+ */
+static PageFrame*
+get_page(PageCache *cache, const int fd, const unsigned long gen,
+        const off_t page, const size_t need)
+{
+    long idx;
+    size_t bucket;
+    PageFrame *frame;
+
+    idx = find_page(cache, fd, gen, page);
+    if (idx != -1 && cache->frames[idx].len >= need) {
+        ++cache->hits;
+        cache->frames[idx].referenced = 1;
+        return cache->frames + idx;
+    }
+    ++cache->misses;
+    if (idx == -1) {
+        idx = evict_page(cache);
+        frame = cache->frames + idx;
+        frame->fd = fd;
+        frame->gen = gen;
+        frame->page = page;
+        bucket = bucket_of(cache, fd, gen, page);
+        frame->next = cache->buckets[bucket];
+        cache->buckets[bucket] = idx;
+    }
+    /* the file may have grown past the end of a page read before  */
+    frame = cache->frames + idx;
+    frame->referenced = 1;
+    if (!fill_page(cache, frame) || frame->len < need) return NULL;
+    return frame;
+}
+
+/* Reads as much of the page of <frame> as the file has  */
+static int
+fill_page(PageCache *cache, PageFrame *frame)
+{
+    char *data;
+    ssize_t pread_res;
+
+    data = cache->data + (frame - cache->frames) * PAGECACHE_PAGE_SIZE;
+    frame->len = 0;
+    while (frame->len < PAGECACHE_PAGE_SIZE) {
+        pread_res = pread(frame->fd, data + frame->len,
+                PAGECACHE_PAGE_SIZE - frame->len,
+                frame->page * PAGECACHE_PAGE_SIZE + frame->len);
+        if (pread_res == -1 && errno == EINTR) continue;
+        if (pread_res == -1) {
+            frame->len = 0;
+            return 0;
+        }
+        if (pread_res == 0) break;
+        frame->len += pread_res;
+    }
+    return 1;
+}
+
+/* Returns the index of the frame holding the given page, or -1 if none  */
+static long
+find_page(const PageCache* const cache, const int fd,
+        const unsigned long gen, const off_t page)
+{
+    long idx;
+    const PageFrame *frame;
+
+    idx = cache->buckets[bucket_of(cache, fd, gen, page)];
+    for (; idx != -1; idx = frame->next) {
+        frame = cache->frames + idx;
+        if (frame->page == page && frame->fd == fd && frame->gen == gen) {
+            return idx;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Moves the hand of the clock until it finds a frame that is free or was not
+ * read since the last round, clearing the marks of the ones it passes by.
+ * Returns the index of the frame, now free
+ */
+static long
+evict_page(PageCache *cache)
+{
+    long idx;
+    PageFrame *frame;
+
+    for (;;) {
+        idx = cache->hand;
+        cache->hand = (cache->hand + 1) % cache->no_of_frames;
+        frame = cache->frames + idx;
+        if (frame->fd != -1 && frame->referenced) {
+            frame->referenced = 0;
+            continue;
+        }
+        if (frame->fd != -1) unlink_page(cache, idx);
+        frame->fd = -1;
+        frame->len = 0;
+        return idx;
+    }
+}
+
+static void
+unlink_page(PageCache *cache, const long idx)
+{
+    long *link;
+    const PageFrame *frame = cache->frames + idx;
+
+    link = cache->buckets + bucket_of(cache, frame->fd, frame->gen,
+            frame->page);
+    while (*link != idx) link = &cache->frames[*link].next;
+    *link = frame->next;
+}
+
+static size_t
+bucket_of(const PageCache* const cache, const int fd, const unsigned long gen,
+        const off_t page)
+{
+    unsigned long hash;
+
+    hash = (unsigned long) page * 2654435761UL;
+    hash ^= (unsigned long) fd * 40503UL + gen * 97UL;
+    return (hash ^ (hash >> 16)) & (cache->no_of_buckets - 1);
+}
+
+
+/*
+ * Reads exactly <len> bytes of <fd>, starting at <offset>.
+ * Returns 0 (false) on errors and on end of file
+ */
+static int
+pread_full(const int fd, char *buf, const size_t len, const off_t offset)
+{
+    size_t done = 0;
+    ssize_t pread_res;
+
+    while (done < len) {
+        pread_res = pread(fd, buf + done, len - done, offset + done);
+        if (pread_res == -1 && errno == EINTR) continue;
+        if (pread_res <= 0) return 0;
+        done += pread_res;
+    }
+    return 1;
+}
+
+static void*
+malloc_or_die(const size_t size)
+{
+    void *ptr;
+
+    ptr = malloc(size);
+    if (ptr == NULL) {
+        perror("[FATAL] malloc()");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
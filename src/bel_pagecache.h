@@ -0,0 +1,55 @@
+#ifndef BELPAGECACHE_H_INCLUDED
+#define BELPAGECACHE_H_INCLUDED
+
+#include <stddef.h>
+#include <sys/types.h>
+
+
+/* Files are cached in pages of this many bytes  */
+#define PAGECACHE_PAGE_SIZE 16384
+
+
+typedef struct PageFrame PageFrame;
+
+/*
+ * Cache of the pages of files read with pread(), within a fixed memory
+ * budget. Pages are evicted with the CLOCK algorithm: a hand sweeps over the
+ * frames, sparing the ones read since it last passed by, so that pages read
+ * often stay and the ones read once make room. Files are told apart by their
+ * descriptor and by a generation, which the caller bumps whenever a file
+ * changes other than by growing: pages of old generations are never found
+ * again, and just wait to be evicted
+ */
+typedef struct {
+    PageFrame *frames;
+    char *data;             /* the pages, one per frame  */
+    long *buckets;          /* hash table of frames, -1 for none  */
+    size_t no_of_frames;
+    size_t no_of_buckets;
+    size_t hand;            /* next frame the CLOCK hand looks at  */
+    unsigned long hits;
+    unsigned long misses;
+} PageCache;
+static const PageCache empty_page_cache;
+
+
+/*
+ * Prepares <cache> for use, allocating as many pages as fit in <budget>
+ * bytes (at least one) upfront. Exits on failure
+ */
+extern void bel_pagecache_init_or_die(PageCache*, const size_t budget);
+
+/*
+ * Copies <len> bytes of <fd> (generation <gen>), from <offset> on, into
+ * <buf>, going through the cache. Reads bigger than a quarter of the cache
+ * skip it, so that they do not wipe it out.
+ * Returns 0 (false) on errors and on end of file
+ */
+extern int bel_pagecache_read(PageCache*, const int fd,
+        const unsigned long gen, const off_t offset, const size_t len,
+        char *buf);
+
+/* Gives all the memory held by <cache> back to the system  */
+extern void bel_pagecache_destroy(PageCache*);
+
+#endif	/* BELPAGECACHE_H_INCLUDED */
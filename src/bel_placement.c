@@ -0,0 +1,113 @@
+/* bel_placement - CPU affinity and huge pages  */
+
+/* CPU sets are a GNU extension  */
+#define _GNU_SOURCE
+
+#include "bel_placement.h"
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+
+static int parse_cpu(const char*, char**);
+
+
+/* Whether huge pages were asked for  */
+static int hugepages;
+
+
+int
+bel_parse_cpus(const char *spec, int cpus[MAX_CPUS])
+{
+    int count = 0, first, last;
+    char *endptr;
+
+    for (;;) {
+        first = last = parse_cpu(spec, &endptr);
+        if (first == -1) return 0;
+        if (*endptr == '-') {
+            last = parse_cpu(endptr + 1, &endptr);
+            if (last < first) return 0;
+        }
+        for (; first <= last; ++first) {
+            if (count == MAX_CPUS) return 0;
+            cpus[count++] = first;
+        }
+        if (*endptr == '\0') return count;
+        if (*endptr != ',') return 0;
+        spec = endptr + 1;
+    }
+}
+
+/* Parses a single CPU number. Returns -1 if there is none  */
+static int
+parse_cpu(const char *str, char **endptr)
+{
+    long cpu;
+
+    if (*str < '0' || *str > '9') return -1;
+    cpu = strtol(str, endptr, 10);
+    return cpu < MAX_CPUS ? (int) cpu : -1;
+}
+
+
+void
+bel_pin_to_cpu(const int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        perror("[WARN] sched_setaffinity()");
+        return;
+    }
+    printf("[DEBUG] pinned to CPU '%d'\n", cpu);
+}
+
+
+void
+bel_hugepages_enable(void)
+{
+    hugepages = 1;
+}
+
+void
+bel_hugepages_advise(void *ptr, const size_t len)
+{
+    unsigned long start, end;
+
+    if (!hugepages || len < HUGEPAGE_SIZE) return;
+    start = ((unsigned long) ptr + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+    end = ((unsigned long) ptr + len) & ~(HUGEPAGE_SIZE - 1);
+    if (end <= start) return;
+    if (madvise((void*) start, end - start, MADV_HUGEPAGE) == -1) {
+        perror("[WARN] madvise()");
+    }
+}
+
+void*
+bel_map_shared_or_die(const size_t len)
+{
+    void *ptr = MAP_FAILED;
+    size_t huge_len;
+
+    if (hugepages && len >= HUGEPAGE_SIZE) {
+        huge_len = (len + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+        ptr = mmap(NULL, huge_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ptr != MAP_FAILED) return ptr;
+        printf("[DEBUG] no reserved huge pages, falling back to regular"
+                " ones\n");
+    }
+    ptr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        perror("[FATAL] mmap()");
+        exit(EXIT_FAILURE);
+    }
+    bel_hugepages_advise(ptr, len);
+    return ptr;
+}
@@ -0,0 +1,54 @@
+#ifndef BELPLACEMENT_H_INCLUDED
+#define BELPLACEMENT_H_INCLUDED
+
+#include <stddef.h>
+
+
+/*
+ * Where processes run and how their memory is backed. Processes can be pinned
+ * to a CPU each: memory is then allocated on the NUMA node of that CPU the
+ * first time it is touched, so whatever a process allocates after being
+ * pinned stays local to it. Big buffers can be backed by huge pages, to cut
+ * down on TLB misses
+ */
+
+
+/* Most CPUs a list can hold  */
+#define MAX_CPUS 1024
+
+/* Buffers smaller than a huge page are never worth backing with them  */
+#define HUGEPAGE_SIZE (2UL * 1024 * 1024)
+
+
+/*
+ * Parses a list of CPUs like "0-3,8,10-11" into <cpus>, in the given order.
+ * Returns the number of CPUs in the list, or 0 if it is not valid
+ */
+extern int bel_parse_cpus(const char *spec, int cpus[MAX_CPUS]);
+
+/*
+ * Restricts the calling process to run on <cpu> only. Failures are not fatal,
+ * and only reported
+ */
+extern void bel_pin_to_cpu(const int cpu);
+
+/*
+ * From now on, the functions below back memory with huge pages where they
+ * can. Meant to be called once, before forking
+ */
+extern void bel_hugepages_enable(void);
+
+/*
+ * Asks for transparent huge pages for the (whole, aligned) huge pages within
+ * the <len> bytes at <ptr>. Does nothing unless enabled, or for small buffers
+ */
+extern void bel_hugepages_advise(void *ptr, const size_t len);
+
+/*
+ * Maps <len> bytes of zero-filled memory shared with children forked later,
+ * from the reserved huge pages if enabled and there are enough of them, or
+ * else advised to use transparent ones. Exits on failure
+ */
+extern void* bel_map_shared_or_die(const size_t len);
+
+#endif	/* BELPLACEMENT_H_INCLUDED */
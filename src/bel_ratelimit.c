@@ -0,0 +1,232 @@
+/* bel_ratelimit - Token buckets shared by server processes  */
+
+#include "bel_ratelimit.h"
+#include "bel_common.h"
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+/* Number of entries in the table, must be a power of two  */
+#define RATE_TABLE_SIZE 4096
+
+/* Entries looked at before evicting one to make room  */
+#define RATE_MAX_PROBES 8
+
+/* Tokens are counted in millionths, so that refills need no floating point  */
+#define TOKEN_UNIT 1000000UL
+
+#define NS_PER_SEC 1000000000UL
+
+/*
+ * Tries at taking a busy entry lock before yielding the CPU, and checking
+ * whether its holder is still alive
+ */
+#define LOCK_SPINS 100
+
+
+typedef struct {
+    unsigned long tokens;   /* in TOKEN_UNITs  */
+    unsigned long last_ns;  /* last refill  */
+} Bucket;
+
+typedef struct {
+    pid_t lock;             /* holder, 0 if free  */
+    unsigned long hash;
+    unsigned long last_ns;  /* last use, to choose what to evict  */
+    char key[RATE_KEY_MAXLEN];
+    Bucket buckets[NO_OF_RATES];
+} Entry;
+
+typedef struct {
+    RateLimit limits[NO_OF_RATES];
+    Entry entries[RATE_TABLE_SIZE];
+} RateTable;
+
+
+static Entry* find_entry(const char* const, const unsigned long);
+static void init_entry(Entry*, const char* const, const unsigned long,
+        const unsigned long);
+static void refill(Bucket*, const RateLimit* const, const unsigned long);
+static unsigned long capacity(const RateLimit* const);
+static void lock_entry(Entry*);
+static void unlock_entry(Entry*);
+static unsigned long hash_key(const char*);
+
+
+static const char* const rate_names[NO_OF_RATES] = {"read", "send", "delete"};
+
+static RateTable *table;
+
+
+void
+bel_ratelimit_init_or_die(const RateLimit limits[NO_OF_RATES])
+{
+    table = mmap(NULL, sizeof(RateTable), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED) {
+        perror("[FATAL] mmap()");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(table->limits, limits, sizeof(table->limits));
+}
+
+
+int
+bel_ratelimit_byname(const char* const name)
+{
+    int i;
+
+    for (i = 0; i < NO_OF_RATES; ++i) {
+        if (strcmp(name, rate_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+
+int
+bel_ratelimit_allow(const char* const key, const int rate)
+{
+    Entry *entry;
+    Bucket *bucket;
+    unsigned long now;
+    int allowed;
+
+    if (table->limits[rate].per_sec == 0) return 1;
+    now = bel_clock_ns();
+    entry = find_entry(key, now);
+    bucket = entry->buckets + rate;
+    refill(bucket, table->limits + rate, now);
+    allowed = bucket->tokens >= TOKEN_UNIT;
+    if (allowed) bucket->tokens -= TOKEN_UNIT;
+    entry->last_ns = now;
+    unlock_entry(entry);
+    if (!allowed) printf("[INFO] throttling %s for '%s'\n", key,
+            rate_names[rate]);
+    return allowed;
+}
+
+
+/*
+ * Returns the entry of <key>, locked, creating it if needed. Entries are
+ * never emptied, only replaced: when the probed ones are all taken, the least
+ * recently used among them makes room
+ */
+static Entry*
+find_entry(const char* const key, const unsigned long now)
+{
+    int i;
+    unsigned long hash;
+    Entry *entry, *oldest = NULL;
+
+    hash = hash_key(key);
+    for (i = 0; i < RATE_MAX_PROBES; ++i) {
+        entry = table->entries + ((hash + i) & (RATE_TABLE_SIZE - 1));
+        lock_entry(entry);
+        if (entry->key[0] == '\0') {
+            init_entry(entry, key, hash, now);
+            return entry;
+        }
+        if (entry->hash == hash && strcmp(entry->key, key) == 0) return entry;
+        if (oldest == NULL || entry->last_ns < oldest->last_ns) oldest = entry;
+        unlock_entry(entry);
+    }
+    lock_entry(oldest);
+    init_entry(oldest, key, hash, now);
+    return oldest;
+}
+
+/* Gives <key> a fresh entry, with full buckets  */
+static void
+init_entry(Entry *entry, const char* const key, const unsigned long hash,
+        const unsigned long now)
+{
+    int i;
+
+    entry->hash = hash;
+    entry->last_ns = now;
+    strncpy(entry->key, key, RATE_KEY_MAXLEN - 1);
+    entry->key[RATE_KEY_MAXLEN - 1] = '\0';
+    for (i = 0; i < NO_OF_RATES; ++i) {
+        entry->buckets[i].tokens = capacity(table->limits + i);
+        entry->buckets[i].last_ns = now;
+    }
+}
+
+/* Adds the tokens earned since the last refill, up to the burst size  */
+static void
+refill(Bucket *bucket, const RateLimit* const limit, const unsigned long now)
+{
+    unsigned long elapsed, full;
+
+    elapsed = now - bucket->last_ns;
+    full = capacity(limit);
+    if (elapsed >= full / limit->per_sec * (NS_PER_SEC / TOKEN_UNIT)) {
+        bucket->tokens = full;  /* also keeps the product below in range  */
+    } else {
+        bucket->tokens += elapsed / (NS_PER_SEC / TOKEN_UNIT) * limit->per_sec;
+        if (bucket->tokens > full) bucket->tokens = full;
+    }
+    bucket->last_ns = now;
+}
+
+static unsigned long
+capacity(const RateLimit* const limit)
+{
+    return (limit->burst > 0 ? limit->burst : 1) * TOKEN_UNIT;
+}
+
+/*
+ * Critical sections are a handful of instructions: spins for a while, then
+ * lets the holder run. A holder killed in there would keep the entry locked
+ * for ever, so the lock is taken over from holders that are gone, leaving the
+ * buckets as they were (at worst slightly off)
+ */
+static void
+lock_entry(Entry *entry)
+{
+    int spins = 0;
+    pid_t self, holder;
+
+    self = getpid();
+    for (;;) {
+        holder = *(volatile pid_t*) &entry->lock;
+        if (holder == 0) {
+            if (__sync_bool_compare_and_swap(&entry->lock, 0, self)) return;
+            continue;
+        }
+        if (++spins < LOCK_SPINS) continue;
+        spins = 0;
+        if (kill(holder, 0) == -1 && errno == ESRCH
+                && __sync_bool_compare_and_swap(&entry->lock, holder, self)) {
+            fprintf(stderr, "[WARN] rate limit entry left locked by pid"
+                    " '%ld'\n", (long) holder);
+            return;
+        }
+        sched_yield();
+    }
+}
+
+static void
+unlock_entry(Entry *entry)
+{
+    __sync_lock_release(&entry->lock);
+}
+
+/* FNV-1a  */
+static unsigned long
+hash_key(const char *key)
+{
+    unsigned long hash = 2166136261UL;
+
+    for (; *key != '\0'; ++key) {
+        hash ^= (unsigned char) *key;
+        hash *= 16777619UL;
+    }
+    return hash;
+}
@@ -0,0 +1,50 @@
+#ifndef BELRATELIMIT_H_INCLUDED
+#define BELRATELIMIT_H_INCLUDED
+
+
+/*
+ * Token-bucket rate limits, shared by the server and all of its children.
+ * Every key (a user, an address...) gets a bucket per limited operation,
+ * kept in a fixed-size hash table living in shared memory. Buckets are
+ * refilled lazily when checked, so checking costs O(1) and there is no
+ * background work
+ */
+
+
+/* Operations that can be limited  */
+#define RATE_READ   0
+#define RATE_SEND   1
+#define RATE_DELETE 2
+#define NO_OF_RATES 3
+
+/* Longest key, terminator included  */
+#define RATE_KEY_MAXLEN 64
+
+
+typedef struct {
+    unsigned long per_sec;  /* sustained rate, 0 for no limit  */
+    unsigned long burst;    /* how many can be done in a row  */
+} RateLimit;
+static const RateLimit empty_rate_limit;
+
+
+/*
+ * Maps the shared table and sets the limits of every operation. To be called
+ * once, before forking any child. Exits on failure
+ */
+extern void bel_ratelimit_init_or_die(const RateLimit limits[NO_OF_RATES]);
+
+/*
+ * Returns the index of the operation with the given name ("read", "send" or
+ * "delete"), or -1 if there is none
+ */
+extern int bel_ratelimit_byname(const char* const name);
+
+/*
+ * Takes a token for operation <rate> from the bucket of <key>.
+ * Returns 1 (true) if there was one, 0 (false) if the operation must be
+ * refused
+ */
+extern int bel_ratelimit_allow(const char* const key, const int rate);
+
+#endif	/* BELRATELIMIT_H_INCLUDED */
@@ -0,0 +1,343 @@
+/* bel_repl - Streaming replication of the message storage  */
+
+#include "bel_repl.h"
+#include "msg_storage.h"
+#include "bel_arena.h"
+#include "bel_placement.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NS_PER_SEC 1000000000UL
+
+/* How often the primary looks for changes, in milliseconds  */
+#define REPL_POLL_MS 10
+
+/* Heartbeats a replica can miss before giving up on a connection  */
+#define REPL_MAX_MISSED 3
+
+/* Longest change header  */
+#define REPL_HEADER_MAXLEN (6 * ID_MSGLEN)
+
+
+static int is_gone(const pid_t);
+static void send_change(const int, const MsgLogChange* const,
+        const MsgLogPosition* const);
+static void follow_session(const char* const, const u_short,
+        const char* const, const char* const, MsgLogPosition*);
+static void login_or_die(const int, const char* const, const char* const);
+static int answered_ok(const int);
+static void set_recv_timeout_or_die(const int, const long);
+static void send_ulong(const int, const unsigned long);
+static unsigned long recv_ulong(const int);
+static void nap(const long);
+static int nap_or_stop(const int, const long);
+
+
+/* Memory for the fields received by a replica, reset after each change  */
+static Arena arena;
+
+/* Processes streaming to a replica, 0 for free streams (shared)  */
+static pid_t *streams;
+
+
+void
+bel_repl_init_or_die(void)
+{
+    streams = bel_map_shared_or_die(sizeof(pid_t) * REPL_MAX_STREAMS);
+}
+
+
+int
+bel_repl_admit(void)
+{
+    int i;
+    pid_t holder;
+    const pid_t self = getpid();
+
+    for (i = 0; i < REPL_MAX_STREAMS; ++i) {
+        holder = *(volatile pid_t*) &streams[i];
+        if (holder != 0 && !is_gone(holder)) continue;
+        if (__sync_bool_compare_and_swap(&streams[i], holder, self)) return 1;
+    }
+    return 0;
+}
+
+
+void
+bel_repl_release(void)
+{
+    int i;
+    const pid_t self = getpid();
+
+    if (streams == NULL) return;
+    for (i = 0; i < REPL_MAX_STREAMS; ++i) {
+        __sync_bool_compare_and_swap(&streams[i], self, 0);
+    }
+}
+
+/* Returns 1 (true) if there is no process <pid> anymore  */
+static int
+is_gone(const pid_t pid)
+{
+    return kill(pid, 0) == -1 && errno == ESRCH;
+}
+
+
+void
+bel_repl_serve(const int sockfd, const int stop_fd)
+{
+    int i, count, changed;
+    MsgLogPosition pos[MSG_MAX_SHARDS];
+    MsgLogChange change;
+    unsigned long last_sent, now;
+
+    count = msg_shard_count();
+    if (recv_ulong(sockfd) != (unsigned long) count) {
+        fprintf(stderr, "[WARN] replica has a different number of shards\n");
+        bel_sendall_or_die(sockfd, ANSWER_KO, ANSWER_MSGLEN);
+        return;
+    }
+    bel_sendall_or_die(sockfd, ANSWER_OK, ANSWER_MSGLEN);
+    for (i = 0; i < count; ++i) {
+        pos[i].gen = recv_ulong(sockfd);
+        pos[i].offset = recv_ulong(sockfd);
+    }
+    printf("[INFO] streaming '%d' shards to a replica\n", count);
+
+    last_sent = bel_clock_ns();
+    for (;;) {
+        changed = 0;
+        for (i = 0; i < count; ++i) {
+            if (msg_log_read(i, pos + i, &change)) {
+                send_change(sockfd, &change, pos + i);
+                changed = 1;
+            }
+        }
+        now = bel_clock_ns();
+        if (changed) {
+            last_sent = now;
+        } else if (now - last_sent >= REPL_HEARTBEAT * NS_PER_SEC) {
+            bel_sendfield_or_die(sockfd, "", 0);
+            last_sent = now;
+            changed = 1;    /* no time to rest  */
+        }
+        if (nap_or_stop(stop_fd, changed ? 0 : REPL_POLL_MS)) {
+            printf("[INFO] replication stream stopped\n");
+            return;
+        }
+    }
+}
+
+/* Sends <change>, which brought the log of its shard to <pos>  */
+static void
+send_change(const int sockfd, const MsgLogChange* const change,
+        const MsgLogPosition* const pos)
+{
+    char header[REPL_HEADER_MAXLEN];
+    int header_len;
+
+    header_len = sprintf(header, "%d %d %lu %lu %lu %lu", change->shard,
+            change->reset, pos->gen, pos->offset, change->next_id,
+            change->version);
+    bel_sendfield_or_die(sockfd, header, header_len);
+    bel_sendfield_or_die(sockfd, change->data, change->len);
+}
+
+
+void
+bel_repl_follow(const char* const address, const u_short port,
+        const char* const uname, const char* const pword)
+{
+    const pid_t parent = getppid();
+    pid_t session;
+    MsgLogPosition *positions;
+
+    signal(SIGCHLD, SIG_DFL);   /* the sessions are waited for right here  */
+    bel_arena_init_or_die(&arena, ARENA_BLOCK_SIZE);
+
+    /* shared, so that a new session carries on where the last one stopped */
+    positions = mmap(NULL, sizeof(MsgLogPosition) * MSG_MAX_SHARDS,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (positions == MAP_FAILED) {
+        perror("[FATAL] mmap()");
+        exit(EXIT_FAILURE);
+    }
+    while (getppid() == parent) {
+        fflush(stdout);     /* or the session would print it again  */
+        session = fork();
+        switch (session) {
+        case -1:
+            perror("[FATAL] fork()");
+            exit(EXIT_FAILURE);
+        case 0:
+            follow_session(address, port, uname, pword, positions);
+        }
+        while (waitpid(session, NULL, 0) == -1 && errno == EINTR) continue;
+        printf("[WARN] replication interrupted, reconnecting\n");
+        sleep(REPL_HEARTBEAT);
+    }
+}
+
+/*
+ * Connects to the primary and applies the changes it sends, saving how far
+ * it got into <positions>. Never returns: exits when the connection drops,
+ * and when the process that started it is gone
+ */
+static void
+follow_session(const char* const address, const u_short port,
+        const char* const uname, const char* const pword,
+        MsgLogPosition *positions)
+{
+    int i, sockfd, count;
+    const pid_t parent = getppid();
+    char *header;
+    size_t header_len;
+    MsgLogChange change;
+    MsgLogPosition pos;
+
+    sockfd = bel_connect_or_die(address, port);
+    login_or_die(sockfd, uname, pword);
+    bel_sendall_or_die(sockfd, CMD_REPL, CMD_MSGLEN);
+    if (!answered_ok(sockfd)) {
+        fprintf(stderr, "[FATAL] the primary refused to replicate\n");
+        exit(EXIT_FAILURE);
+    }
+    count = msg_shard_count();
+    send_ulong(sockfd, count);
+    if (!answered_ok(sockfd)) {
+        fprintf(stderr, "[FATAL] the primary has not '%d' shards\n", count);
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < count; ++i) {
+        send_ulong(sockfd, positions[i].gen);
+        send_ulong(sockfd, positions[i].offset);
+    }
+    set_recv_timeout_or_die(sockfd, REPL_HEARTBEAT * REPL_MAX_MISSED);
+    printf("[INFO] replicating from %s\n", address);
+
+    while (getppid() == parent) {
+        header = bel_recvfield_or_die(sockfd, &arena, REPL_HEADER_MAXLEN,
+                &header_len);
+        if (header_len == 0) continue;  /* heartbeat  */
+        change = empty_log_change;
+        if (header == NULL || sscanf(header, "%d %d %lu %lu %lu %lu",
+                &change.shard, &change.reset, &pos.gen, &pos.offset,
+                &change.next_id, &change.version) != 6) {
+            fprintf(stderr, "[FATAL] malformed change from the primary\n");
+            exit(EXIT_FAILURE);
+        }
+        change.data = bel_recvfield_or_die(sockfd, &arena,
+                MSG_LOG_CHANGE_MAXLEN, &change.len);
+        if (change.data == NULL) {
+            fprintf(stderr, "[FATAL] oversized change from the primary\n");
+            exit(EXIT_FAILURE);
+        }
+        msg_log_apply_or_die(&change);
+        positions[change.shard] = pos;
+        bel_arena_reset(&arena);
+    }
+    exit(EXIT_SUCCESS);
+}
+
+static void
+login_or_die(const int sockfd, const char* const uname,
+        const char* const pword)
+{
+    char uname_buf[UNAME_MSGLEN], pword_buf[PWORD_MSGLEN];
+
+    memset(uname_buf, 0, UNAME_MSGLEN);
+    memset(pword_buf, 0, PWORD_MSGLEN);
+    strncpy(uname_buf, uname, UNAME_MSGLEN - 1);
+    strncpy(pword_buf, pword, PWORD_MSGLEN - 1);
+    bel_sendall_or_die(sockfd, uname_buf, UNAME_MSGLEN);
+    bel_sendall_or_die(sockfd, pword_buf, PWORD_MSGLEN);
+    if (!answered_ok(sockfd)) {
+        fprintf(stderr, "[FATAL] the primary refused the login\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static int
+answered_ok(const int sockfd)
+{
+    char answer[ANSWER_MSGLEN];
+
+    bel_recvall_or_die(sockfd, answer, ANSWER_MSGLEN);
+    return strcmp(answer, ANSWER_OK) == 0;
+}
+
+static void
+set_recv_timeout_or_die(const int sockfd, const long seconds)
+{
+    struct timeval timeout;
+
+    timeout.tv_sec = seconds;
+    timeout.tv_usec = 0;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+            sizeof(timeout)) == -1) {
+        perror("[FATAL] setsockopt()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void
+send_ulong(const int sockfd, const unsigned long value)
+{
+    char buf[ID_MSGLEN];
+
+    memset(buf, 0, ID_MSGLEN);
+    sprintf(buf, "%lu", value);
+    bel_sendall_or_die(sockfd, buf, ID_MSGLEN);
+}
+
+/* Returns the number received, or 0 if it is not a valid one  */
+static unsigned long
+recv_ulong(const int sockfd)
+{
+    char buf[ID_MSGLEN];
+    char *endptr = NULL;
+    unsigned long value;
+
+    bel_recvall_or_die(sockfd, buf, ID_MSGLEN);
+    value = strtoul(buf, &endptr, 10);
+    return endptr == buf || *endptr ? 0 : value;
+}
+
+static void
+nap(const long ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+}
+
+/*
+ * Naps for <ms> milliseconds, unless <stop_fd> (if not 0) becomes readable or
+ * hangs up meanwhile.
+ * Returns 1 (true) if it did
+ */
+static int
+nap_or_stop(const int stop_fd, const long ms)
+{
+    struct pollfd pfd;
+
+    if (stop_fd == 0) {
+        if (ms > 0) nap(ms);
+        return 0;
+    }
+    pfd.fd = stop_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, ms) > 0 && pfd.revents != 0;
+}
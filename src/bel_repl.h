@@ -0,0 +1,60 @@
+#ifndef BELREPL_H_INCLUDED
+#define BELREPL_H_INCLUDED
+
+#include "bel_common.h"
+
+
+/*
+ * Streaming replication. A replica logs into its primary like any client and
+ * sends CMD_REPL; once the primary answers OK, the replica sends the number
+ * of shards it has, which the primary answers OK if it matches its own, KO
+ * otherwise. Then the replica sends, for each shard, how far it got in the
+ * log of the primary (generation and offset). Numbers travel as decimal
+ * strings of ID_MSGLEN bytes.
+ * From then on the primary only sends, as soon as they happen, the changes
+ * to its logs: a header field with "<shard> <reset> <generation> <offset>
+ * <next id> <version>", followed by a field with the data. An empty header
+ * is a heartbeat, sent whenever there is nothing else to send for a while
+ */
+
+
+/* Seconds between heartbeats. Replicas give up after missing a few  */
+#define REPL_HEARTBEAT 1
+
+/* Replicas a primary streams to at the same time  */
+#define REPL_MAX_STREAMS 4
+
+/*
+ * Maps the shared memory tracking the replication streams. To be called
+ * once, before forking any child. Exits on failure
+ */
+extern void bel_repl_init_or_die(void);
+
+/*
+ * Takes one of the REPL_MAX_STREAMS streams for the calling process, those
+ * of processes that are gone being up for grabs.
+ * Returns 0 (false) if they are all taken
+ */
+extern int bel_repl_admit(void);
+
+/* Gives back the stream of the calling process, if it has one  */
+extern void bel_repl_release(void);
+
+/*
+ * Primary side: serves a replica connected through <sockfd>, which has just
+ * been admitted and answered OK to CMD_REPL. Only returns if the replica is
+ * not compatible, or once <stop_fd> (unless 0) becomes readable or hangs up;
+ * disconnections are dealt with like in any other connection
+ */
+extern void bel_repl_serve(const int sockfd, const int stop_fd);
+
+/*
+ * Replica side: keeps the local database a copy of the one of the primary at
+ * <address> and <port>, logging in with the given credentials, and
+ * reconnecting whenever the connection drops. Only returns when the parent
+ * process is gone
+ */
+extern void bel_repl_follow(const char* const address, const u_short port,
+        const char* const uname, const char* const pword);
+
+#endif	/* BELREPL_H_INCLUDED */
@@ -0,0 +1,521 @@
+/*
+ * bel_replay.c - Replays a trace recorded by bel_server -t against a server
+ *
+ * General considerations:
+ * - every traced connection is replayed by its own process, started when the
+ *      original one logged in, which issues the same commands with the same
+ *      arguments, each one at the time the server received it
+ * - times can be scaled down by a speed factor, or ignored altogether: then
+ *      connections start right away and issue their commands back to back,
+ *      still in their original order
+ * - as in bench, latency is measured from the scheduled time rather than from
+ *      the actual send, so that a stalling server is not under-reported
+ * - the trace holds no passwords: users log in with the ones given with -l,
+ *      or else with the default one
+ * - commands are replayed verbatim, so a DELETE succeeds only if the server
+ *      holds the same messages as the traced one did: start it from a copy
+ *      of the database of the traced run
+ * - replication streams (REPL) are not replayed, and connections whose login
+ *      was not traced are skipped
+ */
+
+#include "bel_arena.h"
+#include "bel_common.h"
+#include "bel_loadgen.h"
+#include "bel_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+#define NO_OF_OPS 8
+#define OP_READ     0
+#define OP_READIF   1
+#define OP_SEND     2
+#define OP_SENDEX   3
+#define OP_DELETE   4
+#define OP_STATS    5
+#define OP_CHANNEL  6
+#define OP_OTHER    7   /* unknown to the server, answered with KO  */
+
+#if NO_OF_OPS > LOADGEN_MAX_OPS
+#error "more commands than bel_loadgen tells apart"
+#endif
+
+/* Not replayed  */
+#define OP_SKIP     -1
+
+#define MAX_LOGINS 16
+
+#define NS_PER_SEC 1000000000UL
+#define NS_PER_USEC 1000UL
+
+
+typedef struct {
+    const char *uname;
+    const char *pword;
+} Login;
+
+/* Settings coming from the command line  */
+typedef struct {
+    double speed;       /* 1 for the original pace, 0 for no pace at all  */
+    Login logins[MAX_LOGINS];
+    int no_of_logins;
+    const char *pword;  /* for users with no login of their own  */
+    const char *trace_path;
+    const char *address;
+    u_short port;
+} Config;
+
+/* The records of a traced connection, contiguous once sorted  */
+typedef struct {
+    size_t first;
+    size_t count;
+} Connection;
+
+
+static void parse_options_or_die(int, char**);
+static void parse_login_or_die(char*);
+static void usage_and_die(void);
+
+static size_t sort_connections_or_die(Connection**);
+static int compare_records(const void*, const void*);
+static int compare_connections(const void*, const void*);
+static unsigned long scheduled_time(const unsigned long);
+static void reap_children(const int, int*, int*);
+
+static void run_connection(const Connection* const);
+static void authenticate_or_die(const TraceRecord* const);
+static int op_of(const TraceRecord* const);
+static int replay(const int, const TraceRecord* const);
+
+static int do_read(const TraceRecord* const);
+static int do_readif(const TraceRecord* const);
+static int do_send(const TraceRecord* const, const int);
+static int do_delete(const TraceRecord* const);
+static int do_channel(const TraceRecord* const);
+static int do_other(const TraceRecord* const);
+static void send_text(const TraceRecord* const, const int);
+static int ok_from_server(void);
+static void recv_answer(char*);
+
+
+static const char* const op_names[NO_OF_OPS] =
+        {"READ", "READIF", "SEND", "SENDEX", "DELETE", "STATS", "CHAN",
+        "OTHER"};
+
+/* Fields every traced command has, its name included  */
+static const int op_fields[NO_OF_OPS] = {1, 2, 3, 4, 2, 1, 2, 1};
+
+static Config config;
+static LoadResults *results;
+
+/* The trace, and when it starts  */
+static TraceRecord *records;
+static unsigned long trace_start_us;
+static unsigned long replay_start_ns;
+
+/* Per-process state of a connection  */
+static int sockfd;
+static Arena arena;
+
+
+/* Replay entry point  */
+int
+main(int argc, char **argv)
+{
+    size_t i, count;
+    int running = 0, failed = 0;
+    Connection *conns;
+
+    parse_options_or_die(argc, argv);
+    results = bel_loadgen_map_results_or_die();
+    count = sort_connections_or_die(&conns);
+    printf("replaying %lu connections of '%s' against %s, speed ",
+            (unsigned long) count, config.trace_path, config.address);
+    if (config.speed > 0) printf("%.2fx\n", config.speed);
+    else printf("unlimited\n");
+    fflush(stdout);
+
+    replay_start_ns = bel_clock_ns();
+    for (i = 0; i < count; ++i) {
+        bel_loadgen_sleep_until(
+                scheduled_time(records[conns[i].first].time_us));
+        reap_children(0, &running, &failed);
+        switch (fork()) {
+        case -1:
+            perror("[FATAL] fork()");
+            exit(EXIT_FAILURE);
+        case 0:
+            run_connection(conns + i);
+            exit(EXIT_SUCCESS);
+        default:
+            ++running;
+            break;
+        }
+    }
+    reap_children(1, &running, &failed);
+    bel_loadgen_print_report(results, op_names, NO_OF_OPS, 1, failed,
+            (double) (bel_clock_ns() - replay_start_ns) / NS_PER_SEC);
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/* Fills the global configuration from the command line options  */
+static void
+parse_options_or_die(int argc, char **argv)
+{
+    int opt;
+
+    config.speed = 1.0;
+    config.pword = "test1234";
+    config.port = COMM_PORT;
+    while ((opt = getopt(argc, argv, "s:l:p:P:")) != -1) {
+        switch (opt) {
+        case 's': config.speed = atof(optarg);                  break;
+        case 'l': parse_login_or_die(optarg);                   break;
+        case 'p': config.pword = optarg;                        break;
+        case 'P': config.port = atoi(optarg);                   break;
+        default:  usage_and_die();
+        }
+    }
+    if (optind != argc - 2 || config.speed < 0 || config.port == 0
+            || strlen(config.pword) >= PWORD_MSGLEN) {
+        usage_and_die();
+    }
+    config.trace_path = argv[optind];
+    config.address = argv[optind + 1];
+}
+
+/* Parses a "<user>:<password>" login  */
+static void
+parse_login_or_die(char *spec)
+{
+    char *colon;
+    Login *login;
+
+    colon = strchr(spec, ':');
+    if (colon == NULL || config.no_of_logins == MAX_LOGINS) usage_and_die();
+    *colon = '\0';
+    login = config.logins + config.no_of_logins++;
+    login->uname = spec;
+    login->pword = colon + 1;
+    if (strlen(login->uname) >= UNAME_MSGLEN
+            || strlen(login->pword) >= PWORD_MSGLEN) {
+        usage_and_die();
+    }
+}
+
+static void
+usage_and_die(void)
+{
+    printf("usage: replay [options] <trace file> <remote address or local"
+            " socket path>\n"
+            "  -s  speed, as a multiple of the original one; 0 to issue the\n"
+            "      commands as fast as possible (default 1)\n"
+            "  -l  password of a user, as <user>:<password>; can be\n"
+            "      repeated, up to %d times\n"
+            "  -p  password of the users not given with -l"
+            " (default test1234)\n"
+            "  -P  port of the server (default %d)\n", MAX_LOGINS, COMM_PORT);
+    exit(EXIT_FAILURE);
+}
+
+
+/*
+ * Loads the trace and sorts its records by connection, and then by time.
+ * Saves into <conns> where the records of each connection are, in order of
+ * start time.
+ * Returns the number of connections
+ */
+static size_t
+sort_connections_or_die(Connection **conns)
+{
+    size_t i, count, no_of_conns = 0;
+
+    count = bel_trace_load_or_die(config.trace_path, &records);
+    *conns = malloc(count * sizeof(Connection) + 1);
+    if (*conns == NULL) {
+        perror("[FATAL] malloc()");
+        exit(EXIT_FAILURE);
+    }
+    qsort(records, count, sizeof(TraceRecord), compare_records);
+    for (i = 0; i < count; ++i) {
+        if (i == 0 || records[i].time_us < trace_start_us) {
+            trace_start_us = records[i].time_us;
+        }
+        if (i == 0 || records[i].conn != records[i - 1].conn) {
+            (*conns)[no_of_conns].first = i;
+            (*conns)[no_of_conns++].count = 0;
+        }
+        ++(*conns)[no_of_conns - 1].count;
+    }
+    qsort(*conns, no_of_conns, sizeof(Connection), compare_connections);
+    return no_of_conns;
+}
+
+/*
+ * Orders records by connection, then by time. Records of a connection come
+ * from a single process, in order, so equal times keep their file order,
+ * which the addresses of the records follow
+ */
+static int
+compare_records(const void *a, const void *b)
+{
+    const TraceRecord *ra = a, *rb = b;
+
+    if (ra->conn != rb->conn) return ra->conn < rb->conn ? -1 : 1;
+    if (ra->time_us != rb->time_us) return ra->time_us < rb->time_us ? -1 : 1;
+    return ra->fields[0] < rb->fields[0] ? -1
+            : ra->fields[0] > rb->fields[0];
+}
+
+/* Orders connections by the time of their first record  */
+static int
+compare_connections(const void *a, const void *b)
+{
+    unsigned long ta, tb;
+
+    ta = records[((const Connection*) a)->first].time_us;
+    tb = records[((const Connection*) b)->first].time_us;
+    return ta < tb ? -1 : ta > tb;
+}
+
+/* Returns when something traced at <time_us> has to be replayed  */
+static unsigned long
+scheduled_time(const unsigned long time_us)
+{
+    if (config.speed == 0) return replay_start_ns;
+    return replay_start_ns + (unsigned long)
+            ((time_us - trace_start_us) * NS_PER_USEC / config.speed);
+}
+
+/*
+ * Collects the connection processes that are over, counting the ones that
+ * failed. With <all>, waits for all of them
+ */
+static void
+reap_children(const int all, int *running, int *failed)
+{
+    int status;
+    pid_t pid;
+
+    while (*running > 0) {
+        pid = waitpid(-1, &status, all ? 0 : WNOHANG);
+        if (pid <= 0) break;
+        --*running;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            ++*failed;
+        }
+    }
+}
+
+
+/*
+ * Body of the process replaying <conn>. Its standard output is thrown away,
+ * since it would be flooded by the traces of bel_common
+ */
+static void
+run_connection(const Connection* const conn)
+{
+    size_t i;
+    int op, ok;
+    unsigned long begin;
+    const TraceRecord *rec = records + conn->first;
+
+    if (freopen("/dev/null", "w", stdout) == NULL) {
+        perror("[FATAL] freopen()");
+        exit(EXIT_FAILURE);
+    }
+    if (rec->event != TRACE_LOGIN || rec->no_of_fields != 1) {
+        __sync_fetch_and_add(&results->skipped, 1UL);
+        return;
+    }
+    bel_arena_init_or_die(&arena, ARENA_BLOCK_SIZE);
+    sockfd = bel_connect_or_die(config.address, config.port);
+    authenticate_or_die(rec);
+
+    for (i = 1, ++rec; i < conn->count && rec->event != TRACE_CLOSE;
+            ++i, ++rec) {
+        op = op_of(rec);
+        if (op == OP_SKIP) {
+            __sync_fetch_and_add(&results->skipped, 1UL);
+            continue;
+        }
+        begin = scheduled_time(rec->time_us);
+        bel_loadgen_sleep_until(begin);
+        if (config.speed == 0) begin = bel_clock_ns();
+        ok = replay(op, rec);
+        bel_hist_record(&results->latency[op], bel_clock_ns() - begin);
+        if (!ok) __sync_fetch_and_add(&results->ko[op], 1UL);
+        bel_arena_reset(&arena);
+    }
+    bel_close_or_die(sockfd);
+}
+
+/* Logs in as the user of the LOGIN record <rec>  */
+static void
+authenticate_or_die(const TraceRecord* const rec)
+{
+    int i;
+    char uname[UNAME_MSGLEN] = "", pword[PWORD_MSGLEN] = "";
+
+    if (rec->lens[0] >= UNAME_MSGLEN) {
+        fprintf(stderr, "[FATAL] invalid user name in the trace\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(uname, rec->fields[0], rec->lens[0]);
+    strcpy(pword, config.pword);
+    for (i = 0; i < config.no_of_logins; ++i) {
+        if (strcmp(uname, config.logins[i].uname) == 0) {
+            strcpy(pword, config.logins[i].pword);
+        }
+    }
+    bel_sendall_or_die(sockfd, uname, UNAME_MSGLEN);
+    bel_sendall_or_die(sockfd, pword, PWORD_MSGLEN);
+    if (!ok_from_server()) {
+        fprintf(stderr, "[FATAL] authentication failed for '%s'\n", uname);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Returns the OP_* of the command in <rec>, or OP_SKIP  */
+static int
+op_of(const TraceRecord* const rec)
+{
+    int op;
+    char name[CMD_MSGLEN + 1] = "";
+
+    if (rec->event != TRACE_COMMAND || rec->no_of_fields < 1
+            || rec->lens[0] != CMD_MSGLEN) {
+        return OP_SKIP;
+    }
+    memcpy(name, rec->fields[0], CMD_MSGLEN);
+    if (strcmp(name, CMD_REPL) == 0) return OP_SKIP;
+    for (op = 0; op < OP_OTHER; ++op) {
+        if (strcmp(name, op_names[op]) == 0) break;
+    }
+    return rec->no_of_fields < op_fields[op] ? OP_SKIP : op;
+}
+
+/* Issues the command in <rec>. Returns 0 (false) if it was refused  */
+static int
+replay(const int op, const TraceRecord* const rec)
+{
+    switch (op) {
+    case OP_READ:
+    case OP_STATS:  return do_read(rec);
+    case OP_READIF: return do_readif(rec);
+    case OP_SEND:   return do_send(rec, 0);
+    case OP_SENDEX: return do_send(rec, 1);
+    case OP_DELETE: return do_delete(rec);
+    case OP_CHANNEL: return do_channel(rec);
+    default:        return do_other(rec);
+    }
+}
+
+/* READ and STATS: an answer and then a field, unless throttled  */
+static int
+do_read(const TraceRecord* const rec)
+{
+    size_t len;
+
+    bel_sendall_or_die(sockfd, rec->fields[0], CMD_MSGLEN);
+    if (!ok_from_server()) return 0;
+    return bel_recvfield_or_die(sockfd, &arena, MSG_LIST_MAXLEN, &len)
+            != NULL;
+}
+
+static int
+do_readif(const TraceRecord* const rec)
+{
+    char answer[ANSWER_MSGLEN], version[VERSION_MSGLEN];
+    size_t len;
+
+    bel_sendall_or_die(sockfd, rec->fields[0], CMD_MSGLEN);
+    if (!ok_from_server()) return 0;
+    bel_sendall_or_die(sockfd, rec->fields[1], rec->lens[1]);
+    recv_answer(answer);
+    if (strcmp(answer, ANSWER_NOT_MODIFIED) == 0) return 1;
+    if (strcmp(answer, ANSWER_OK) != 0) return 0;
+    bel_recvall_or_die(sockfd, version, VERSION_MSGLEN);
+    return bel_recvfield_or_die(sockfd, &arena, MSG_LIST_MAXLEN, &len)
+            != NULL;
+}
+
+/* SEND, or SENDEX if <with_ttl>  */
+static int
+do_send(const TraceRecord* const rec, const int with_ttl)
+{
+    bel_sendall_or_die(sockfd, rec->fields[0], CMD_MSGLEN);
+    if (!ok_from_server()) return 0;
+    if (with_ttl) bel_sendall_or_die(sockfd, rec->fields[1], rec->lens[1]);
+    send_text(rec, with_ttl + 1);
+    send_text(rec, with_ttl + 2);
+    return ok_from_server();
+}
+
+/* Deletes the traced ID, whatever the list says  */
+static int
+do_delete(const TraceRecord* const rec)
+{
+    size_t len;
+
+    bel_sendall_or_die(sockfd, rec->fields[0], CMD_MSGLEN);
+    if (!ok_from_server()) return 0;
+    bel_recvfield_or_die(sockfd, &arena, MSG_LIST_MAXLEN, &len);
+    bel_sendall_or_die(sockfd, rec->fields[1], rec->lens[1]);
+    return ok_from_server();
+}
+
+/* Selects the traced channel, for the commands that follow  */
+static int
+do_channel(const TraceRecord* const rec)
+{
+    bel_sendall_or_die(sockfd, rec->fields[0], CMD_MSGLEN);
+    if (!ok_from_server()) return 0;
+    bel_sendall_or_die(sockfd, rec->fields[1], rec->lens[1]);
+    return ok_from_server();
+}
+
+static int
+do_other(const TraceRecord* const rec)
+{
+    bel_sendall_or_die(sockfd, rec->fields[0], CMD_MSGLEN);
+    return ok_from_server();
+}
+
+/*
+ * Sends the subject or body in field <i> of <rec>. Fields the server threw
+ * away, being too long, are sent too long for any server
+ */
+static void
+send_text(const TraceRecord* const rec, const int i)
+{
+    char *text;
+
+    if (rec->lens[i] != TRACE_DROPPED) {
+        bel_sendfield_or_die(sockfd, rec->fields[i], rec->lens[i]);
+        return;
+    }
+    text = bel_arena_zalloc_or_die(&arena, TXT_MAXLEN_LIMIT + 1);
+    bel_sendfield_or_die(sockfd, text, TXT_MAXLEN_LIMIT + 1);
+}
+
+static int
+ok_from_server(void)
+{
+    char answer[ANSWER_MSGLEN];
+
+    recv_answer(answer);
+    return strcmp(answer, ANSWER_OK) == 0;
+}
+
+static void
+recv_answer(char *answer)
+{
+    bel_recvall_or_die(sockfd, answer, ANSWER_MSGLEN);
+    answer[ANSWER_MSGLEN - 1] = '\0';
+}
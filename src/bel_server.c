@@ -2,27 +2,96 @@
  * bel_server.c - Server part of the OS1 assignment
  *
  * General considerations:
- * - communication protocol is based on fixed-length messages
+ * - communication protocol is based on fixed-length messages, except for
+ * the message text and lists, which are sent as length-prefixed fields
  * - every communication failure with a specific client will close that
  * connection and abort the process assigned to it
+ * - resources stay bounded: connections over the limit are turned away right
+ * after accept(), idle ones are closed after a timeout, dead peers are found
+ * by TCP keepalive, and peers that stop reading are disconnected once their
+ * (capped) send buffer stays full for a whole timeout
+ * - reads, sends and deletes can be rate limited, both per user and per
+ * client address, and refused requests get a "throttled" answer
+ * - by default every connection gets a freshly forked process. With -w, a
+ * pool of pre-forked workers accept() on the listening socket and serve one
+ * connection after the other instead, while the parent respawns any worker
+ * that dies
+ * - messages live in channels, each one with its own files, index and locks:
+ * a connection works on the default channel until it selects another one,
+ * and stays there for all the commands that follow. Only the default channel
+ * is replicated
+ * - besides TCP, the server can listen on a local (AF_UNIX) socket, for
+ * clients on the same host: both are served the same way, by whichever
+ * process accept()s first
+ * - with -R the server is a read-only replica of another one: a replicator
+ * process follows the logs of the primary and applies them to the local
+ * database, and SEND and DELETE are refused. Replicas can be chained
+ * - with -a, workers (or the processes forked for each connection) are pinned
+ * to the given CPUs in turn, and allocate their buffers after that, on the
+ * NUMA node of their CPU. With -H, the in-memory boards and the writer queue
+ * are backed by huge pages
+ * - with -W, stores and deletions are not applied by the processes serving
+ * connections but queued to a single writer process, which applies them in
+ * batches: the more writes come at once, the fewer locks and file writes
+ * they take
+ * - with -t, every login and every command received, arguments included, is
+ * appended to a trace file as it is served, for bin/replay to play it again
+ * later. Passwords are left out of the trace
+ * - with -s, every connection records how long each stage of its commands
+ * takes (receiving, the storage, formatting, sending) into rings in shared
+ * memory, and SIGUSR1 makes the server dump the latest spans of all of them
+ * as a Chrome trace, for chrome://tracing or Perfetto
+ * - with -X, a new server can take over from a running one without dropping
+ * anything: it is passed the listening sockets through the handoff socket,
+ * and then, once it is ready, every connection of the old server, each one as
+ * soon as it is between two commands. Connections taken over are served by
+ * processes of their own, forked by the handoff process, even with -w
+ * - with -e, or a retention policy, a sweeper process deletes, a batch at a
+ * time, the messages past their time to live and the oldest ones breaking the
+ * retention policy, and keeps a snapshot of the database for quick restarts
  */
 
 #include "msg_storage.h"
+#include "bel_arena.h"
 #include "bel_common.h"
+#include "bel_handoff.h"
+#include "bel_metrics.h"
+#include "bel_placement.h"
+#include "bel_ratelimit.h"
+#include "bel_repl.h"
+#include "bel_simd.h"
+#include "bel_spans.h"
+#include "bel_trace.h"
+#include "bel_writer.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 
 /* Number of (hardcoded) registered users in the system  */
 #define NO_OF_USERS 3
 
-#define NO_OF_COMMANDS 3
+#define NO_OF_COMMANDS 8
 
 #define DB_FILENAME "db.txt"
 
-/* How many messages can be read at once  */
-#define MSG_LIST_SIZE 10
+/* User a replica logs into its primary with, when $BEL_REPL_USER is unset  */
+#define REPL_DEFAULT_USER "admin"
+
+/* Messages the sweeper deletes from each shard before looking again  */
+#define SWEEP_BATCH 256
 
 
 typedef struct {
@@ -34,28 +103,122 @@ static const Credentials empty_credentials;
 typedef struct {
     char name[CMD_MSGLEN];
     Action action;
+    int metric;     /* which METRIC_* tracks it  */
+    int rate;       /* which RATE_* limits it, or -1  */
+    int has_payload;
 } Command;
 
+/* Settings coming from the command line  */
+typedef struct {
+    size_t txt_maxlen;  /* longest subject or body accepted  */
+    long idle_timeout;  /* seconds, 0 for none  */
+    long keepalive;     /* seconds of silence before probing, 0 for none  */
+    long max_conns;
+    long sndbuf;        /* bytes, 0 for the system default  */
+    RateLimit limits[NO_OF_RATES];
+    long workers;       /* size of the pre-forked pool, 0 for none  */
+    int shards;         /* database files  */
+    long cache_budget;  /* bytes of text cached, 0 to keep all of it  */
+    RetentionPolicy retention;
+    long sweep_interval;    /* seconds between sweeps, 0 for no sweeper  */
+    const char *local_path; /* of the AF_UNIX socket, NULL for none  */
+    u_short port;
+    const char *db_path;
+    const char *primary;    /* address of the primary, NULL if not a replica */
+    u_short primary_port;
+    const char *repl_user;
+    const char *repl_password;
+    int writer;         /* whether writes go through a writer process  */
+    int cpus[MAX_CPUS]; /* to pin processes serving connections to  */
+    int no_of_cpus;
+    int hugepages;
+    const char *trace_path; /* where to trace the traffic, NULL for none  */
+    const char *spans_path; /* where to dump the spans, NULL for none  */
+    const char *handoff_path;   /* of the handoff socket, NULL for none  */
+} Config;
+
+
+static void parse_options_or_die(int, char**);
+static long parse_long_or_die(const char* const, const long, const long);
+static void parse_limit_or_die(char*);
+static void usage_and_die(void);
 
 static void bind_to_port(u_short);
 static int do_bind(struct addrinfo*);
 static void set_reuseaddr_or_die(void);
-static void do_listen_or_die(void);
+static void do_listen_or_die(const int);
+static void bind_local_or_die(const char* const);
+static void remove_local_socket(void);
+static void take_listeners(const int*, const int);
+static u_short bound_port(const int);
+static int is_bound_to(const int, const char* const);
+static void open_lifeline_or_die(void);
+static void close_lifeline_writer(void);
+static int lifeline_cut(const int);
+static void set_nonblocking_or_die(const int, const int);
 
 static void server_loop(void);
+static void supervise_workers(void);
+static pid_t spawn_worker_or_die(const long);
+static void pin_to_cpu(const unsigned long);
+static void worker_loop(void);
+static pid_t spawn_helper_or_die(void (*)(void));
+static void close_listeners(void);
+static void sweeper_loop(void);
+static void replicator_loop(void);
+static void writer_loop(void);
+static void handoff_loop(void);
+static void give_listeners(const int);
+static void adopt_connection(const int, const int,
+        const HandoffSession* const);
+static void set_handover_handler_or_die(void);
+static void request_handover(int);
+static void set_dump_handler_or_die(void);
+static void request_dump(int);
+static void ignore_dump_requests(void);
+static void dump_spans(void);
+static void hand_over(void);
+static void end_connection(void);
+static void close_connection(void);
+static void set_sigchld_handler_or_die(void);
+static void reap_children(int);
+static void count_child(void);
 static int accept_incoming(void);
+static int wait_for_listener(void);
+static void reject_incoming(void);
+static void configure_connection_or_die(void);
+static void set_timeout_or_die(const int, const long);
 static void handle_client(void);
+static void serve_connection(void);
+static void wait_for_command(void);
+static void hand_over_connection(void);
 static void authenticate_or_die(void);
+static void trace_login(void);
 static int is_valid_login(const Credentials);
+static int is_allowed(const Command* const);
+static int is_permitted(const Command* const);
 
-static Action receive_client_command(void);
+static const Command* receive_client_command(void);
 static void handle_read(void);
+static void handle_readif(void);
+static void send_message_list(void);
 static void handle_send(void);
+static void handle_sendex(void);
+static void receive_and_store(const long);
 static void handle_delete(void);
+static void handle_stats(void);
+static void handle_repl(void);
+static void handle_channel(void);
+static int refuse_if_replica(void);
+
+static const char* recv_text_field(size_t*);
 
 static void send_ok(void);
 static void send_ko(void);
+static void send_throttled(void);
+
 
+static Config config;
 
 /*
  * (file descriptor of) the main server socket, which handles new client
@@ -63,16 +226,88 @@ static void send_ko(void);
  */
 static int sockfd;
 
+/* (file descriptor of) the local socket, if any  */
+static int sockfd_local;
+
+/* The process that created the local socket, and has to remove it  */
+static pid_t local_owner;
+
+/* (file descriptor of) the handoff socket, and the process that made it  */
+static int sockfd_handoff;
+static pid_t handoff_owner;
+
+/*
+ * Pipe that only the main process writes to: it closes it to tell all the
+ * others that the server is handing over (or gone). 0 for none
+ */
+static int lifeline_rd;
+static int lifeline_wr;
+
+/* Connection to the old server, to confirm taking over on, or -1  */
+static int handoff_conn = -1;
+
+/* Whether this process failed to pass its connection on, and keeps it  */
+static int keeps_connection;
+
 /*
  * (file descriptor of) the socket used to communicate with the client. Each
  * process has its own
  */
 static int sockfd_acc;
 
+/* Whether the client being served came through the local socket  */
+static int current_is_local;
+
+/* Whether this process is a worker of the pre-forked pool  */
+static int is_worker;
+
+/* Where a worker goes back to when its current connection is over  */
+static jmp_buf connection_over;
+
+/* Number of children serving a connection. Updated on SIGCHLD  */
+static volatile sig_atomic_t active_children;
+
+/* The sweeper process, and whether it has died and must be replaced  */
+static pid_t sweeper_pid;
+static volatile sig_atomic_t sweeper_died;
+
+/* Same for the replicator process, on replicas  */
+static pid_t replicator_pid;
+static volatile sig_atomic_t replicator_died;
+
+/* Same for the writer process, with -W  */
+static pid_t writer_pid;
+static volatile sig_atomic_t writer_died;
+
+/* Same for the handoff process, with -X  */
+static pid_t handoff_pid;
+static volatile sig_atomic_t handoff_died;
+
+/* Whether the new server is ready, and this one has to hand over  */
+static volatile sig_atomic_t handover_requested;
+
+/* Whether the spans have to be dumped, with -s  */
+static volatile sig_atomic_t dump_requested;
+
 
 /* Name of the user being served right now  */
 static char current_user[UNAME_MSGLEN];
 
+/* Address of the client being served right now  */
+static char current_ip[INET6_ADDRSTRLEN];
+
+/* Whether the request being served has been refused by rate limiting  */
+static int current_throttled;
+
+/* Metric of the command being served right now, or -1  */
+static int current_metric = -1;
+
+/*
+ * Memory for the buffers needed while serving a single request. Each process
+ * serves one connection, and the arena is reset after every request
+ */
+static Arena conn_arena;
+
 
 /*
  * Explicitly closes the resources acquired by the current process. Called on
@@ -83,28 +318,283 @@ cleanup(void)
 {
     printf("[DEBUG] resource cleanup\n");
     if (sockfd != 0) bel_close_or_die(sockfd);
+    if (sockfd_local != 0) bel_close_or_die(sockfd_local);
     if (sockfd_acc != 0) bel_close_or_die(sockfd_acc);
+    if (sockfd_handoff != 0) bel_close_or_die(sockfd_handoff);
+    remove_local_socket();
+    if (handoff_owner == getpid()) unlink(config.handoff_path);
 }
 
 
 /* Server entry point  */
 int
-main(void)
+main(int argc, char **argv)
 {    
+    int fds[HANDOFF_MAX_FDS], count;
+
+    parse_options_or_die(argc, argv);
     printf("[DEBUG] program started with pid = '%ld'\n", (long) getpid());
+    if (config.hugepages) bel_hugepages_enable();
+    printf("[DEBUG] text routines use '%s' instructions\n", bel_simd_name());
     atexit(cleanup);
-    bind_to_port(COMM_PORT);
+    if (config.handoff_path != NULL) {
+        handoff_conn = bel_handoff_request_or_die(config.handoff_path, fds,
+                &count);
+        if (handoff_conn != -1) take_listeners(fds, count);
+    }
+    if (sockfd == 0) bind_to_port(config.port);
     
     /* still not listening though, but we cannot print this after the fact */
-    printf("server listening on port %d\n", COMM_PORT);
+    printf("server listening on port %d\n", config.port);
     
-    do_listen_or_die();
-    msg_init_db_or_die(DB_FILENAME);
-    server_loop();
+    do_listen_or_die(sockfd);
+    if (config.local_path != NULL) {
+        if (sockfd_local == 0) bind_local_or_die(config.local_path);
+        do_listen_or_die(sockfd_local);
+        printf("server listening on local socket %s\n", config.local_path);
+    }
+    if (config.local_path != NULL || config.handoff_path != NULL) {
+        /* whoever is woken up for nothing must not block in accept()  */
+        set_nonblocking_or_die(sockfd, 1);
+        if (sockfd_local != 0) set_nonblocking_or_die(sockfd_local, 1);
+    }
+    if (config.handoff_path != NULL) {
+        sockfd_handoff = bel_handoff_listen_or_die(config.handoff_path);
+        handoff_owner = getpid();
+        open_lifeline_or_die();
+    }
+    bel_metrics_init_or_die();
+    bel_ratelimit_init_or_die(config.limits);
+    bel_repl_init_or_die();
+    if (config.trace_path != NULL) bel_trace_open_or_die(config.trace_path);
+    if (config.spans_path != NULL) {
+        bel_spans_init_or_die();
+        set_dump_handler_or_die();
+    }
+    if (config.cache_budget > 0) msg_set_cache_budget(config.cache_budget);
+    msg_init_sharded_db_or_die(config.db_path, config.shards);
+    if (config.writer) {
+        bel_writer_init_or_die();
+        writer_pid = spawn_helper_or_die(writer_loop);
+    }
+    if (config.sweep_interval > 0) {
+        sweeper_pid = spawn_helper_or_die(sweeper_loop);
+    }
+    if (config.primary != NULL) {
+        replicator_pid = spawn_helper_or_die(replicator_loop);
+    }
+    if (config.handoff_path != NULL) {
+        set_handover_handler_or_die();
+        handoff_pid = spawn_helper_or_die(handoff_loop);
+    }
+    if (handoff_conn != -1) {
+        printf("[INFO] ready: telling the old server to hand over\n");
+        fflush(stdout);
+        bel_handoff_confirm(handoff_conn);
+    }
+    if (config.workers > 0) supervise_workers(); else server_loop();
     return EXIT_SUCCESS;
 }
 
 
+/* Fills the global configuration from the command line options  */
+static void
+parse_options_or_die(int argc, char **argv)
+{
+    int opt;
+
+    config.txt_maxlen = TXT_MAXLEN_LIMIT;
+    config.idle_timeout = 300;
+    config.keepalive = 60;
+    config.max_conns = 128;
+    config.sndbuf = 0;
+    config.shards = 1;
+    config.sweep_interval = -1;
+    config.port = COMM_PORT;
+    config.db_path = DB_FILENAME;
+    config.primary_port = COMM_PORT;
+    while ((opt = getopt(argc, argv,
+            "m:i:k:c:o:l:w:S:M:A:N:B:e:U:P:D:R:r:Wa:Ht:s:X:")) != -1) {
+        switch (opt) {
+        case 'm': config.txt_maxlen =
+                        parse_long_or_die(optarg, 1, TXT_MAXLEN_LIMIT);
+                  break;
+        case 'i': config.idle_timeout = parse_long_or_die(optarg, 0, 86400);
+                  break;
+        case 'k': config.keepalive = parse_long_or_die(optarg, 0, 86400);
+                  break;
+        case 'c': config.max_conns = parse_long_or_die(optarg, 1, 65536);
+                  break;
+        case 'o': config.sndbuf = parse_long_or_die(optarg, 0, 1L << 30);
+                  break;
+        case 'l': parse_limit_or_die(optarg);
+                  break;
+        case 'w': config.workers = parse_long_or_die(optarg, 0, 4096);
+                  break;
+        case 'S': config.shards = parse_long_or_die(optarg, 1, MSG_MAX_SHARDS);
+                  break;
+        case 'M': config.cache_budget =
+                        parse_long_or_die(optarg, 0, LONG_MAX);
+                  break;
+        case 'A': config.retention.max_age =
+                        parse_long_or_die(optarg, 0, LONG_MAX);
+                  break;
+        case 'N': config.retention.max_count =
+                        parse_long_or_die(optarg, 0, LONG_MAX);
+                  break;
+        case 'B': config.retention.max_bytes =
+                        parse_long_or_die(optarg, 0, LONG_MAX);
+                  break;
+        case 'e': config.sweep_interval = parse_long_or_die(optarg, 0, 86400);
+                  break;
+        case 'U': config.local_path = optarg;
+                  break;
+        case 'P': config.port = parse_long_or_die(optarg, 1, 65535);
+                  break;
+        case 'D': config.db_path = optarg;
+                  break;
+        case 'R': config.primary = optarg;
+                  break;
+        case 'r': config.primary_port = parse_long_or_die(optarg, 1, 65535);
+                  break;
+        case 'W': config.writer = 1;
+                  break;
+        case 'a': config.no_of_cpus = bel_parse_cpus(optarg, config.cpus);
+                  if (config.no_of_cpus == 0) usage_and_die();
+                  break;
+        case 'H': config.hugepages = 1;
+                  break;
+        case 's': config.spans_path = optarg;
+                  break;
+        case 't': config.trace_path = optarg;
+                  break;
+        case 'X': config.handoff_path = optarg;
+                  break;
+        default:  usage_and_die();
+        }
+    }
+    if (optind != argc) usage_and_die();
+    if (config.sweep_interval < 0) {
+        config.sweep_interval = config.retention.max_age
+                || config.retention.max_count
+                || config.retention.max_bytes ? 1 : 0;
+    }
+    config.repl_user = getenv("BEL_REPL_USER");
+    if (config.repl_user == NULL) config.repl_user = REPL_DEFAULT_USER;
+    if (config.primary != NULL) {
+        config.repl_password = getenv("BEL_REPL_PASSWORD");
+        if (config.repl_password == NULL) usage_and_die();
+        config.writer = 0;  /* nothing to write  */
+    }
+}
+
+/* Parses a rate limit, as <operation>:<per second>[:<burst>]  */
+static void
+parse_limit_or_die(char *spec)
+{
+    int rate;
+    char *per_sec, *burst;
+
+    per_sec = strchr(spec, ':');
+    if (per_sec == NULL) usage_and_die();
+    *per_sec++ = '\0';
+    burst = strchr(per_sec, ':');
+    if (burst != NULL) *burst++ = '\0';
+    rate = bel_ratelimit_byname(spec);
+    if (rate == -1) usage_and_die();
+    config.limits[rate].per_sec = parse_long_or_die(per_sec, 0, 1000000);
+    config.limits[rate].burst = burst == NULL
+            ? config.limits[rate].per_sec
+            : (unsigned long) parse_long_or_die(burst, 1, 1000000);
+}
+
+/* Parses a number between <min> and <max>, or shows the usage and exits  */
+static long
+parse_long_or_die(const char* const str, const long min, const long max)
+{
+    long value;
+    char *endptr = NULL;
+
+    value = strtol(str, &endptr, 10);
+    if (endptr == str || *endptr || value < min || value > max) {
+        usage_and_die();
+    }
+    return value;
+}
+
+static void
+usage_and_die(void)
+{
+    printf("usage: server [-m <max text length>] [-i <idle timeout>]"
+            " [-k <keepalive>]\n"
+            "              [-c <max connections>] [-o <send buffer>]\n"
+            "  -m  longest subject or body accepted, in bytes (default %d)\n",
+            TXT_MAXLEN_LIMIT);
+    printf("  -i  seconds a client can stay silent, or fail to read what it\n"
+            "      is sent, before being disconnected; 0 for ever"
+            " (default 300)\n"
+            "  -k  seconds of silence before checking that a client is still\n"
+            "      alive (TCP keepalive); 0 to never check (default 60)\n"
+            "  -c  connections served at the same time, more are refused\n"
+            "      (default 128)\n"
+            "  -o  size of the send buffer of each connection, in bytes;\n"
+            "      0 for the system default (default 0)\n");
+    printf("  -l  rate limit, as <read|send|delete>:<per second>[:<burst>],\n"
+            "      applied to each user and to each client address;\n"
+            "      can be repeated (default: no limits)\n"
+            "  -w  serve connections with a pool of this many pre-forked\n"
+            "      processes, instead of forking one for each connection;\n"
+            "      the pool size also caps the connections served at the\n"
+            "      same time, so -c does not apply (default 0: no pool)\n");
+    printf("  -S  split the database in this many files, " DB_FILENAME ".0,\n"
+            "      " DB_FILENAME ".1...; writers to different files do not\n"
+            "      wait for each other. Cannot be changed later (default 1:\n"
+            "      just " DB_FILENAME ")\n"
+            "  -M  leave the text of messages on disk, caching at most this\n"
+            "      many bytes of it in each process; 0 keeps all of it in\n"
+            "      memory (default 0)\n");
+    printf("  -A  delete messages older than this many seconds\n"
+            "  -N  keep at most this many messages, deleting the oldest\n"
+            "  -B  keep the database files within this many bytes, deleting\n"
+            "      the oldest messages (limits default to 0: none)\n"
+            "  -e  seconds between sweeps for messages to delete, which also\n"
+            "      enforce the time to live of messages and take snapshots;\n"
+            "      0 disables the sweeper (default 1 with any limit above,\n"
+            "      0 otherwise: without it messages cannot have a time to\n"
+            "      live)\n");
+    printf("  -U  also listen on a local (AF_UNIX) socket at this path, for\n"
+            "      clients on the same host (default: TCP only)\n"
+            "  -P  port to listen on (default %d)\n"
+            "  -D  database file (default " DB_FILENAME "); channels other\n"
+            "      than the default one go to " DB_FILENAME "-<name>\n",
+            COMM_PORT);
+    printf("  -R  be a read-only replica of the server at this address (or\n"
+            "      local socket path), logging in as $BEL_REPL_USER (default\n"
+            "      " REPL_DEFAULT_USER ") with password $BEL_REPL_PASSWORD;\n"
+            "      a primary only lets that user replicate, up to %d\n"
+            "      replicas at a time\n"
+            "  -r  port of the server to replicate (default %d)\n",
+            REPL_MAX_STREAMS, COMM_PORT);
+    printf("  -W  queue stores and deletions to a single writer process,\n"
+            "      which applies them in batches (default: every process\n"
+            "      writes on its own)\n");
+    printf("  -a  pin the workers, or the processes serving connections, to\n"
+            "      these CPUs in turn, as in 0-3,8 (default: no pinning)\n"
+            "  -H  back the message boards and the writer queue with huge\n"
+            "      pages (default: regular pages)\n"
+            "  -t  record every command received, with its arguments, to\n"
+            "      this trace file, for bin/replay (default: no trace)\n"
+            "  -s  record spans of the stages of every command, and dump\n"
+            "      them to this file, as a Chrome trace, on SIGUSR1\n"
+            "      (default: no spans)\n");
+    printf("  -X  hand over through a handoff socket at this path: a server\n"
+            "      started with the path of a running one takes over its\n"
+            "      listening sockets and then its connections, which the\n"
+            "      old one passes on before exiting (default: no handoff)\n");
+    exit(EXIT_FAILURE);
+}
+
+
 /* 
  * Gets all the addresses associated to the given port and binds to the first
  * available one
@@ -173,12 +663,12 @@ set_reuseaddr_or_die(void)
 
 /* Performs the listen() syscall, and exits the program if it fails  */
 static void
-do_listen_or_die(void)
+do_listen_or_die(const int fd)
 {
     int listen_result;
     const int listen_backlog = 10;
     
-    listen_result = listen(sockfd, listen_backlog);
+    listen_result = listen(fd, listen_backlog);
 	if (listen_result == -1) {
         perror("[FATAL] listen()");
         exit(EXIT_FAILURE);
@@ -186,26 +676,700 @@ do_listen_or_die(void)
 }
 
 
+/*
+ * Creates the local socket and binds it to <path>, replacing any socket left
+ * there by a previous run. Saves its file descriptor into sockfd_local.
+ * Exits on failure
+ */
+static void
+bind_local_or_die(const char* const path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) usage_and_die();
+    strcpy(addr.sun_path, path);
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+
+    sockfd_local = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd_local == -1) {
+        perror("[FATAL] socket()");
+        exit(EXIT_FAILURE);
+    }
+    printf("[INFO] binding to local socket %s\n", path);
+    if (bind(sockfd_local, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        perror("[FATAL] bind()");
+        exit(EXIT_FAILURE);
+    }
+    local_owner = getpid();
+}
+
+/* Removes the local socket from the filesystem, if this process made it  */
+static void
+remove_local_socket(void)
+{
+    if (config.local_path != NULL && local_owner == getpid()) {
+        unlink(config.local_path);
+    }
+}
+
+static void
+set_nonblocking_or_die(const int fd, const int nonblocking)
+{
+    int flags;
+
+    flags = fcntl(fd, F_GETFL);
+    if (flags == -1) {
+        perror("[FATAL] fcntl()");
+        exit(EXIT_FAILURE);
+    }
+    flags = nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+    if (fcntl(fd, F_SETFL, flags) == -1) {
+        perror("[FATAL] fcntl()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+ * Keeps the listening sockets passed on by the old server, as long as they
+ * are bound where this server would bind its own: the others are closed, and
+ * replaced by new ones
+ */
+static void
+take_listeners(const int *fds, const int count)
+{
+    if (bound_port(fds[0]) == config.port) {
+        sockfd = fds[0];
+    } else {
+        printf("[WARN] the old server listens on another port\n");
+        bel_close_or_die(fds[0]);
+    }
+    if (count < 2) return;
+    if (config.local_path != NULL && is_bound_to(fds[1], config.local_path)) {
+        sockfd_local = fds[1];
+        local_owner = getpid();
+    } else {
+        bel_close_or_die(fds[1]);
+    }
+}
+
+/* Returns the port the TCP socket <fd> is bound to, or 0  */
+static u_short
+bound_port(const int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+
+    if (getsockname(fd, (struct sockaddr*) &addr, &addrlen) == -1) return 0;
+    if (addr.ss_family == AF_INET) {
+        return ntohs(((struct sockaddr_in*) &addr)->sin_port);
+    }
+    if (addr.ss_family == AF_INET6) {
+        return ntohs(((struct sockaddr_in6*) &addr)->sin6_port);
+    }
+    return 0;
+}
+
+/* Returns 1 (true) if the local socket <fd> is bound to <path>  */
+static int
+is_bound_to(const int fd, const char* const path)
+{
+    struct sockaddr_un addr;
+    socklen_t addrlen = sizeof(addr);
+
+    memset(&addr, 0, sizeof(addr));
+    if (getsockname(fd, (struct sockaddr*) &addr, &addrlen) == -1) return 0;
+    return addr.sun_family == AF_UNIX && strcmp(addr.sun_path, path) == 0;
+}
+
+static void
+open_lifeline_or_die(void)
+{
+    int fds[2];
+
+    if (pipe(fds) == -1) {
+        perror("[FATAL] pipe()");
+        exit(EXIT_FAILURE);
+    }
+    lifeline_rd = fds[0];
+    lifeline_wr = fds[1];
+}
+
+/* For every child: the lifeline is cut only once the parent closes it  */
+static void
+close_lifeline_writer(void)
+{
+    if (lifeline_wr == 0) return;
+    bel_close_or_die(lifeline_wr);
+    lifeline_wr = 0;
+}
+
+/*
+ * Returns 1 (true) if the lifeline is cut, waiting up to <timeout_ms> for it
+ * (-1: for ever). Always 0 without a lifeline
+ */
+static int
+lifeline_cut(const int timeout_ms)
+{
+    struct pollfd pfd;
+
+    if (lifeline_rd == 0) return 0;
+    pfd.fd = lifeline_rd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, timeout_ms) > 0 && pfd.revents != 0;
+}
+
+
 /* The main server loop, spawning child processes to handle clients  */
 static void
 server_loop(void)
 {
+    unsigned long forked = 0;
+
+    set_sigchld_handler_or_die();
     for(;;) {
+        if (handover_requested) hand_over();
+        if (dump_requested) dump_spans();
+        if (sweeper_died) {
+            sweeper_died = 0;
+            sweeper_pid = spawn_helper_or_die(sweeper_loop);
+        }
+        if (replicator_died) {
+            replicator_died = 0;
+            replicator_pid = spawn_helper_or_die(replicator_loop);
+        }
+        if (writer_died) {
+            writer_died = 0;
+            writer_pid = spawn_helper_or_die(writer_loop);
+        }
+        if (handoff_died) {
+            handoff_died = 0;
+            handoff_pid = spawn_helper_or_die(handoff_loop);
+        }
         if (accept_incoming() == -1) continue;
+        if (active_children >= config.max_conns) {
+            reject_incoming();
+            continue;
+        }
         switch (fork()) {
         case -1:    /* error, did not fork  */
             perror("[FATAL] fork()");
             exit(EXIT_FAILURE);
         case 0:     /* child process  */
+            close_lifeline_writer();
+            ignore_dump_requests();
+            pin_to_cpu(forked);
+            configure_connection_or_die();
             handle_client();
             exit(EXIT_SUCCESS);
         default:    /* parent process  */
+            ++forked;
+            count_child();
             bel_close_or_die(sockfd_acc);
+            sockfd_acc = 0;
             break;
         }
     }
 }
 
+static void
+set_sigchld_handler_or_die(void)
+{
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = reap_children;
+    sigemptyset(&action.sa_mask);
+
+    /* no SA_RESTART: accept() has to return, to replace dead helpers  */
+    action.sa_flags = SA_NOCLDSTOP;
+    if (sigaction(SIGCHLD, &action, NULL) == -1) {
+        perror("[FATAL] sigaction()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* SIGCHLD handler: collects the exit status of every finished child  */
+static void
+reap_children(int signum)
+{
+    pid_t pid;
+
+    (void) signum;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        if (pid == sweeper_pid) {
+            sweeper_died = 1;
+        } else if (pid == replicator_pid) {
+            replicator_died = 1;
+        } else if (pid == writer_pid) {
+            writer_died = 1;
+        } else if (pid == handoff_pid) {
+            handoff_died = 1;
+        } else {
+            --active_children;
+        }
+    }
+}
+
+/*
+ * Counts a newly forked child. SIGCHLD is blocked meanwhile, so that the
+ * handler cannot interleave with the update
+ */
+static void
+count_child(void)
+{
+    sigset_t chld, old;
+
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &old);
+    ++active_children;
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+
+/*
+ * Pre-fork mode: starts the pool of workers, then waits for any of them to
+ * die and replaces it. Never returns
+ */
+static void
+supervise_workers(void)
+{
+    long i;
+    pid_t pid, *workers;
+    unsigned long last_spawn = 0;
+
+    /* a worker replacing another one takes its place, and its CPU  */
+    workers = malloc(sizeof(pid_t) * config.workers);
+    if (workers == NULL) {
+        perror("[FATAL] malloc()");
+        exit(EXIT_FAILURE);
+    }
+    printf("[INFO] starting '%ld' workers\n", config.workers);
+    for (i = 0; i < config.workers; ++i) workers[i] = spawn_worker_or_die(i);
+    for (;;) {
+        if (handover_requested) hand_over();
+        if (dump_requested) dump_spans();
+        pid = wait(NULL);
+        if (pid == -1) {
+            if (errno == EINTR) continue;
+            perror("[FATAL] wait()");
+            exit(EXIT_FAILURE);
+        }
+        if (pid == sweeper_pid) {
+            printf("[WARN] sweeper exited, starting a new one\n");
+        } else if (pid == replicator_pid) {
+            printf("[WARN] replicator exited, starting a new one\n");
+        } else if (pid == writer_pid) {
+            printf("[WARN] writer exited, starting a new one\n");
+        } else if (pid == handoff_pid) {
+            printf("[WARN] handoff process exited, starting a new one\n");
+        } else {
+            printf("[WARN] worker '%ld' exited, starting a new one\n",
+                    (long) pid);
+        }
+        
+        /* do not spin if children keep dying right away  */
+        if (bel_clock_ns() - last_spawn < 1000000000UL) sleep(1);
+        last_spawn = bel_clock_ns();
+        if (pid == sweeper_pid) {
+            sweeper_pid = spawn_helper_or_die(sweeper_loop);
+        } else if (pid == replicator_pid) {
+            replicator_pid = spawn_helper_or_die(replicator_loop);
+        } else if (pid == writer_pid) {
+            writer_pid = spawn_helper_or_die(writer_loop);
+        } else if (pid == handoff_pid) {
+            handoff_pid = spawn_helper_or_die(handoff_loop);
+        } else {
+            for (i = 0; i < config.workers && workers[i] != pid; ++i) {
+                continue;
+            }
+            if (i < config.workers) workers[i] = spawn_worker_or_die(i);
+        }
+    }
+}
+
+static pid_t
+spawn_worker_or_die(const long slot)
+{
+    pid_t pid;
+
+    fflush(stdout);     /* or the worker would print it again  */
+    pid = fork();
+    switch (pid) {
+    case -1:
+        perror("[FATAL] fork()");
+        exit(EXIT_FAILURE);
+    case 0:
+        close_lifeline_writer();
+        ignore_dump_requests();
+        pin_to_cpu(slot);
+        worker_loop();  /* never returns  */
+    }
+    return pid;
+}
+
+/*
+ * Pins the calling process to the <n>th of the CPUs given with -a, if any,
+ * starting over from the first one past the last. To be called before the
+ * process allocates anything, so that it does it on the node of its CPU
+ */
+static void
+pin_to_cpu(const unsigned long n)
+{
+    if (config.no_of_cpus == 0) return;
+    bel_pin_to_cpu(config.cpus[n % config.no_of_cpus]);
+}
+
+/*
+ * Body of a worker: accepts connections and serves them one at a time, with
+ * the same code used by forked children. Whatever ends a connection (the
+ * client leaving, an I/O error, a timeout, a failed login) jumps back here
+ * instead of exiting the process
+ */
+static void
+worker_loop(void)
+{
+    is_worker = 1;
+    bel_arena_init_or_die(&conn_arena, ARENA_BLOCK_SIZE);
+    bel_set_disconnect_handler(end_connection);
+    for (;;) {
+        if (accept_incoming() == -1) continue;
+        if (setjmp(connection_over) == 0) {
+            configure_connection_or_die();
+            bel_metrics_connection_opened();
+            bel_trace_new_connection();
+            bel_spans_new_connection();
+            serve_connection();
+        }
+        close_connection();
+    }
+}
+
+/*
+ * Forks a process that does not serve clients, running <body> (which must
+ * not return) with the listening sockets closed. The handoff process keeps
+ * them, to pass them on
+ */
+static pid_t
+spawn_helper_or_die(void (*body)(void))
+{
+    pid_t pid;
+
+    fflush(stdout);
+    pid = fork();
+    switch (pid) {
+    case -1:
+        perror("[FATAL] fork()");
+        exit(EXIT_FAILURE);
+    case 0:
+        close_lifeline_writer();
+        ignore_dump_requests();
+        if (body != handoff_loop) close_listeners();
+        body();
+    }
+    return pid;
+}
+
+static void
+close_listeners(void)
+{
+    bel_close_or_die(sockfd);
+    sockfd = 0;
+    if (sockfd_local != 0) bel_close_or_die(sockfd_local);
+    sockfd_local = 0;
+    if (sockfd_handoff != 0) bel_close_or_die(sockfd_handoff);
+    sockfd_handoff = 0;
+}
+
+/*
+ * Body of the sweeper: deletes expired messages a batch at a time, resting
+ * between sweeps only once there is nothing left to delete, so that writers
+ * never wait long for it. Before resting, it also snapshots the database, for
+ * quick restarts. Exits when the server does
+ */
+static void
+sweeper_loop(void)
+{
+    const pid_t server_pid = getppid();
+
+    printf("[INFO] sweeper started with pid = '%ld'\n", (long) getpid());
+    while (getppid() == server_pid) {
+        /* replicas get their deletions from the primary  */
+        if (config.primary != NULL
+                || msg_expire(&config.retention, SWEEP_BATCH) < SWEEP_BATCH) {
+            msg_snapshot();
+            sleep(config.sweep_interval);
+        }
+    }
+    exit(EXIT_SUCCESS);
+}
+
+/* Body of the replicator: follows the primary until the server exits  */
+static void
+replicator_loop(void)
+{
+    printf("[INFO] replicator started with pid = '%ld'\n", (long) getpid());
+    bel_repl_follow(config.primary, config.primary_port, config.repl_user,
+            config.repl_password);
+    exit(EXIT_SUCCESS);
+}
+
+/* Body of the writer: applies the queued writes until the server exits  */
+static void
+writer_loop(void)
+{
+    bel_writer_run();
+    exit(EXIT_SUCCESS);
+}
+
+/*
+ * Body of the handoff process: passes the listening sockets on to a new
+ * server, and adopts the connections that the processes of an old one pass
+ * on. Once the lifeline is cut, waits for the connections it adopted to be
+ * over (or passed on again) and exits
+ */
+static void
+handoff_loop(void)
+{
+    int conn, fd, kind;
+    HandoffSession session;
+    struct pollfd fds[2];
+    struct sigaction action;
+
+    printf("[INFO] handoff process started with pid = '%ld'\n",
+            (long) getpid());
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_IGN;    /* adopters are reaped by the system  */
+    sigaction(SIGCHLD, &action, NULL);
+    for (;;) {
+        fds[0].fd = sockfd_handoff;
+        fds[1].fd = lifeline_rd;
+        fds[0].events = fds[1].events = POLLIN;
+        fds[0].revents = fds[1].revents = 0;
+        if (poll(fds, 2, -1) == -1 && errno != EINTR) {
+            perror("[ERROR] poll()");
+        }
+        if (fds[1].revents != 0) break;
+        if (!(fds[0].revents & POLLIN)) continue;
+        kind = bel_handoff_accept(sockfd_handoff, &conn, &fd, &session);
+        if (kind == -1) continue;
+        if (kind == HANDOFF_LISTENERS) give_listeners(conn);
+        else adopt_connection(conn, fd, &session);
+        bel_close_or_die(conn);
+    }
+    close_listeners();
+    while (wait(NULL) != -1 || errno == EINTR) continue;
+    exit(EXIT_SUCCESS);
+}
+
+/*
+ * Passes the listening sockets on to the new server connected through
+ * <conn> and, once it is ready, has the main process hand over. If the new
+ * server fails instead, takes the handoff socket back and goes on
+ */
+static void
+give_listeners(const int conn)
+{
+    int fds[HANDOFF_MAX_FDS], count = 0;
+
+    fds[count++] = sockfd;
+    if (sockfd_local != 0) fds[count++] = sockfd_local;
+    if (!bel_handoff_give_listeners(conn, fds, count)) {
+        fprintf(stderr, "[WARN] the new server failed, not handing over\n");
+        bel_close_or_die(sockfd_handoff);
+        sockfd_handoff = bel_handoff_listen_or_die(config.handoff_path);
+        return;
+    }
+    printf("[INFO] the new server is ready, handing over\n");
+
+    /* until the main process gets it, and cuts the lifeline  */
+    do {
+        kill(getppid(), SIGUSR2);
+    } while (!lifeline_cut(1000));
+}
+
+/*
+ * Forks a process to serve the connection passed on through <conn>, as if it
+ * had logged in here
+ */
+static void
+adopt_connection(const int conn, const int fd,
+        const HandoffSession* const session)
+{
+    fflush(stdout);
+    switch (fork()) {
+    case -1:    /* no answer: the old server keeps the connection  */
+        perror("[ERROR] fork()");
+        bel_close_or_die(fd);
+        return;
+    case 0:
+        bel_close_or_die(conn);
+        close_listeners();
+        sockfd_acc = fd;
+        current_is_local = session->is_local;
+        strcpy(current_user, session->user);
+        strcpy(current_ip, session->ip);
+        if (!msg_select_channel(session->channel)) {
+            fprintf(stderr, "[ERROR] cannot select channel '%s'\n",
+                    session->channel);
+            exit(EXIT_FAILURE);
+        }
+        printf("[INFO] adopted a connection of user '%s' from %s\n",
+                current_user, current_ip);
+        configure_connection_or_die();
+        handle_client();
+        exit(EXIT_SUCCESS);
+    }
+    bel_close_or_die(fd);
+    bel_handoff_adopted(conn);
+}
+
+/* Lets the handoff process tell the main one that the new server is ready */
+static void
+set_handover_handler_or_die(void)
+{
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_handover;
+    sigemptyset(&action.sa_mask);
+
+    /* no SA_RESTART: accept() and wait() have to return  */
+    if (sigaction(SIGUSR2, &action, NULL) == -1) {
+        perror("[FATAL] sigaction()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* SIGUSR2 handler  */
+static void
+request_handover(int signum)
+{
+    (void) signum;
+    handover_requested = 1;
+}
+
+/*
+ * Lets SIGUSR1 ask the main process for the spans. Set before forking
+ * anything, so that children are never killed by a signal sent to the whole
+ * group: they inherit the handler, and ignore the signal from then on
+ */
+static void
+set_dump_handler_or_die(void)
+{
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_dump;
+    sigemptyset(&action.sa_mask);
+
+    /* no SA_RESTART: accept() and wait() have to return  */
+    if (sigaction(SIGUSR1, &action, NULL) == -1) {
+        perror("[FATAL] sigaction()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* SIGUSR1 handler  */
+static void
+request_dump(int signum)
+{
+    (void) signum;
+    dump_requested = 1;
+}
+
+/*
+ * Leaves SIGUSR1 to the main process. The others ignore it, or it would
+ * interrupt whatever they are blocked in
+ */
+static void
+ignore_dump_requests(void)
+{
+    struct sigaction action;
+
+    if (config.spans_path == NULL) return;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_IGN;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGUSR1, &action, NULL) == -1) {
+        perror("[FATAL] sigaction()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Dumps the spans of all the connections, as asked with SIGUSR1  */
+static void
+dump_spans(void)
+{
+    dump_requested = 0;
+    bel_spans_dump(config.spans_path);
+}
+
+/*
+ * The new server took over: stops accepting connections, cuts the lifeline
+ * so that every process serving one passes it on, and exits once they are
+ * all gone. The helpers follow, as usual. Never returns
+ */
+static void
+hand_over(void)
+{
+    long remaining;
+    pid_t pid;
+    struct sigaction action;
+
+    printf("[INFO] handing over to the new server\n");
+    local_owner = handoff_owner = 0;    /* the new server's paths now  */
+    close_listeners();
+    close_lifeline_writer();
+
+    /* collect the children here, instead of in the handler  */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_DFL;
+    sigaction(SIGCHLD, &action, NULL);
+    remaining = (config.workers > 0 ? config.workers : active_children) + 1;
+    while (remaining > 0) {
+        pid = wait(NULL);
+        if (pid == -1 && errno == EINTR) continue;
+        if (pid == -1) break;
+        if (pid != sweeper_pid && pid != replicator_pid
+                && pid != writer_pid) {
+            --remaining;
+        }
+    }
+    printf("[INFO] all connections handed over, exiting\n");
+    exit(EXIT_SUCCESS);
+}
+
+/* Ends the connection being served. Never returns  */
+static void
+end_connection(void)
+{
+    if (is_worker) longjmp(connection_over, 1);
+    exit(EXIT_SUCCESS);
+}
+
+/* Releases what a worker used for its last connection  */
+static void
+close_connection(void)
+{
+    bel_metrics_connection_closed();
+    bel_trace_end_connection();
+    bel_close_or_die(sockfd_acc);
+    sockfd_acc = 0;
+    memset(current_user, 0, UNAME_MSGLEN);
+    current_metric = -1;
+    current_throttled = 0;
+    keeps_connection = 0;
+    bel_repl_release();
+    msg_select_channel("");
+    bel_arena_reset(&conn_arena);
+}
+
 /*
  * Blocks until an incoming client request arrives, and then creates a socket
  * to serve this specific client.
@@ -215,42 +1379,229 @@ server_loop(void)
 static int
 accept_incoming(void)
 {
-    int addrlen;
+    int addrlen, listener;
     struct sockaddr_storage client_addr = {0};
 
     const char* const conn_msg = "[INFO] incoming connection from ";
     const char* const debug_msg =
             "[DEBUG] created socket with fd = '%d' to handle the connection\n";
     
+    listener = wait_for_listener();
+    if (listener == -1) return -1;
     addrlen = sizeof(client_addr);
-    sockfd_acc = accept(sockfd, (struct sockaddr *) &client_addr, &addrlen);
+    sockfd_acc = accept(listener, (struct sockaddr *) &client_addr, &addrlen);
     if (sockfd_acc == -1) {
-        perror("[ERROR] accept()");
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("[ERROR] accept()");
+        }
         return -1;
     }
+    current_is_local = listener == sockfd_local;
     bel_print_address(conn_msg, (struct sockaddr *) &client_addr);
+    bel_address_tostring((struct sockaddr *) &client_addr, current_ip);
     printf(debug_msg, sockfd_acc);
     return sockfd_acc;
 }
 
+/*
+ * Returns the listening socket with a connection waiting, blocking until
+ * there is one, or -1 on error. With no local socket there is nothing to
+ * choose from, and accept() itself does the waiting
+ */
+static int
+wait_for_listener(void)
+{
+    int i, n = 0;
+    struct pollfd fds[3];
+
+    if (sockfd_local == 0 && lifeline_rd == 0) return sockfd;
+    fds[n++].fd = sockfd;
+    if (sockfd_local != 0) fds[n++].fd = sockfd_local;
+    if (lifeline_rd != 0) fds[n++].fd = lifeline_rd;
+    for (i = 0; i < n; ++i) {
+        fds[i].events = POLLIN;
+        fds[i].revents = 0;
+    }
+    if (poll(fds, n, -1) == -1) {
+        if (errno != EINTR) perror("[ERROR] poll()");
+        return -1;
+    }
+    if (lifeline_rd != 0 && fds[n - 1].revents != 0) {
+        printf("[INFO] worker stops accepting: the server is handing over\n");
+        exit(EXIT_SUCCESS);
+    }
+    return sockfd_local != 0 && fds[1].revents & POLLIN
+            ? sockfd_local : sockfd;
+}
+
+/*
+ * Turns the just accepted connection away, telling the client that the
+ * server is busy. Whatever the client already sent is drained before
+ * closing, so that the answer is not lost to a connection reset
+ */
+static void
+reject_incoming(void)
+{
+    char drain[UNAME_MSGLEN + PWORD_MSGLEN];
+
+    printf("[WARN] '%ld' connections already open, refusing a new one\n",
+            (long) active_children);
+    bel_metrics_connection_rejected();
+    if (send(sockfd_acc, ANSWER_BUSY, ANSWER_MSGLEN,
+            MSG_NOSIGNAL | MSG_DONTWAIT) == -1) {
+        perror("[WARN] send()");
+    }
+    shutdown(sockfd_acc, SHUT_WR);
+    while (recv(sockfd_acc, drain, sizeof(drain), MSG_DONTWAIT) > 0) continue;
+    bel_close_or_die(sockfd_acc);
+    sockfd_acc = 0;
+}
+
+/* Applies the configured timeouts and limits to the client connection  */
+static void
+configure_connection_or_die(void)
+{
+    /* some systems pass on O_NONBLOCK from the listening socket  */
+    if (sockfd_local != 0 || lifeline_rd != 0) {
+        set_nonblocking_or_die(sockfd_acc, 0);
+    }
+    if (config.idle_timeout > 0) {
+        set_timeout_or_die(SO_RCVTIMEO, config.idle_timeout);
+        set_timeout_or_die(SO_SNDTIMEO, config.idle_timeout);
+    }
+    if (config.sndbuf > 0) {
+        bel_setsockopt_or_die(sockfd_acc, SOL_SOCKET, SO_SNDBUF,
+                config.sndbuf);
+    }
+    if (current_is_local) return;   /* the rest is about TCP  */
+
+    bel_setsockopt_or_die(sockfd_acc, IPPROTO_TCP, TCP_NODELAY, 1);
+    if (config.keepalive > 0) {
+        bel_setsockopt_or_die(sockfd_acc, SOL_SOCKET, SO_KEEPALIVE, 1);
+#ifdef TCP_KEEPIDLE
+        bel_setsockopt_or_die(sockfd_acc, IPPROTO_TCP, TCP_KEEPIDLE,
+                config.keepalive);
+        bel_setsockopt_or_die(sockfd_acc, IPPROTO_TCP, TCP_KEEPINTVL,
+                config.keepalive / 6 > 0 ? config.keepalive / 6 : 1);
+        bel_setsockopt_or_die(sockfd_acc, IPPROTO_TCP, TCP_KEEPCNT, 6);
+#endif
+    }
+}
+
+/* Sets the timeout of blocking receives or sends on the client socket  */
+static void
+set_timeout_or_die(const int optname, const long seconds)
+{
+    struct timeval timeout;
+
+    timeout.tv_sec = seconds;
+    timeout.tv_usec = 0;
+    if (setsockopt(sockfd_acc, SOL_SOCKET, optname, &timeout,
+            sizeof(timeout)) == -1) {
+        perror("[FATAL] setsockopt()");
+        exit(EXIT_FAILURE);
+    }
+}
+
 static void
 handle_client(void)
 {
-    Action command = NULL;
+    bel_metrics_connection_opened();
+    atexit(bel_metrics_connection_closed);
+    bel_trace_new_connection();
+    atexit(bel_trace_end_connection);
+    bel_spans_new_connection();
+    bel_arena_init_or_die(&conn_arena, ARENA_BLOCK_SIZE);
+    serve_connection();
+}
+
+/* Authenticates the client and then serves its commands, until it leaves  */
+static void
+serve_connection(void)
+{
+    const Command *command = NULL;
+    unsigned long start;
     
-    authenticate_or_die();
+    if (current_user[0] == '\0') {
+        authenticate_or_die();
+    } else {    /* passed on by the old server, already logged in  */
+        trace_login();
+    }
     for(;;) {
+        if (lifeline_rd != 0 && !keeps_connection) wait_for_command();
         command = receive_client_command();
+        start = bel_clock_ns();
         if (command == NULL) {
+            bel_metrics_unknown_command();
             send_ko();
         } else {
-            send_ok();
-            command();
+            current_metric = command->metric;
+            current_throttled = !is_allowed(command);
+            if (current_throttled && !command->has_payload) {
+                send_throttled();
+            } else if (!is_permitted(command)) {
+                send_ko();
+            } else {
+                send_ok();
+                command->action();
+            }
+            bel_metrics_command(current_metric, bel_clock_ns() - start);
+            bel_spans_record(SPAN_COMMAND, command->name, start);
+            current_metric = -1;
         }
+        bel_trace_end();    /* arguments were traced along the way  */
+        bel_arena_reset(&conn_arena);
     }
 }
 
 
+/*
+ * Waits for the next command like receive_client_command() would, but passes
+ * the connection on instead if the lifeline is cut meanwhile. Whatever the
+ * client sent so far stays in the socket, for the new server to read
+ */
+static void
+wait_for_command(void)
+{
+    int poll_res;
+    struct pollfd fds[2];
+
+    fds[0].fd = sockfd_acc;
+    fds[1].fd = lifeline_rd;
+    fds[0].events = fds[1].events = POLLIN;
+    fds[0].revents = fds[1].revents = 0;
+    poll_res = poll(fds, 2,
+            config.idle_timeout > 0 ? config.idle_timeout * 1000 : -1);
+    if (poll_res == -1 && errno != EINTR) perror("[ERROR] poll()");
+    if (poll_res == 0) {
+        fprintf(stderr, "[ERROR] client silent for too long\n");
+        end_connection();
+    }
+    if (fds[1].revents != 0) hand_over_connection();
+}
+
+/*
+ * Passes the connection on to the new server, and ends it here. If the new
+ * server does not take it, keeps serving it until the client leaves
+ */
+static void
+hand_over_connection(void)
+{
+    HandoffSession session = empty_handoff_session;
+
+    session.is_local = current_is_local;
+    strcpy(session.user, current_user);
+    strcpy(session.ip, current_ip);
+    strcpy(session.channel, msg_channel());
+    if (!bel_handoff_connection(config.handoff_path, sockfd_acc, &session)) {
+        fprintf(stderr, "[WARN] cannot pass the connection on, keeping it\n");
+        keeps_connection = 1;
+        return;
+    }
+    printf("[INFO] connection of user '%s' passed on\n", current_user);
+    end_connection();
+}
+
 /*
  * Reads user credentials from the wire and then if they are valid it saves the
  * user name. Otherwise the client-serving process is aborted
@@ -264,12 +1615,21 @@ authenticate_or_die(void)
     bel_recvall_or_die(sockfd_acc, login.pword, PWORD_MSGLEN);
     if(!is_valid_login(login)) {
         send_ko();
-        exit(EXIT_SUCCESS);
+        end_connection();
     }
     strcpy(current_user, login.uname);
+    trace_login();
     send_ok();
 }
 
+static void
+trace_login(void)
+{
+    bel_trace_begin(TRACE_LOGIN);
+    bel_trace_field(current_user, strlen(current_user));
+    bel_trace_end();
+}
+
 /*
  * Returns 1 if given credentials match one of the registered (hardcoded)
  * users, 0 otherwise
@@ -289,22 +1649,71 @@ is_valid_login(const Credentials login)
     return 0;   /* false  */
 }
 
+/*
+ * Checks the rate limits of <command>, both for the current user and for the
+ * current client address.
+ * Returns 1 (true) if the command can be served, 0 (false) otherwise
+ */
+static int
+is_allowed(const Command* const command)
+{
+    char key[RATE_KEY_MAXLEN];
+
+    if (command->rate == -1) return 1;
+    sprintf(key, "ip:%s", current_ip);
+    if (!bel_ratelimit_allow(key, command->rate)) return 0;
+    sprintf(key, "user:%s", current_user);
+    return bel_ratelimit_allow(key, command->rate);
+}
 
-/* Listens for a command from the client and returns the matching Action  */
-static Action
+/*
+ * Returns 0 (false) if the current user may not run <command>. Replication
+ * hands out every message of every user, so it is only for the replication
+ * user, and only for so many replicas at a time
+ */
+static int
+is_permitted(const Command* const command)
+{
+    if (command->action != handle_repl) return 1;
+    if (strcmp(current_user, config.repl_user) != 0) {
+        fprintf(stderr, "[WARN] user '%s' is not allowed to replicate\n",
+                current_user);
+        return 0;
+    }
+    if (!bel_repl_admit()) {
+        fprintf(stderr, "[WARN] refusing replica: '%d' already served\n",
+                REPL_MAX_STREAMS);
+        return 0;
+    }
+    return 1;
+}
+
+
+/*
+ * Listens for a command from the client and returns the matching Command, or
+ * NULL if there is none
+ */
+static const Command*
 receive_client_command(void)
 {
     int i;
     char cmd[CMD_MSGLEN] = "";
-    const Command commands[NO_OF_COMMANDS] = {
-            {CMD_READ,      handle_read},
-            {CMD_SEND,      handle_send},
-            {CMD_DELETE,    handle_delete}
+    static const Command commands[NO_OF_COMMANDS] = {
+            {CMD_READ,   handle_read,   METRIC_READ,   RATE_READ,   0},
+            {CMD_SEND,   handle_send,   METRIC_SEND,   RATE_SEND,   1},
+            {CMD_DELETE, handle_delete, METRIC_DELETE, RATE_DELETE, 1},
+            {CMD_STATS,  handle_stats,  METRIC_STATS,  -1,          0},
+            {CMD_READIF, handle_readif, METRIC_READIF, RATE_READ,   1},
+            {CMD_SENDEX, handle_sendex, METRIC_SEND,   RATE_SEND,   1},
+            {CMD_REPL,   handle_repl,   METRIC_REPL,   -1,          0},
+            {CMD_CHANNEL, handle_channel, METRIC_CHANNEL, -1,         1}
             };
     
     bel_recvall_or_die(sockfd_acc, cmd, CMD_MSGLEN);
+    bel_trace_begin(TRACE_COMMAND);
+    bel_trace_field(cmd, CMD_MSGLEN);
     for(i = 0; i < NO_OF_COMMANDS; ++i) {
-        if (strcmp(cmd, commands[i].name) == 0) return commands[i].action;
+        if (strcmp(cmd, commands[i].name) == 0) return commands + i;
     }
     fprintf(stderr, "[WARN] unrecognized message '%s'\n", cmd);
     return NULL;
@@ -313,30 +1722,158 @@ receive_client_command(void)
 
 static void
 handle_read(void)
+{
+    send_message_list();
+}
+
+/*
+ * Conditional read: receives the board version the client already has, and
+ * answers ANSWER_NOT_MODIFIED if it is still the current one. Otherwise
+ * answers OK and sends the current version followed by the message list
+ */
+static void
+handle_readif(void)
+{
+    char version_buf[VERSION_MSGLEN] = "";
+    char *endptr = NULL;
+    unsigned long client_version, version;
+
+    bel_recvall_or_die(sockfd_acc, version_buf, VERSION_MSGLEN);
+    bel_trace_field(version_buf, VERSION_MSGLEN);
+    if (current_throttled) {
+        send_throttled();
+        return;
+    }
+    client_version = strtoul(version_buf, &endptr, 10);
+    version = msg_version();
+    if (endptr != version_buf && *endptr == '\0'
+            && client_version == version) {
+        bel_sendall_or_die(sockfd_acc, ANSWER_NOT_MODIFIED, ANSWER_MSGLEN);
+        return;
+    }
+    send_ok();
+    memset(version_buf, 0, VERSION_MSGLEN);
+    sprintf(version_buf, "%lu", version);
+    bel_sendall_or_die(sockfd_acc, version_buf, VERSION_MSGLEN);
+    send_message_list();
+}
+
+/* Sends the first MSG_LIST_SIZE messages of the board, as a single field  */
+static void
+send_message_list(void)
 {
     int msgcount;
-    Message messages[MSG_LIST_SIZE];
-    char listbuf[MSG_TOSTRING_SIZE * MSG_LIST_SIZE] = "";
+    Message *messages;
+    char *listbuf;
+    size_t list_len;
+    unsigned long start;
     
+    messages = bel_arena_alloc_or_die(&conn_arena,
+            sizeof(Message) * MSG_LIST_SIZE);
+    start = bel_clock_ns();
     msgcount = msg_retrieve_some(messages, MSG_LIST_SIZE);
-    msg_arraytostring(messages, msgcount, listbuf);
+    bel_metrics_storage(METRIC_RETRIEVE, bel_clock_ns() - start);
+    bel_spans_record(SPAN_RETRIEVE, NULL, start);
+    start = bel_clock_ns();
+    listbuf = bel_arena_alloc_or_die(&conn_arena,
+            msg_tostring_size(messages, msgcount));
+    list_len = msg_arraytostring(messages, msgcount, listbuf);
+    bel_spans_record(SPAN_FORMAT, NULL, start);
     
-    bel_sendall_or_die(sockfd_acc, listbuf, LIST_MSGLEN);
+    start = bel_clock_ns();
+    bel_sendfield_or_die(sockfd_acc, listbuf, list_len);
+    bel_spans_record(SPAN_SEND, NULL, start);
 }
 
 
 static void
 handle_send(void)
+{
+    receive_and_store(0);
+}
+
+/* Like SEND, for messages that have to be deleted after a while  */
+static void
+handle_sendex(void)
+{
+    char ttl_buf[ID_MSGLEN] = "";
+    char *endptr = NULL;
+    long ttl;
+
+    bel_recvall_or_die(sockfd_acc, ttl_buf, ID_MSGLEN);
+    bel_trace_field(ttl_buf, ID_MSGLEN);
+    ttl = strtol(ttl_buf, &endptr, 10);
+    if (endptr == ttl_buf || *endptr || ttl < 1) {
+        fprintf(stderr, "[WARN] received invalid time to live '%s'\n",
+                ttl_buf);
+        ttl = -1;
+    } else if (config.sweep_interval == 0) {
+        fprintf(stderr, "[WARN] no sweeper to enforce a time to live\n");
+        ttl = -1;
+    }
+    receive_and_store(ttl);
+}
+
+/*
+ * Receives the subject and the body of a new message and stores it, to live
+ * <ttl> seconds (0 for ever). Answers KO if <ttl> is negative, or if the
+ * writer could not store it
+ */
+static void
+receive_and_store(const long ttl)
 {
     Message msg = empty_message;
+    unsigned long start;
+    int stored = 1;
     
-    strcpy(msg.from, current_user);
-    bel_recvall_or_die(sockfd_acc, msg.subject, TXT_MSGLEN);
-    bel_recvall_or_die(sockfd_acc, msg.body,    TXT_MSGLEN);
+    msg.from = current_user;
+    msg.from_len = strlen(current_user);
+    msg.subject = recv_text_field(&msg.subject_len);
+    msg.body    = recv_text_field(&msg.body_len);
+    if (current_throttled) {
+        send_throttled();
+        return;
+    }
+    if (refuse_if_replica()) return;
+    if (msg.subject == NULL || msg.body == NULL || ttl < 0) {
+        send_ko();
+        return;
+    }
+    if (ttl > 0) msg.expires = time(NULL) + ttl;
     
     msg_trace(msg);
-    msg_store(msg);
-    send_ok();
+    start = bel_clock_ns();
+    if (config.writer) stored = bel_writer_store(msg); else msg_store(msg);
+    bel_metrics_storage(METRIC_STORE, bel_clock_ns() - start);
+    bel_spans_record(SPAN_STORE, NULL, start);
+    if (stored) send_ok(); else send_ko();
+}
+
+/*
+ * Receives a subject or a body from the client, saving its length into <len>.
+ * Returns NULL if it is too long or contains characters not allowed in a
+ * message (newlines and terminators)
+ */
+static const char*
+recv_text_field(size_t *len)
+{
+    char *text;
+    unsigned long start;
+
+    start = bel_clock_ns();
+    text = bel_recvfield_or_die(sockfd_acc, &conn_arena, config.txt_maxlen,
+            len);
+    bel_spans_record(SPAN_RECV, NULL, start);
+    if (text == NULL) {
+        bel_trace_dropped();
+        return NULL;
+    }
+    bel_trace_field(text, *len);
+    if (bel_find_either(text, *len, '\n', '\0') != NULL) {
+        fprintf(stderr, "[WARN] rejecting text with forbidden characters\n");
+        return NULL;
+    }
+    return text;
 }
 
 
@@ -346,18 +1883,104 @@ handle_delete(void)
     char id_buf[ID_MSGLEN] = "";
     char *endptr = NULL;
     long id = 0L;
+    int deleted;
+    unsigned long start;
     
+    if (current_throttled) {
+        bel_sendfield_or_die(sockfd_acc, "", 0);   /* nothing to choose from  */
+        bel_recvall_or_die(sockfd_acc, id_buf, ID_MSGLEN);
+        bel_trace_field(id_buf, ID_MSGLEN);
+        send_throttled();
+        return;
+    }
     handle_read();
     bel_recvall_or_die(sockfd_acc, id_buf, ID_MSGLEN);
+    bel_trace_field(id_buf, ID_MSGLEN);
+    if (refuse_if_replica()) return;
     id = strtol(id_buf, &endptr, 10);   /* 10 is the base   */
     if (*endptr) {  /* could not convert entire string  */
         fprintf(stderr, "[WARN] received non-numeric id '%s'\n", id_buf);
         send_ko();
     } else {
-        if(msg_delete(current_user, id)) send_ok(); else send_ko();
+        start = bel_clock_ns();
+        deleted = id > 0 && (config.writer
+                ? bel_writer_delete(current_user, id)
+                : msg_delete(current_user, id));
+        bel_metrics_storage(METRIC_REMOVE, bel_clock_ns() - start);
+        bel_spans_record(SPAN_DELETE, NULL, start);
+        if(deleted) send_ok(); else send_ko();
+    }
+}
+
+
+/* Sends the server metrics, as text  */
+static void
+handle_stats(void)
+{
+    char *buf;
+    size_t len;
+
+    buf = bel_arena_alloc_or_die(&conn_arena, STATS_MSGLEN);
+    len = bel_metrics_tostring(buf, STATS_MSGLEN);
+    bel_sendfield_or_die(sockfd_acc, buf, len);
+}
+
+
+/*
+ * Streams the changes to the database to a replica, for as long as it stays
+ * connected
+ */
+static void
+handle_repl(void)
+{
+    printf("[INFO] user '%s' starts replicating\n", current_user);
+    bel_repl_serve(sockfd_acc, lifeline_rd);
+    bel_repl_release();
+
+    /* the replica reconnects, to the new server  */
+    if (lifeline_cut(0)) end_connection();
+}
+
+/*
+ * Receives the name of a channel and selects it for the rest of the
+ * connection. Replicas only get the default channel from their primary, and
+ * refuse any other
+ */
+static void
+handle_channel(void)
+{
+    char name[CHANNEL_MSGLEN] = "";
+
+    bel_recvall_or_die(sockfd_acc, name, CHANNEL_MSGLEN);
+    bel_trace_field(name, CHANNEL_MSGLEN);
+    name[CHANNEL_MSGLEN - 1] = '\0';
+    if (config.primary != NULL && name[0] != '\0') {
+        fprintf(stderr, "[WARN] refusing channel '%s': this is a replica\n",
+                name);
+        send_ko();
+    } else if (!msg_select_channel(name)) {
+        fprintf(stderr, "[WARN] cannot select channel '%s'\n", name);
+        send_ko();
+    } else {
+        printf("[DEBUG] user '%s' selects channel '%s'\n", current_user,
+                name);
+        send_ok();
     }
 }
 
+/*
+ * Answers KO to the write being served if this server is a replica.
+ * Returns 1 (true) if it did
+ */
+static int
+refuse_if_replica(void)
+{
+    if (config.primary == NULL) return 0;
+    fprintf(stderr, "[WARN] refusing a write: this is a replica\n");
+    send_ko();
+    return 1;
+}
+
 
 static void
 send_ok(void)
@@ -365,8 +1988,16 @@ send_ok(void)
     bel_sendall_or_die(sockfd_acc, ANSWER_OK, ANSWER_MSGLEN);
 }
 
+static void
+send_throttled(void)
+{
+    bel_metrics_command_throttled(current_metric);
+    bel_sendall_or_die(sockfd_acc, ANSWER_THROTTLED, ANSWER_MSGLEN);
+}
+
 static void
 send_ko(void)
 {
+    if (current_metric != -1) bel_metrics_command_ko(current_metric);
     bel_sendall_or_die(sockfd_acc, ANSWER_KO, ANSWER_MSGLEN);
 }
@@ -0,0 +1,128 @@
+/* bel_simd - Vectorized byte scanning, with runtime CPU dispatch  */
+
+#include "bel_simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BEL_SIMD_X86
+#include <immintrin.h>
+#endif
+
+
+/* One implementation of every routine, for a given instruction set  */
+typedef struct {
+    const char *name;
+    const char* (*find_either)(const char*, const size_t, const int, const int);
+} SimdImpl;
+
+
+static const SimdImpl* get_impl(void);
+
+static const char* find_either_scalar(
+        const char*, const size_t, const int, const int);
+
+static const SimdImpl scalar_impl = {"scalar", find_either_scalar};
+
+#ifdef BEL_SIMD_X86
+static const char* find_either_sse2(
+        const char*, const size_t, const int, const int);
+static const char* find_either_avx2(
+        const char*, const size_t, const int, const int);
+
+static const SimdImpl sse2_impl = {"sse2", find_either_sse2};
+static const SimdImpl avx2_impl = {"avx2", find_either_avx2};
+#endif
+
+
+/* Implementation picked on first use  */
+static const SimdImpl *impl;
+
+
+const char*
+bel_find_either(const char *buf, const size_t len, const int c1, const int c2)
+{
+    return get_impl()->find_either(buf, len, c1, c2);
+}
+
+const char*
+bel_simd_name(void)
+{
+    return get_impl()->name;
+}
+
+
+static const SimdImpl*
+get_impl(void)
+{
+    if (impl != NULL) return impl;
+    impl = &scalar_impl;
+#ifdef BEL_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        impl = &avx2_impl;
+    } else if (__builtin_cpu_supports("sse2")) {
+        impl = &sse2_impl;
+    }
+#endif
+    return impl;
+}
+
+
+static const char*
+find_either_scalar(
+        const char *buf, const size_t len, const int c1, const int c2)
+{
+    const char *end;
+
+    for (end = buf + len; buf < end; ++buf) {
+        if (*buf == (char) c1 || *buf == (char) c2) return buf;
+    }
+    return NULL;
+}
+
+
+#ifdef BEL_SIMD_X86
+
+/*
+ * The vector loops below deal with whole 16 or 32-byte blocks, leaving the
+ * remainder to the narrower versions
+ */
+
+__attribute__((target("sse2"))) static const char*
+find_either_sse2(const char *buf, const size_t len, const int c1, const int c2)
+{
+    size_t i;
+    int mask;
+    __m128i block;
+    const __m128i needle1 = _mm_set1_epi8((char) c1);
+    const __m128i needle2 = _mm_set1_epi8((char) c2);
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        block = _mm_loadu_si128((const __m128i*) (buf + i));
+        mask = _mm_movemask_epi8(_mm_or_si128(
+                _mm_cmpeq_epi8(block, needle1),
+                _mm_cmpeq_epi8(block, needle2)));
+        if (mask != 0) return buf + i + __builtin_ctz(mask);
+    }
+    return find_either_scalar(buf + i, len - i, c1, c2);
+}
+
+__attribute__((target("avx2"))) static const char*
+find_either_avx2(const char *buf, const size_t len, const int c1, const int c2)
+{
+    size_t i;
+    unsigned int mask;
+    __m256i block;
+    const __m256i needle1 = _mm256_set1_epi8((char) c1);
+    const __m256i needle2 = _mm256_set1_epi8((char) c2);
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        block = _mm256_loadu_si256((const __m256i*) (buf + i));
+        mask = _mm256_movemask_epi8(_mm256_or_si256(
+                _mm256_cmpeq_epi8(block, needle1),
+                _mm256_cmpeq_epi8(block, needle2)));
+        if (mask != 0) return buf + i + __builtin_ctz(mask);
+    }
+    return find_either_sse2(buf + i, len - i, c1, c2);
+}
+
+#endif  /* BEL_SIMD_X86  */
@@ -0,0 +1,25 @@
+#ifndef BELSIMD_H_INCLUDED
+#define BELSIMD_H_INCLUDED
+
+#include <stddef.h>
+
+
+/*
+ * Vectorized byte scanning, for what the C library has no single call for
+ * (memchr(), strlen() and memcpy() are vectorized already). Routines pick the
+ * widest instruction set supported by the CPU (AVX2, then SSE2) on their
+ * first call, and fall back to plain C elsewhere
+ */
+
+
+/*
+ * Returns a pointer to the first byte among the first <len> of <buf> that is
+ * either <c1> or <c2>, or NULL if there is none
+ */
+extern const char* bel_find_either(
+        const char*, const size_t len, const int c1, const int c2);
+
+/* Returns the name of the instruction set picked at runtime  */
+extern const char* bel_simd_name(void);
+
+#endif	/* BELSIMD_H_INCLUDED */
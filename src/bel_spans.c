@@ -0,0 +1,160 @@
+/* bel_spans - Per-request spans, dumped as Chrome traces  */
+
+#include "bel_spans.h"
+#include "bel_common.h"
+#include "bel_placement.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+
+typedef struct {
+    unsigned long seq;      /* position in the ring plus 1, once complete  */
+    unsigned long start;    /* nanoseconds, monotonic  */
+    unsigned long dur;
+    unsigned long conn;
+    long pid;
+    int kind;
+    char name[CMD_MSGLEN];  /* of commands  */
+} Span;
+
+typedef struct {
+    unsigned long head;     /* next position to fill  */
+    Span spans[SPAN_RING_SIZE];
+} Ring;
+
+typedef struct {
+    unsigned long last_conn;    /* last connection number given out  */
+    Ring rings[SPAN_RINGS];
+} Spans;
+
+
+static int read_span(Ring*, const unsigned long, Span*);
+static void print_span(FILE*, const Span* const);
+
+
+static const char* const kind_names[NO_OF_SPAN_KINDS] =
+        {"command", "recv", "retrieve", "format", "send", "store", "delete"};
+
+static Spans *spans;
+
+/* Ring and connection of the calling process, if it serves one  */
+static Ring *ring;
+static unsigned long conn;
+static long pid;
+
+
+void
+bel_spans_init_or_die(void)
+{
+    spans = bel_map_shared_or_die(sizeof(Spans));
+}
+
+
+void
+bel_spans_new_connection(void)
+{
+    if (spans == NULL) return;
+    conn = __sync_add_and_fetch(&spans->last_conn, 1UL);
+    ring = spans->rings + conn % SPAN_RINGS;
+    pid = getpid();
+}
+
+
+void
+bel_spans_record(const int kind, const char* const name,
+        const unsigned long start)
+{
+    unsigned long pos, end;
+    Span *span;
+
+    if (ring == NULL) return;
+    end = bel_clock_ns();
+    pos = __sync_fetch_and_add(&ring->head, 1UL);
+    span = ring->spans + pos % SPAN_RING_SIZE;
+    span->seq = 0;
+    __sync_synchronize();
+    span->start = start;
+    span->dur = end - start;
+    span->conn = conn;
+    span->pid = pid;
+    span->kind = kind;
+    if (kind == SPAN_COMMAND) {
+        strncpy(span->name, name, CMD_MSGLEN - 1);
+        span->name[CMD_MSGLEN - 1] = '\0';
+    }
+    __sync_synchronize();
+    span->seq = pos + 1;
+}
+
+
+int
+bel_spans_dump(const char* const path)
+{
+    FILE *out;
+    int i, first = 1;
+    unsigned long pos, head, count = 0;
+    Span span;
+
+    if (spans == NULL) return 0;
+    out = fopen(path, "w");
+    if (out == NULL) {
+        perror("[ERROR] fopen()");
+        return 0;
+    }
+    fprintf(out, "{\"traceEvents\":[");
+    for (i = 0; i < SPAN_RINGS; ++i) {
+        head = *(volatile unsigned long*) &spans->rings[i].head;
+        pos = head > SPAN_RING_SIZE ? head - SPAN_RING_SIZE : 0;
+        for (; pos < head; ++pos) {
+            if (!read_span(spans->rings + i, pos, &span)) continue;
+            fprintf(out, first ? "\n" : ",\n");
+            print_span(out, &span);
+            first = 0;
+            ++count;
+        }
+    }
+    fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+    if (fclose(out) == EOF) {
+        perror("[ERROR] cannot write the spans");
+        return 0;
+    }
+    printf("[INFO] dumped '%lu' spans to '%s'\n", count, path);
+    return 1;
+}
+
+/*
+ * Copies the span at <pos> of <r> into <span>.
+ * Returns 0 (false) if it is being written, or was overwritten meanwhile
+ */
+static int
+read_span(Ring *r, const unsigned long pos, Span *span)
+{
+    Span *src;
+
+    src = r->spans + pos % SPAN_RING_SIZE;
+    if (*(volatile unsigned long*) &src->seq != pos + 1) return 0;
+    __sync_synchronize();
+    *span = *src;
+    __sync_synchronize();
+    return *(volatile unsigned long*) &src->seq == pos + 1;
+}
+
+/* Prints <span> as a complete event, with times in microseconds  */
+static void
+print_span(FILE *out, const Span* const span)
+{
+    const char *name, *cat;
+
+    if (span->kind == SPAN_COMMAND) {
+        name = span->name;
+        cat = kind_names[SPAN_COMMAND];
+    } else {
+        name = kind_names[span->kind];
+        cat = "stage";
+    }
+    fprintf(out, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+            "\"ts\":%lu.%03lu,\"dur\":%lu.%03lu,\"pid\":%ld,\"tid\":%lu}",
+            name, cat, span->start / 1000, span->start % 1000,
+            span->dur / 1000, span->dur % 1000, span->pid, span->conn);
+}
@@ -0,0 +1,60 @@
+#ifndef BELSPANS_H_INCLUDED
+#define BELSPANS_H_INCLUDED
+
+
+/*
+ * Spans: where the time of every request goes, stage by stage. Each
+ * connection records its spans into a ring in memory shared by the server and
+ * all of its children, the rings being handed out to connections in turn;
+ * full rings overwrite their oldest spans. Recording takes a clock read and a
+ * couple of atomic operations, and never blocks. On demand, all the rings are
+ * dumped as a Chrome trace, in the JSON format that chrome://tracing and
+ * Perfetto load, with a track per connection where the stages of a command
+ * nest within the command
+ */
+
+
+/* Stages, each one a kind of span  */
+#define SPAN_COMMAND    0   /* a whole command, named after it  */
+#define SPAN_RECV       1   /* receiving a subject or a body  */
+#define SPAN_RETRIEVE   2   /* reading messages from the storage  */
+#define SPAN_FORMAT     3   /* turning them into a message list  */
+#define SPAN_SEND       4   /* sending the message list  */
+#define SPAN_STORE      5   /* storing a message  */
+#define SPAN_DELETE     6   /* deleting a message  */
+#define NO_OF_SPAN_KINDS 7
+
+/* Rings, and spans kept by each one  */
+#define SPAN_RINGS 64
+#define SPAN_RING_SIZE 1024
+
+
+/*
+ * Maps the shared memory holding the rings. To be called once, before
+ * forking any child: until then, nothing is recorded. Exits on failure
+ */
+extern void bel_spans_init_or_die(void);
+
+/*
+ * Gives the connection served by the calling process a ring, and a new
+ * connection number, for the spans recorded from now on
+ */
+extern void bel_spans_new_connection(void);
+
+/*
+ * Records a span of the given kind, from <start> (as given by bel_clock_ns())
+ * to now. Commands are named after <name>, which must stay valid and need no
+ * escaping in JSON; other kinds ignore it. Does nothing unless the calling
+ * process has a ring
+ */
+extern void bel_spans_record(const int kind, const char* const name,
+        const unsigned long start);
+
+/*
+ * Writes the spans in all the rings, as a Chrome trace, to the file at
+ * <path>, replacing it.
+ * Returns 0 (false) on failure
+ */
+extern int bel_spans_dump(const char* const path);
+
+#endif	/* BELSPANS_H_INCLUDED */
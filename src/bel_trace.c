@@ -0,0 +1,287 @@
+/* bel_trace - Binary traces of the traffic received by the server  */
+
+#include "bel_trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+
+/* Length, time, connection, event and number of fields  */
+#define RECORD_HEADER_LEN (4 + 8 + 8 + 1 + 1)
+#define FIELD_HEADER_LEN 4
+
+/* Where the number of fields is, within a record  */
+#define NO_OF_FIELDS_OFFSET (RECORD_HEADER_LEN - 1)
+
+
+static void reserve_or_die(const size_t);
+static void put_u32(unsigned char*, const unsigned long);
+static void put_u64(unsigned char*, const unsigned long);
+static unsigned long get_u32(const unsigned char*);
+static unsigned long get_u64(const unsigned char*);
+static char* read_file_or_die(const char* const, size_t*);
+static size_t parse_record(const unsigned char*, const size_t, TraceRecord*);
+static void malformed_trace_and_die(const char* const);
+
+
+static int trace_fd = -1;
+
+/* Last connection number given out, shared among all the processes  */
+static unsigned long *last_conn;
+
+/* Connection of the calling process  */
+static unsigned long conn;
+
+/* Record being built  */
+static unsigned char *record;
+static size_t record_len;
+static size_t record_cap;
+
+
+void
+bel_trace_open_or_die(const char* const path)
+{
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (trace_fd == -1) {
+        perror("[FATAL] open()");
+        exit(EXIT_FAILURE);
+    }
+    if (write(trace_fd, TRACE_MAGIC, TRACE_MAGIC_LEN) != TRACE_MAGIC_LEN) {
+        perror("[FATAL] write()");
+        exit(EXIT_FAILURE);
+    }
+    last_conn = mmap(NULL, sizeof(*last_conn), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (last_conn == MAP_FAILED) {
+        perror("[FATAL] mmap()");
+        exit(EXIT_FAILURE);
+    }
+    printf("[INFO] tracing the traffic to '%s'\n", path);
+}
+
+void
+bel_trace_new_connection(void)
+{
+    if (trace_fd == -1) return;
+    conn = __sync_add_and_fetch(last_conn, 1UL);
+}
+
+void
+bel_trace_end_connection(void)
+{
+    bel_trace_begin(TRACE_CLOSE);
+    bel_trace_end();
+}
+
+
+void
+bel_trace_begin(const int event)
+{
+    struct timeval now;
+
+    if (trace_fd == -1) return;
+    gettimeofday(&now, NULL);
+    reserve_or_die(RECORD_HEADER_LEN);
+    put_u64(record + 4,
+            (unsigned long) now.tv_sec * 1000000UL + now.tv_usec);
+    put_u64(record + 12, conn);
+    record[20] = event;
+    record[NO_OF_FIELDS_OFFSET] = 0;
+    record_len = RECORD_HEADER_LEN;
+}
+
+void
+bel_trace_field(const char* const buf, const size_t len)
+{
+    if (trace_fd == -1 || record[NO_OF_FIELDS_OFFSET] == TRACE_MAX_FIELDS) {
+        return;
+    }
+    reserve_or_die(record_len + FIELD_HEADER_LEN + len);
+    put_u32(record + record_len, len);
+    memcpy(record + record_len + FIELD_HEADER_LEN, buf, len);
+    record_len += FIELD_HEADER_LEN + len;
+    ++record[NO_OF_FIELDS_OFFSET];
+}
+
+void
+bel_trace_dropped(void)
+{
+    if (trace_fd == -1 || record[NO_OF_FIELDS_OFFSET] == TRACE_MAX_FIELDS) {
+        return;
+    }
+    reserve_or_die(record_len + FIELD_HEADER_LEN);
+    put_u32(record + record_len, TRACE_DROPPED);
+    record_len += FIELD_HEADER_LEN;
+    ++record[NO_OF_FIELDS_OFFSET];
+}
+
+void
+bel_trace_end(void)
+{
+    if (trace_fd == -1) return;
+    put_u32(record, record_len - 4);
+
+    /* appends are atomic: a single write keeps the record in one piece  */
+    if (write(trace_fd, record, record_len) != (ssize_t) record_len) {
+        perror("[WARN] cannot write trace record");
+    }
+}
+
+/* Makes room for <len> bytes in the record being built  */
+static void
+reserve_or_die(const size_t len)
+{
+    if (len <= record_cap) return;
+    record_cap = len > 2 * record_cap ? len : 2 * record_cap;
+    record = realloc(record, record_cap);
+    if (record == NULL) {
+        perror("[FATAL] realloc()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+size_t
+bel_trace_load_or_die(const char* const path, TraceRecord **records)
+{
+    size_t size, pos, len, count = 0;
+    char *buf;
+
+    buf = read_file_or_die(path, &size);
+    if (size < TRACE_MAGIC_LEN
+            || memcmp(buf, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+        malformed_trace_and_die(path);
+    }
+    for (pos = TRACE_MAGIC_LEN; pos < size; pos += len) {   /* count first  */
+        len = parse_record((unsigned char*) buf + pos, size - pos, NULL);
+        if (len == 0) malformed_trace_and_die(path);
+        ++count;
+    }
+    *records = malloc(count * sizeof(TraceRecord) + 1);
+    if (*records == NULL) {
+        perror("[FATAL] malloc()");
+        exit(EXIT_FAILURE);
+    }
+    for (pos = TRACE_MAGIC_LEN, count = 0; pos < size; ++count) {
+        pos += parse_record((unsigned char*) buf + pos, size - pos,
+                *records + count);
+    }
+    return count;
+}
+
+/*
+ * Parses the record at the start of buf[0..len) into <rec>, unless NULL.
+ * Returns its length, or 0 if it is malformed
+ */
+static size_t
+parse_record(const unsigned char *buf, const size_t len, TraceRecord *rec)
+{
+    int i, no_of_fields;
+    size_t pos, rec_len;
+    unsigned long field_len;
+
+    if (len < RECORD_HEADER_LEN) return 0;
+    rec_len = get_u32(buf) + 4;
+    no_of_fields = buf[NO_OF_FIELDS_OFFSET];
+    if (rec_len < RECORD_HEADER_LEN || rec_len > len
+            || no_of_fields > TRACE_MAX_FIELDS) {
+        return 0;
+    }
+    if (rec != NULL) {
+        *rec = empty_trace_record;
+        rec->time_us = get_u64(buf + 4);
+        rec->conn = get_u64(buf + 12);
+        rec->event = buf[20];
+        rec->no_of_fields = no_of_fields;
+    }
+    for (i = 0, pos = RECORD_HEADER_LEN; i < no_of_fields; ++i) {
+        if (pos + FIELD_HEADER_LEN > rec_len) return 0;
+        field_len = get_u32(buf + pos);
+        pos += FIELD_HEADER_LEN;
+        if (field_len != TRACE_DROPPED && field_len > rec_len - pos) return 0;
+        if (rec != NULL) {
+            rec->fields[i] = field_len == TRACE_DROPPED ? NULL
+                    : (const char*) buf + pos;
+            rec->lens[i] = field_len;
+        }
+        if (field_len != TRACE_DROPPED) pos += field_len;
+    }
+    return pos == rec_len ? rec_len : 0;
+}
+
+/* Returns the whole content of the file at <path>, saving its size  */
+static char*
+read_file_or_die(const char* const path, size_t *size)
+{
+    int fd;
+    char *buf;
+    size_t done = 0;
+    ssize_t read_res;
+    struct stat st;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror("[FATAL] cannot open trace");
+        exit(EXIT_FAILURE);
+    }
+    *size = st.st_size;
+    buf = malloc(*size + 1);
+    if (buf == NULL) {
+        perror("[FATAL] malloc()");
+        exit(EXIT_FAILURE);
+    }
+    while (done < *size) {
+        read_res = read(fd, buf + done, *size - done);
+        if (read_res == -1 && errno == EINTR) continue;
+        if (read_res <= 0) {
+            perror("[FATAL] cannot read trace");
+            exit(EXIT_FAILURE);
+        }
+        done += read_res;
+    }
+    close(fd);
+    return buf;
+}
+
+static void
+malformed_trace_and_die(const char* const path)
+{
+    fprintf(stderr, "[FATAL] '%s' is not a valid trace\n", path);
+    exit(EXIT_FAILURE);
+}
+
+
+static void
+put_u32(unsigned char *buf, const unsigned long value)
+{
+    buf[0] = (value >> 24) & 0xff;
+    buf[1] = (value >> 16) & 0xff;
+    buf[2] = (value >> 8) & 0xff;
+    buf[3] = value & 0xff;
+}
+
+static void
+put_u64(unsigned char *buf, const unsigned long value)
+{
+    put_u32(buf, (value >> 16) >> 16);  /* no 32-bit shifts of 32-bit longs  */
+    put_u32(buf + 4, value & 0xffffffffUL);
+}
+
+static unsigned long
+get_u32(const unsigned char *buf)
+{
+    return (unsigned long) buf[0] << 24 | (unsigned long) buf[1] << 16
+            | (unsigned long) buf[2] << 8 | buf[3];
+}
+
+static unsigned long
+get_u64(const unsigned char *buf)
+{
+    return (get_u32(buf) << 16) << 16 | get_u32(buf + 4);
+}
@@ -0,0 +1,97 @@
+#ifndef BELTRACE_H_INCLUDED
+#define BELTRACE_H_INCLUDED
+
+#include <stddef.h>
+
+
+/*
+ * Traces of the traffic received by the server, for replaying it later. A
+ * trace file starts with TRACE_MAGIC, followed by one record per event, all
+ * numbers in network byte order:
+ *
+ *      4 bytes     length of the rest of the record
+ *      8 bytes     time of the event, in microseconds since the Epoch
+ *      8 bytes     connection number, unique within the trace
+ *      1 byte      TRACE_* event
+ *      1 byte      number of fields
+ *      fields      each one a 4-byte length followed by that many bytes
+ *
+ * Commands are traced with their name and then their arguments, as they were
+ * received: fixed-width ones (IDs, versions, times to live) with all their
+ * bytes, subjects and bodies as the content of their field. Every process
+ * appends whole records with a single write, so records of concurrent
+ * connections never mix, but they can be slightly out of time order
+ */
+
+
+#define TRACE_MAGIC "BELTRC01"
+#define TRACE_MAGIC_LEN 8
+
+/* Events, and their fields  */
+#define TRACE_LOGIN     0   /* the user name  */
+#define TRACE_COMMAND   1   /* the command, then its arguments  */
+#define TRACE_CLOSE     2   /* none  */
+
+/* Most fields of a record: a SENDEX has its name, TTL, subject and body  */
+#define TRACE_MAX_FIELDS 4
+
+/*
+ * Length standing for a field that the server read and threw away, being too
+ * long: it has no content in the trace
+ */
+#define TRACE_DROPPED 0xffffffffUL
+
+
+/* An event read back from a trace  */
+typedef struct {
+    unsigned long time_us;
+    unsigned long conn;
+    int event;
+    int no_of_fields;
+    const char *fields[TRACE_MAX_FIELDS];  /* not '\0'-terminated  */
+    unsigned long lens[TRACE_MAX_FIELDS];
+} TraceRecord;
+static const TraceRecord empty_trace_record;
+
+
+/*
+ * Writing side. Creates (or truncates) the trace file at <path>, which
+ * processes forked later keep appending to. Exits on failure
+ */
+extern void bel_trace_open_or_die(const char* const path);
+
+/*
+ * Gives the connection served by the calling process a new connection
+ * number, for the events traced from now on
+ */
+extern void bel_trace_new_connection(void);
+
+/* Traces the end of the connection served by the calling process  */
+extern void bel_trace_end_connection(void);
+
+/*
+ * Starts a record of <event>, timestamped now, to which the calls below add
+ * fields. Nothing is written until bel_trace_end(). Does nothing unless a
+ * trace is being written, like all the functions below
+ */
+extern void bel_trace_begin(const int event);
+
+/* Adds a field of <len> bytes to the record being built  */
+extern void bel_trace_field(const char* const buf, const size_t len);
+
+/* Adds a TRACE_DROPPED field to the record being built  */
+extern void bel_trace_dropped(void);
+
+/* Appends the record being built to the trace. Failures are only reported  */
+extern void bel_trace_end(void);
+
+
+/*
+ * Reading side. Loads the whole trace at <path> into memory, pointing
+ * <*records> to its records, in file order.
+ * Returns their number. Exits on failure, and on malformed traces
+ */
+extern size_t bel_trace_load_or_die(const char* const path,
+        TraceRecord **records);
+
+#endif	/* BELTRACE_H_INCLUDED */
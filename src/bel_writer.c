@@ -0,0 +1,444 @@
+/*
+ * bel_writer - Single database writer, fed by a shared queue
+ *
+ * General considerations:
+ * - the queue is a ring of fixed-size slots in shared memory. Every slot has
+ *      a sequence number telling whether it is free for a given position of
+ *      the ring, or filled for it: producers claim positions by moving the
+ *      tail with compare-and-swap, and nobody ever holds a lock
+ * - a slot stays with its producer until the producer has read the outcome
+ *      of its write, and only then is it free for the next round
+ * - whoever waits (the writer for work, producers for their outcome) sleeps
+ *      on a futex, with a timeout so that a writer dying does not leave
+ *      anybody stuck: a new one takes over from the queue as it is
+ * - every write carries the channel selected by its producer, and a batch
+ *      never spans two channels: the writer selects the one of the batch
+ * - before applying a batch, the writer records where it is in the queue and
+ *      the next ID of every shard: a writer dying halfway through it leaves
+ *      that behind, and the new one tells from the IDs the stores that made
+ *      it to the files, and only applies the rest again
+ * - a producer dying would leave its slot taken for ever, and the queue stuck
+ *      once the tail gets back to it: every slot tells who claimed it and for
+ *      which position, and whenever the writer has nothing to apply it frees
+ *      the slots of producers that are gone, skipping the write at the head
+ *      if its producer died before queueing it. Only a producer killed right
+ *      between moving the tail and signing its slot goes unnoticed
+ */
+
+#include "bel_writer.h"
+#include "bel_common.h"
+#include "bel_placement.h"
+#include <errno.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/* Room for the sender, subject and body of a message, with terminators  */
+#define SLOT_TEXT_MAXLEN (FROM_MAXLEN + 2 * TXT_MAXLEN_LIMIT + 3)
+
+/* Longest sleep on a futex before looking around again  */
+#define WAIT_MS 1000
+
+/* Pause of producers finding the queue full, in microseconds  */
+#define FULL_PAUSE_US 50
+
+
+typedef struct {
+    unsigned long seq;  /* position it is free for, plus 1 once filled  */
+    int done;           /* futex: 1 once the writer applied it  */
+    int kind;           /* MSG_WRITE_*  */
+    int result;
+    pid_t owner;            /* the producer that claimed it...  */
+    unsigned long claimed;  /* ...for this position, set after <owner>  */
+    unsigned long id;
+    time_t expires;
+    size_t from_len;
+    size_t subject_len;
+    size_t body_len;
+    char channel[MSG_CHANNEL_MAXLEN + 1];
+    char text[SLOT_TEXT_MAXLEN];
+} Slot;
+
+typedef struct {
+    unsigned long tail;     /* next position to claim  */
+    unsigned long head;     /* next position to apply, moved by the writer  */
+    int signal;             /* futex: bumped whenever a write is queued  */
+    int sleeping;           /* whether the writer waits on <signal>  */
+    pid_t owner;            /* the server: the writer exits along with it  */
+    unsigned long batch_head;   /* first position of the batch applied...  */
+    int batch_len;              /* ...and its writes, 0 once completed  */
+    int batch_applied;          /* whether its outcomes are in its slots  */
+    unsigned long next_ids[MSG_MAX_SHARDS];     /* of the shards, before it  */
+    Slot slots[WRITER_QUEUE_SIZE];
+} Queue;
+
+
+static int submit(Slot*, const unsigned long);
+static Slot* claim_slot(unsigned long*);
+static void fill_slot(Slot*, const Message* const);
+static void recover_batch(void);
+static int collect_batch(MsgWrite*, const char**, const int);
+static void begin_batch(const int);
+static void complete_batch(const MsgWrite* const, const int);
+static void wait_for_work(const int);
+static void reclaim_abandoned(void);
+static int is_gone(const pid_t);
+static unsigned long load_seq(Slot*);
+static void futex_wait(int*, const int);
+static void futex_wake(int*);
+
+
+static Queue *queue;
+
+
+void
+bel_writer_init_or_die(void)
+{
+    int i;
+
+    queue = bel_map_shared_or_die(sizeof(Queue));
+    for (i = 0; i < WRITER_QUEUE_SIZE; ++i) queue->slots[i].seq = i;
+    queue->owner = getpid();
+}
+
+
+int
+bel_writer_store(const Message msg)
+{
+    Slot *slot;
+    unsigned long pos;
+
+    if (msg.from_len >= FROM_MAXLEN || msg.subject_len > TXT_MAXLEN_LIMIT
+            || msg.body_len > TXT_MAXLEN_LIMIT) {
+        fprintf(stderr, "[ERROR] message too long for the writer queue\n");
+        return 0;
+    }
+    slot = claim_slot(&pos);
+    slot->kind = MSG_WRITE_STORE;
+    fill_slot(slot, &msg);
+    return submit(slot, pos);
+}
+
+int
+bel_writer_delete(const char* const username, const unsigned long msgid)
+{
+    Slot *slot;
+    unsigned long pos;
+    Message msg = empty_message;
+
+    msg.from = username;
+    msg.from_len = strlen(username);
+    if (msg.from_len >= FROM_MAXLEN) {
+        fprintf(stderr, "[ERROR] user name too long for the writer queue\n");
+        return 0;
+    }
+    msg.id = msgid;
+    slot = claim_slot(&pos);
+    slot->kind = MSG_WRITE_DELETE;
+    fill_slot(slot, &msg);
+    return submit(slot, pos);
+}
+
+/*
+ * Hands the filled <slot>, claimed at <pos>, to the writer and waits for it
+ * to be applied, then frees the slot.
+ * Returns the outcome of the write
+ */
+static int
+submit(Slot *slot, const unsigned long pos)
+{
+    int result;
+
+    slot->done = 0;
+    __sync_synchronize();
+    slot->seq = pos + 1;
+    __sync_fetch_and_add(&queue->signal, 1);
+    if (queue->sleeping) futex_wake(&queue->signal);
+
+    while (!*(volatile int*) &slot->done) futex_wait(&slot->done, 0);
+    __sync_synchronize();
+    result = slot->result;
+    slot->seq = pos + WRITER_QUEUE_SIZE;
+    return result;
+}
+
+/* Claims the next position of the queue, waiting for room if it is full  */
+static Slot*
+claim_slot(unsigned long *pos)
+{
+    unsigned long tail, seq;
+    Slot *slot;
+
+    for (;;) {
+        tail = *(volatile unsigned long*) &queue->tail;
+        slot = queue->slots + tail % WRITER_QUEUE_SIZE;
+        seq = load_seq(slot);
+        if (seq == tail) {
+            if (__sync_bool_compare_and_swap(&queue->tail, tail, tail + 1)) {
+                slot->owner = getpid();
+                __sync_synchronize();
+                slot->claimed = tail;
+                *pos = tail;
+                return slot;
+            }
+        } else if ((long) (seq - tail) < 0) {
+            usleep(FULL_PAUSE_US);  /* still taken from the last round  */
+        }
+    }
+}
+
+static void
+fill_slot(Slot *slot, const Message* const msg)
+{
+    char *text = slot->text;
+
+    slot->id = msg->id;
+    slot->expires = msg->expires;
+    slot->from_len = msg->from_len;
+    slot->subject_len = msg->subject_len;
+    slot->body_len = msg->body_len;
+    strcpy(slot->channel, msg_channel());
+    memcpy(text, msg->from, msg->from_len);
+    text[msg->from_len] = '\0';
+    if (slot->kind == MSG_WRITE_DELETE) return;
+    text += msg->from_len + 1;
+    memcpy(text, msg->subject, msg->subject_len);
+    text[msg->subject_len] = '\0';
+    text += msg->subject_len + 1;
+    memcpy(text, msg->body, msg->body_len);
+    text[msg->body_len] = '\0';
+}
+
+
+void
+bel_writer_run(void)
+{
+    int n, seen;
+    const char *channel;
+    MsgWrite writes[WRITER_QUEUE_SIZE];
+
+    printf("[INFO] writer started with pid = '%ld'\n", (long) getpid());
+    recover_batch();
+    while (getppid() == queue->owner) {
+        seen = *(volatile int*) &queue->signal;
+        n = collect_batch(writes, &channel, WRITER_QUEUE_SIZE);
+        if (n == 0) {
+            reclaim_abandoned();
+            wait_for_work(seen);
+            continue;
+        }
+        if (msg_select_channel(channel)) {
+            begin_batch(n);
+            msg_write_batch(writes, n);
+        } else {    /* none of them is done  */
+            fprintf(stderr, "[ERROR] cannot select channel '%s'\n", channel);
+        }
+        complete_batch(writes, n);
+    }
+}
+
+/*
+ * Completes the batch that a previous writer was applying when it died, if
+ * any, applying again only what did not make it to the files
+ */
+static void
+recover_batch(void)
+{
+    int i, n, m;
+    unsigned long pos;
+    const char *channel;
+    Slot *slot;
+    MsgWrite writes[WRITER_QUEUE_SIZE], rest[WRITER_QUEUE_SIZE];
+
+    if (queue->batch_len == 0 || queue->batch_head != queue->head) return;
+    if (queue->batch_applied) {     /* some producers miss their outcome  */
+        for (i = 0; i < queue->batch_len; ++i) {
+            pos = queue->head + i;
+            slot = queue->slots + pos % WRITER_QUEUE_SIZE;
+            if (load_seq(slot) != pos + 1 || slot->done) continue;
+            slot->done = 1;
+            futex_wake(&slot->done);
+        }
+        queue->head += queue->batch_len;
+        queue->batch_len = 0;
+        return;
+    }
+
+    n = collect_batch(writes, &channel, queue->batch_len);
+    printf("[INFO] recovering a batch of '%d' writes\n", n);
+    if (n > 0 && msg_select_channel(channel)) {
+        msg_write_batch_applied(writes, n, queue->next_ids);
+        for (i = 0, m = 0; i < n; ++i) {
+            if (!writes[i].done) rest[m++] = writes[i];
+        }
+        printf("[INFO] '%d' of them made it, applying the others\n", n - m);
+        msg_write_batch(rest, m);
+        for (i = 0, m = 0; i < n; ++i) {
+            if (!writes[i].done) writes[i] = rest[m++];
+        }
+    }
+    complete_batch(writes, n);
+}
+
+/*
+ * Fills <writes> with the filled slots from the head on, in order, up to
+ * <max> of them or to the first one for another channel, pointing <channel>
+ * to the channel of them all.
+ * Returns their number
+ */
+static int
+collect_batch(MsgWrite *writes, const char **channel, const int max)
+{
+    int n;
+    unsigned long pos;
+    Slot *slot;
+    Message *msg;
+
+    for (n = 0; n < max; ++n) {
+        pos = queue->head + n;
+        slot = queue->slots + pos % WRITER_QUEUE_SIZE;
+        if (load_seq(slot) != pos + 1) break;
+        if (n == 0) {
+            *channel = slot->channel;
+        } else if (strcmp(slot->channel, *channel) != 0) {
+            break;
+        }
+        writes[n] = empty_msg_write;
+        writes[n].kind = slot->kind;
+        msg = &writes[n].msg;
+        msg->id = slot->id;
+        msg->expires = slot->expires;
+        msg->from = slot->text;
+        msg->from_len = slot->from_len;
+        msg->subject = msg->from + slot->from_len + 1;
+        msg->subject_len = slot->subject_len;
+        msg->body = msg->subject + slot->subject_len + 1;
+        msg->body_len = slot->body_len;
+    }
+    return n;
+}
+
+/*
+ * Records that the <n> writes from the head are about to be applied, to the
+ * selected channel, for a writer taking over to recover them
+ */
+static void
+begin_batch(const int n)
+{
+    queue->batch_len = 0;
+    __sync_synchronize();
+    msg_next_ids(queue->next_ids);
+    queue->batch_head = queue->head;
+    queue->batch_applied = 0;
+    __sync_synchronize();
+    queue->batch_len = n;
+}
+
+/* Hands the outcomes of the <n> writes from the head to their producers  */
+static void
+complete_batch(const MsgWrite* const writes, const int n)
+{
+    int i;
+    Slot *slot;
+
+    for (i = 0; i < n; ++i) {
+        slot = queue->slots + (queue->head + i) % WRITER_QUEUE_SIZE;
+        slot->result = writes[i].done;
+        slot->id = writes[i].msg.id;
+    }
+    __sync_synchronize();
+    queue->batch_applied = 1;
+    __sync_synchronize();
+    for (i = 0; i < n; ++i) {
+        slot = queue->slots + (queue->head + i) % WRITER_QUEUE_SIZE;
+        slot->done = 1;
+        futex_wake(&slot->done);
+    }
+    queue->head += n;
+    __sync_synchronize();
+    queue->batch_len = 0;
+}
+
+/*
+ * Sleeps until a write is queued, unless one was since <signal> had the
+ * value <seen>
+ */
+static void
+wait_for_work(const int seen)
+{
+    queue->sleeping = 1;
+    __sync_synchronize();
+    futex_wait(&queue->signal, seen);
+    queue->sleeping = 0;
+}
+
+/*
+ * Frees the slots whose producer died before reading the outcome of its
+ * write, and skips the write at the head if its producer died before queueing
+ * it
+ */
+static void
+reclaim_abandoned(void)
+{
+    int i;
+    unsigned long head;
+    Slot *slot;
+
+    head = queue->head;
+    for (i = 0; i < WRITER_QUEUE_SIZE; ++i) {
+        slot = queue->slots + i;
+        if (load_seq(slot) == slot->claimed + 1
+                && (long) (head - slot->claimed) > 0 && is_gone(slot->owner)) {
+            fprintf(stderr, "[WARN] freeing the slot of dead producer"
+                    " '%ld'\n", (long) slot->owner);
+            slot->seq = slot->claimed + WRITER_QUEUE_SIZE;
+        }
+    }
+    slot = queue->slots + head % WRITER_QUEUE_SIZE;
+    if (*(volatile unsigned long*) &queue->tail != head
+            && load_seq(slot) == head && slot->claimed == head
+            && is_gone(slot->owner)) {
+        fprintf(stderr, "[WARN] skipping the write of dead producer '%ld'\n",
+                (long) slot->owner);
+        slot->seq = head + WRITER_QUEUE_SIZE;
+        ++queue->head;
+    }
+}
+
+/* Returns 1 (true) if there is no process <pid> anymore  */
+static int
+is_gone(const pid_t pid)
+{
+    return pid != 0 && kill(pid, 0) == -1 && errno == ESRCH;
+}
+
+
+static unsigned long
+load_seq(Slot *slot)
+{
+    return __sync_add_and_fetch(&slot->seq, 0UL);
+}
+
+/* Sleeps while *<addr> is <value>, up to WAIT_MS  */
+static void
+futex_wait(int *addr, const int value)
+{
+    struct timespec timeout;
+
+    timeout.tv_sec = WAIT_MS / 1000;
+    timeout.tv_nsec = WAIT_MS % 1000 * 1000000L;
+    syscall(SYS_futex, addr, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+/* Wakes up whoever sleeps on <addr>  */
+static void
+futex_wake(int *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
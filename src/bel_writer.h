@@ -0,0 +1,41 @@
+#ifndef BELWRITER_H_INCLUDED
+#define BELWRITER_H_INCLUDED
+
+#include "msg_storage.h"
+
+
+/*
+ * Single writer for the database. Processes serving connections queue their
+ * stores and deletions into memory shared with a writer process, and wait for
+ * it to apply them; the writer takes whatever is queued, up to a batch at a
+ * time, and applies it with msg_write_batch(), so that under load many writes
+ * share a single lock and a single write to the file. The queue takes any
+ * number of producers without locks, and the writer is its only consumer
+ */
+
+
+/* Writes queued at once: more producers than this wait for room  */
+#define WRITER_QUEUE_SIZE 64
+
+/*
+ * Maps the shared queue. To be called once, before forking any child.
+ * Exits on failure
+ */
+extern void bel_writer_init_or_die(void);
+
+/*
+ * Body of the writer process: applies queued writes until the process that
+ * called bel_writer_init_or_die() exits. A new writer can take over from one
+ * that died, starting from the first write not yet completed, and without
+ * applying any store twice
+ */
+extern void bel_writer_run(void);
+
+/*
+ * Same as msg_store() and msg_delete(), through the writer. Stores return 0
+ * (false) if the writer could not apply them
+ */
+extern int bel_writer_store(const Message msg);
+extern int bel_writer_delete(const char* const username, const unsigned long);
+
+#endif	/* BELWRITER_H_INCLUDED */
@@ -0,0 +1,378 @@
+/*
+ * msg_bench.c - Microbenchmarks for msg_storage
+ *
+ * General considerations:
+ * - every board size is measured in its own process, on a fresh database
+ *      file, since the storage can only be initialized once per process
+ * - results are printed as CSV (operation, board size, iterations, total and
+ *      per-operation time in nanoseconds), one line per operation and size
+ * - the standard output of the storage is thrown away, since it would be
+ *      flooded by its traces
+ */
+
+#include "msg_storage.h"
+#include "bel_common.h"
+#include "bel_placement.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+/* Board sizes measured when none are given  */
+#define DEFAULT_SIZES "1000,10000,100000,1000000"
+#define MAX_SIZES 16
+
+#define DB_PATHMAX 4096
+
+/* Messages retrieved per call, when retrieving the whole board  */
+#define FULL_PAGE_SIZE 1000
+
+/* Messages per page when retrieving random pages, as the server does  */
+#define PAGE_SIZE 10
+
+
+/* Settings coming from the command line  */
+typedef struct {
+    long sizes[MAX_SIZES];
+    int no_of_sizes;
+    int iterations;     /* repetitions of the cheap operations  */
+    int delete_iterations;
+    size_t text_len;
+    const char *dir;
+    int shards;
+} Config;
+
+
+static void parse_options_or_die(int, char**);
+static void parse_sizes_or_die(char*);
+static void usage_and_die(void);
+
+static void run_size(const long);
+static void bench_append(const long);
+static void bench_full_retrieval(const long);
+static void bench_paged_retrieval(const long);
+static void bench_delete(const char* const, const long, const int);
+static void remove_db_files(void);
+static void bench_snapshot(const long);
+static void bench_cold_startup(const char* const, const long);
+static void report(const char* const, const long, const long,
+        const unsigned long);
+
+
+static Config config;
+
+/* Where results go, since the standard output is discarded  */
+static FILE *out;
+
+static char db_path[DB_PATHMAX];
+static Message *page;
+
+/* Messages come from several senders, so that they spread over the shards  */
+#define NO_OF_SENDERS 16
+static char senders[NO_OF_SENDERS][FROM_MAXLEN];
+
+/* Messages left on the board  */
+static long board_size;
+
+
+/* Benchmark entry point  */
+int
+main(int argc, char **argv)
+{
+    int i, status, failed = 0;
+
+    parse_options_or_die(argc, argv);
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    if (out == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        perror("[FATAL] fdopen()");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(out, "operation,messages,iterations,total_ns,ns_per_op\n");
+    fflush(out);
+
+    for (i = 0; i < config.no_of_sizes; ++i) {
+        switch (fork()) {
+        case -1:
+            perror("[FATAL] fork()");
+            exit(EXIT_FAILURE);
+        case 0:
+            run_size(config.sizes[i]);
+            exit(EXIT_SUCCESS);
+        default:
+            if (wait(&status) == -1 || !WIFEXITED(status)
+                    || WEXITSTATUS(status) != EXIT_SUCCESS) {
+                fprintf(stderr, "[ERROR] run with %ld messages failed\n",
+                        config.sizes[i]);
+                ++failed;
+            }
+        }
+    }
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/* Fills the global configuration from the command line options  */
+static void
+parse_options_or_die(int argc, char **argv)
+{
+    int opt;
+    char default_sizes[] = DEFAULT_SIZES;
+
+    parse_sizes_or_die(default_sizes);
+    config.iterations = 1000;
+    config.delete_iterations = 5;
+    config.text_len = 64;
+    config.dir = ".";
+    config.shards = 1;
+    while ((opt = getopt(argc, argv, "s:i:D:t:d:S:M:H")) != -1) {
+        switch (opt) {
+        case 's': parse_sizes_or_die(optarg);                   break;
+        case 'i': config.iterations = atoi(optarg);             break;
+        case 'D': config.delete_iterations = atoi(optarg);      break;
+        case 't': config.text_len = strtoul(optarg, NULL, 10);  break;
+        case 'd': config.dir = optarg;                          break;
+        case 'S': config.shards = atoi(optarg);                 break;
+        case 'M': msg_set_cache_budget(strtoul(optarg, NULL, 10)); break;
+        case 'H': bel_hugepages_enable();                       break;
+        default:  usage_and_die();
+        }
+    }
+    if (optind != argc || config.iterations < 1
+            || config.delete_iterations < 1 || config.shards < 1
+            || config.shards > MSG_MAX_SHARDS) {
+        usage_and_die();
+    }
+}
+
+/* Parses a comma-separated list of board sizes  */
+static void
+parse_sizes_or_die(char *spec)
+{
+    char *token;
+
+    config.no_of_sizes = 0;
+    for (token = strtok(spec, ","); token != NULL; token = strtok(NULL, ",")) {
+        if (config.no_of_sizes == MAX_SIZES) usage_and_die();
+        config.sizes[config.no_of_sizes] = atol(token);
+        if (config.sizes[config.no_of_sizes] < 1) usage_and_die();
+        ++config.no_of_sizes;
+    }
+    if (config.no_of_sizes == 0) usage_and_die();
+}
+
+static void
+usage_and_die(void)
+{
+    fprintf(stderr, "usage: storage_bench [options]\n"
+            "  -s  comma-separated board sizes, up to %d of them\n"
+            "      (default %s)\n"
+            "  -i  iterations of paged retrievals and startups"
+            " (default 1000)\n"
+            "  -D  iterations of each kind of deletion (default 5)\n"
+            "  -t  length of subjects and bodies (default 64)\n"
+            "  -d  directory for the database files (default .)\n"
+            "  -S  number of shards of the database (default 1)\n"
+            "  -M  leave the text on disk, caching this many bytes of it\n"
+            "  -H  back the boards with huge pages\n",
+            MAX_SIZES, DEFAULT_SIZES);
+    exit(EXIT_FAILURE);
+}
+
+
+/* Measures all the operations on a board of <size> messages  */
+static void
+run_size(const long size)
+{
+    int i;
+
+    sprintf(db_path, "%.4000s/storage_bench_%ld.db", config.dir, size);
+    for (i = 0; i < NO_OF_SENDERS; ++i) sprintf(senders[i], "bench%d", i);
+    remove_db_files();
+    msg_init_sharded_db_or_die(db_path, config.shards);
+    page = malloc(sizeof(Message) * FULL_PAGE_SIZE);
+    if (page == NULL) {
+        perror("[FATAL] malloc()");
+        exit(EXIT_FAILURE);
+    }
+
+    bench_append(size);
+    bench_full_retrieval(size);
+    bench_paged_retrieval(size);
+    bench_cold_startup("cold_startup", size);
+    bench_snapshot(size);
+    bench_cold_startup("cold_startup_snapshot", size);
+
+    bench_delete("delete_head", size, 0);
+    bench_delete("delete_middle", size, 1);
+    bench_delete("delete_tail", size, 2);
+    remove_db_files();
+}
+
+static void
+remove_db_files(void)
+{
+    int i;
+    char path[DB_PATHMAX + 16];
+
+    if (config.shards == 1) {
+        unlink(db_path);
+        sprintf(path, "%.4000s.snap", db_path);
+        unlink(path);
+        return;
+    }
+    for (i = 0; i < config.shards; ++i) {
+        sprintf(path, "%.4000s.%d", db_path, i);
+        unlink(path);
+        sprintf(path, "%.4000s.%d.snap", db_path, i);
+        unlink(path);
+    }
+}
+
+/* Fills the board one append at a time, timing the whole lot  */
+static void
+bench_append(const long size)
+{
+    long i;
+    char *text;
+    Message msg = empty_message;
+    unsigned long start;
+
+    text = malloc(config.text_len + 1);
+    if (text == NULL) {
+        perror("[FATAL] malloc()");
+        exit(EXIT_FAILURE);
+    }
+    memset(text, 'x', config.text_len);
+    text[config.text_len] = '\0';
+    msg.subject = msg.body = text;
+    msg.subject_len = msg.body_len = config.text_len;
+
+    start = bel_clock_ns();
+    for (i = 0; i < size; ++i) {
+        msg.from = senders[i % NO_OF_SENDERS];
+        msg.from_len = strlen(msg.from);
+        msg_store(msg);
+    }
+    report("append", size, size, bel_clock_ns() - start);
+    board_size = size;
+    free(text);
+}
+
+static void
+bench_full_retrieval(const long size)
+{
+    long first = 0;
+    int retrieved;
+    unsigned long start;
+
+    start = bel_clock_ns();
+    do {
+        retrieved = msg_retrieve_range(page, first, FULL_PAGE_SIZE);
+        first += retrieved;
+    } while (retrieved == FULL_PAGE_SIZE);
+    report("full_retrieval", size, 1, bel_clock_ns() - start);
+}
+
+static void
+bench_paged_retrieval(const long size)
+{
+    int i;
+    unsigned long start;
+
+    srand(size);
+    start = bel_clock_ns();
+    for (i = 0; i < config.iterations; ++i) {
+        msg_retrieve_range(page, rand() % size, PAGE_SIZE);
+    }
+    report("paged_retrieval", size, config.iterations,
+            bel_clock_ns() - start);
+}
+
+/*
+ * Deletes <config.delete_iterations> messages, each time the first one
+ * (<where> = 0), the one in the middle (1) or the last one (2) left on the
+ * board. Only the deletions are timed, not finding out what to delete
+ */
+static void
+bench_delete(const char* const name, const long size, const int where)
+{
+    int i, deleted = 0;
+    unsigned long id, start, elapsed = 0;
+    char owner[FROM_MAXLEN];
+
+    for (i = 0; i < config.delete_iterations && board_size > 0; ++i) {
+        if (msg_retrieve_range(page, where == 0 ? 0
+                : where == 1 ? board_size / 2 : board_size - 1, 1) != 1) {
+            break;
+        }
+        id = page[0].id;
+        memcpy(owner, page[0].from, page[0].from_len + 1);
+        start = bel_clock_ns();
+        if (msg_delete(owner, id)) {
+            ++deleted;
+            --board_size;
+        }
+        elapsed += bel_clock_ns() - start;
+    }
+    if (deleted != config.delete_iterations) {
+        fprintf(stderr, "[WARN] %s: only %d deletions succeeded\n",
+                name, deleted);
+    }
+    report(name, size, config.delete_iterations, elapsed);
+}
+
+/* Times taking the first snapshot of the whole board  */
+static void
+bench_snapshot(const long size)
+{
+    unsigned long start;
+
+    start = bel_clock_ns();
+    msg_snapshot();
+    report("snapshot", size, 1, bel_clock_ns() - start);
+}
+
+/*
+ * Times a process loading the database from scratch and serving the first
+ * page, as a freshly forked server would
+ */
+static void
+bench_cold_startup(const char* const name, const long size)
+{
+    int i, iterations, status;
+    unsigned long start;
+
+    /* loading large boards is slow: do not repeat it too many times  */
+    iterations = size >= 100000 ? 3 : size > 1000 ? 10 : 100;
+    if (iterations > config.iterations) iterations = config.iterations;
+    start = bel_clock_ns();
+    for (i = 0; i < iterations; ++i) {
+        switch (fork()) {
+        case -1:
+            perror("[FATAL] fork()");
+            exit(EXIT_FAILURE);
+        case 0:
+            msg_init_sharded_db_or_die(db_path, config.shards);
+            msg_retrieve_some(page, PAGE_SIZE);
+            _exit(EXIT_SUCCESS);    /* skip the atexit() of the parent  */
+        default:
+            if (wait(&status) == -1 || !WIFEXITED(status)
+                    || WEXITSTATUS(status) != EXIT_SUCCESS) {
+                fprintf(stderr, "[ERROR] startup failed\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    report(name, size, iterations, bel_clock_ns() - start);
+}
+
+static void
+report(const char* const name, const long size, const long iterations,
+        const unsigned long elapsed)
+{
+    fprintf(out, "%s,%ld,%ld,%lu,%lu\n",
+            name, size, iterations, elapsed, elapsed / iterations);
+    fflush(out);
+}
@@ -1,159 +1,2022 @@
 /*
  * msg_storage - operations on messages, mainly storing and retrieving them
+ *
+ * The database is a text file starting with a fixed-width header, followed by
+ * one record per message:
+ *
+ *      BEL2 <generation> <next id> <version>
+ *      <id> <creation time>[ <expiry time>]
+ *      <from>
+ *      <subject>
+ *      <body>
+ *      <empty line>
+ *
+ * Fields are stored as they are, with no padding and no length limit. The
+ * expiry time is only there for messages that have one.
+ * The file is a log: deletions are appended too, as tombstone records
+ *
+ *      -<id>
+ *      <empty line>
+ *
+ * and once more than half of the file is dead weight it is rewritten with
+ * the live messages only, bumping the generation in the header.
+ * Every process keeps the whole board in memory, split in two: a compact
+ * array of MsgHeaders, which is all that scans and ownership checks touch,
+ * and a heap holding the variable-length text. Changes are picked up by
+ * parsing just the tail of the file, while a new generation tells the other
+ * processes to reload.
+ * Concurrent processes are kept apart with fcntl() record locks
+ *
+ * Boards larger than memory can leave the heap out: given a cache budget,
+ * headers also tell where their text is in the file, and the text is read
+ * from there on demand through a page cache that never grows past the
+ * budget. Memory then grows with the number of messages, by a header each,
+ * but not with their text. Reads keep the lock until they are done with the
+ * file, and rewrites squeeze the live records towards the start of the file
+ * in place, without ever holding all of them
+ *
+ * Reloading does not need to parse the whole file: msg_snapshot() dumps the
+ * in-memory board of a generation, as it is, to <file>.snap, along with how
+ * much of the file it covers. Loading that takes a couple of sequential
+ * reads, after which only the tail of the log is parsed. Snapshots are a
+ * cache, in the byte order and layout of the machine writing them: any that
+ * does not match is ignored
+ *
+ * Being a log, the file is also what replication ships: a replica gets the
+ * bytes appended to each shard of its primary and appends them to its own,
+ * where they are parsed like any other change. A rewrite on the primary
+ * makes the replica start its shard over
+ *
+ * The database can be split in shards, each one a file as above with its own
+ * lock and board. Shard <k> of <n> hands out the IDs congruent to <k> + 1
+ * modulo <n>, so an ID tells where its message is; messages go to a shard
+ * chosen by the hash of their sender, and reads merge the shards in ID order.
+ * Writers to different shards never wait for each other, and a deletion only
+ * rewrites its own shard
+ *
+ * Messages can also be kept apart in named channels, each one a database of
+ * its own with the same number of shards: channel <name> lives in
+ * <file>-<name>, and the default channel, whose name is empty, in <file>.
+ * Channels share nothing but the process, so that writers to one never wait
+ * for the locks of another, and every operation only touches the boards of
+ * the channel selected at the moment. The names of the channels created so
+ * far are listed in <file>.channels, for expiry and snapshots to get to all
+ * of them. Replication only ships the default channel
+ *
+ * Stores and deletions can also come in batches, which take the lock of
+ * each shard, append to its file and update its header just once for the
+ * whole batch: single stores and deletions are batches of one
+ *
+ * Old messages are dropped by msg_expire(), according to their own expiry
+ * time and to a retention policy, a batch at a time so that the lock is
+ * never held for long
  */
 
 #include "msg_storage.h"
+#include "bel_arena.h"
+#include "bel_pagecache.h"
+#include "bel_placement.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define NO_OF_MSG_FIELDS 3
 #define MSG_PATHMAX 4096
 
-static char db_filepath[MSG_PATHMAX];
-static FILE* db;
+#define DB_MAGIC "BEL2 "
+#define DB_MAGIC_LEN 5
+#define DB_HEADER_FORMAT "BEL2 %020lu %020lu %020lu\n"
+#define DB_HEADER_LEN (DB_MAGIC_LEN + 3 * (MSGID_MAXCHARS + 1))
 
+/* Longest textual form of a record's "<id> <creation time> <expiry>" line  */
+#define RECORD_IDLINE_MAXLEN (3 * (MSGID_MAXCHARS + 1))
 
+/* The log is parsed, and rewritten in place, this many bytes at a time  */
+#define LOG_CHUNK (1024 * 1024)
+
+/* Longest tombstone record, "-<id>" and two newlines  */
+#define TOMBSTONE_MAXLEN (MSGID_MAXCHARS + 3)
+
+/* Marks the headers of deleted messages, until they are swept away  */
+#define DEAD_TEXT_OFF ((size_t) -1)
+
+#define CHANNELS_SUFFIX ".channels"
+
+/* Longest list of channel names, one per line  */
+#define CHANNELS_MAXLEN (MSG_MAX_CHANNELS * (MSG_CHANNEL_MAXLEN + 1))
+
+#define SNAPSHOT_MAGIC "BELSNAP1"
+#define SNAPSHOT_SUFFIX ".snap"
+
+/*
+ * A new snapshot is taken once the log has grown past the last one by this
+ * many bytes, or by this fraction of its size if more
+ */
+#define SNAPSHOT_MIN_TAIL 65536
+#define SNAPSHOT_TAIL_RATIO 16
+
+
+/* The "hot" part of a message: everything but the actual text  */
+typedef struct {
+    unsigned long id;
+    unsigned long from_hash;
+    time_t ctime;
+    time_t expires;     /* 0 for never  */
+    size_t text_off;    /* from, subject and body, in a row in the heap  */
+    off_t text_pos;     /* same, in the file, separated by newlines  */
+    unsigned int from_len;
+    unsigned int subject_len;
+    unsigned int body_len;
+} MsgHeader;
+
+typedef struct {
+    MsgHeader *headers;
+    size_t count;
+    size_t capacity;
+
+    char *heap;         /* '\0'-terminated fields of all messages  */
+    size_t heap_len;
+    size_t heap_cap;
+    size_t heap_dead;   /* bytes belonging to deleted messages  */
+    size_t expiring;    /* messages with an expiry time  */
+    size_t log_dead;    /* bytes of the file made of deleted records  */
+
+    /* the database header, as of the last refresh  */
+    unsigned long gen;
+    unsigned long next_id;
+    unsigned long version;
+
+    off_t loaded_size;  /* how much of the file is reflected in memory  */
+    int loaded;
+} Board;
+static const Board empty_board;
+
+/* One database file, with its own lock and its own in-memory board  */
+typedef struct {
+    char path[MSG_PATHMAX];
+    int fd;
+    Board board;
+
+    /* the last snapshot known to this process, if size is not 0  */
+    unsigned long snap_gen;
+    off_t snap_size;
+} Shard;
+
+/* A database of its own, split in as many shards as the default one  */
+typedef struct {
+    char name[MSG_CHANNEL_MAXLEN + 1];
+    Shard *shards;
+} Channel;
+
+/* Start of a snapshot file, followed by the headers and then the heap  */
+typedef struct {
+    char magic[8];
+    unsigned long one;          /* tells the byte order  */
+    unsigned long header_size;  /* tells the layout of MsgHeader  */
+    unsigned long gen;
+    unsigned long loaded_size;
+    unsigned long log_dead;
+    unsigned long count;
+    unsigned long heap_len;
+    unsigned long expiring;
+} SnapshotHeader;
+
+/* A slice of a text buffer, not '\0'-terminated  */
+typedef struct {
+    const char *ptr;
+    size_t len;
+} Field;
+
+
+/* Channels opened by this process, the default one first  */
+static Channel channels[MSG_MAX_CHANNELS];
+static int no_of_channels;
+static char db_path[MSG_PATHMAX - MSG_CHANNEL_MAXLEN - 32];
+
+/* Shards of the channel selected at the moment, and how many of them  */
+static Shard *shards;
+static int no_of_shards;
+static int current_channel;
+
+/* Scratch memory for building and parsing chunks of the database file  */
+static Arena scratch;
+
+/* Text of messages, when it is left on disk instead of in the heap  */
+static size_t cache_budget;
+static int text_on_disk;
+static PageCache cache;
+
+/* Chunks of the log being parsed, reused from one to the next  */
+static char *chunk_buf;
+static size_t chunk_cap;
+
+
+static void open_channel_or_die(Channel*, const char* const);
+static void open_shard_or_die(Shard*, const int);
 static void close_db(void);
-static void truncate_db(void);
+static void convert_legacy_db_or_die(Shard*, const off_t);
+static void lock_fd_or_die(const int, const short);
+static void lock_db_or_die(Shard*, const short);
+static void unlock_db_or_die(Shard*);
+static void refresh_all_or_die(void);
+
+static int is_valid_channel(const char* const);
+static int register_channel(const char* const);
+static void open_registered_channels(void);
+static int load_registry(const int, char (*)[MSG_CHANNEL_MAXLEN + 1]);
+static size_t expire_shards(Shard*, const RetentionPolicy* const,
+        const time_t, const int);
+static void snapshot_shards(Shard*);
 
-static Message* retrieve_one_or_die(void);
+static void refresh_board_or_die(Shard*);
+static size_t whole_records_len(const char* const, const size_t);
+static int read_db_header(Shard*, unsigned long*, unsigned long*,
+        unsigned long*);
+static void write_db_header_or_die(Shard*);
+static void rewrite_db_or_die(Shard*, const char* const);
+static off_t dump_board_or_die(Shard*);
+static off_t squeeze_log_or_die(Shard*, const char* const);
+static char* read_db_or_die(Shard*, const off_t, const size_t);
+static char* read_chunk_or_die(Shard*, const off_t, const size_t);
+static void write_db_or_die(Shard*, const char* const, const size_t,
+        const off_t);
+static off_t db_size_or_die(Shard*);
+static int read_full(const int, void*, const size_t, const off_t);
+static int write_full(const int, const void*, const size_t);
 
-static FILE* fopen_or_die(const char* const file_path, const char* const mode);
+static int load_snapshot(Shard*, const unsigned long);
+static int is_usable_snapshot(Shard*, const SnapshotHeader* const,
+        const unsigned long, const off_t);
+static void write_snapshot(Shard*);
+static void snapshot_path(const Shard* const, char*);
+
+static long parse_records(Board*, const char*, const size_t, const off_t,
+        const int);
+static const char* parse_tombstone(Board*, const char*, const char* const,
+        size_t*);
+static int parse_ulong(const Field, unsigned long*);
+static size_t record_tostring(const Message* const, char*);
+static size_t idline_tostring(const unsigned long, const time_t, const time_t,
+        char*);
+static size_t record_size(const MsgHeader*);
+static size_t text_size(const MsgHeader*);
+static size_t ulong_digits(unsigned long);
+
+static int write_shard(const MsgWrite* const);
+static size_t store_on_board(Board*, Message*, char*, const off_t);
+static int mark_deleted_by(Shard*, const Message* const);
+
+static void append_to_board(Board*, const unsigned long, const time_t,
+        const time_t, const off_t, const Field, const Field, const Field);
+static void mark_dead(Board*, const size_t);
+static void sweep_dead(Board*);
+static void log_deletions_or_die(Shard*);
+static size_t expire_from_board(Board*, const RetentionPolicy* const,
+        const time_t, const int);
+static void compact_heap(Board*);
+static long find_by_id(const Board*, const unsigned long);
+static size_t lower_bound(const Board*, const unsigned long);
+static void skip_merged(const long, size_t*);
+static const MsgHeader* next_merged(size_t*, Shard**);
+static void header_tomessage(Shard*, const MsgHeader*, Message*);
+static const char* load_text(Shard*, const MsgHeader*, const size_t);
+static unsigned long hash_name(const char*, const size_t);
+static void* realloc_or_die(void*, const size_t);
 
 
 void
 msg_trace(const Message msg)
 {
-    printf("[TRACE] from = '%s', subject = '%s', body = '%s'\n",
-            msg.from, msg.subject, msg.body);    
+    printf("[TRACE] id = '%lu', from = '%s', subject = '%s', body = '%s'\n",
+            msg.id, msg.from, msg.subject, msg.body);
 }
 
 
-void
+size_t
+msg_tostring_size(const Message* msg, const int array_size)
+{
+    int i;
+    size_t size = 1;    /* the terminator  */
+
+    for (i = 0; i < array_size; ++msg, ++i) {
+        size += MSGID_MAXCHARS + msg->from_len + msg->subject_len
+                + msg->body_len + 7;    /* "[] " and four newlines  */
+    }
+    return size;
+}
+
+
+size_t
 msg_arraytostring(const Message* msg, const int array_size, char *buf)
 {
-    int i, buf_idx = 0;
-    char msgbuf[MSG_TOSTRING_SIZE];
+    int i;
+    size_t buf_idx = 0;
 
     printf("[TRACE] msg_arraytostring - array_size = '%d'\n", array_size);
     for (i = 0; i < array_size; ++msg, ++i) {
-        memset(msgbuf, 0, MSG_TOSTRING_SIZE);
-        msg_trace(*msg);
-        sprintf(msgbuf, "%s\n%s\n%s\n\n", msg->from, msg->subject, msg->body);
-        buf_idx += sprintf(buf + buf_idx, "%s", msgbuf);
-        printf("[TRACE] buf = '%s', buf_idx = '%d'\n", buf, buf_idx);
+        buf_idx += sprintf(buf + buf_idx, "[%lu] ", msg->id);
+        memcpy(buf + buf_idx, msg->from, msg->from_len);
+        buf_idx += msg->from_len;
+        buf[buf_idx++] = '\n';
+        memcpy(buf + buf_idx, msg->subject, msg->subject_len);
+        buf_idx += msg->subject_len;
+        buf[buf_idx++] = '\n';
+        memcpy(buf + buf_idx, msg->body, msg->body_len);
+        buf_idx += msg->body_len;
+        buf[buf_idx++] = '\n';
+        buf[buf_idx++] = '\n';
     }
+    buf[buf_idx] = '\0';
+    return buf_idx;
+}
+
+
+void
+msg_set_cache_budget(const size_t bytes)
+{
+    cache_budget = bytes;
 }
 
 
 void
 msg_init_db_or_die(const char* const file_path)
 {
-    strcpy(db_filepath, file_path);
-    db = fopen_or_die(db_filepath, "ab+");
+    msg_init_sharded_db_or_die(file_path, 1);
+}
+
+void
+msg_init_sharded_db_or_die(const char* const file_path, const int count)
+{
+    int i;
+    unsigned long messages = 0;
+
+    if (count < 1 || count > MSG_MAX_SHARDS
+            || strlen(file_path) >= sizeof(db_path)) {
+        fprintf(stderr, "[ERROR] invalid database '%s', '%d' shards\n",
+                file_path, count);
+        exit(EXIT_FAILURE);
+    }
+    bel_arena_init_or_die(&scratch, ARENA_BLOCK_SIZE);
+    if (cache_budget > 0) {
+        bel_pagecache_init_or_die(&cache, cache_budget);
+        text_on_disk = 1;
+    }
+    strcpy(db_path, file_path);
+    no_of_shards = count;
+    open_channel_or_die(channels, "");
+    no_of_channels = 1;
+    shards = channels[0].shards;
+    for (i = 0; i < count; ++i) messages += shards[i].board.count;
     atexit(close_db);
+    printf("[DEBUG] loaded %lu messages from '%s', in '%d' shards\n",
+            messages, file_path, count);
+    if (text_on_disk) {
+        printf("[DEBUG] message text left on disk, '%lu' bytes of cache\n",
+                (unsigned long) cache_budget);
+    }
+}
+
+/*
+ * Opens the shards of the channel with the given name, creating their files
+ * if they do not exist yet
+ */
+static void
+open_channel_or_die(Channel *ch, const char* const name)
+{
+    int i;
+    char base[MSG_PATHMAX - 16];   /* room left for ".<shard>"  */
+    char extra_path[MSG_PATHMAX];
+
+    strcpy(ch->name, name);
+    if (name[0] == '\0') {
+        strcpy(base, db_path);
+    } else {
+        sprintf(base, "%s-%s", db_path, name);
+    }
+    ch->shards = realloc_or_die(NULL, no_of_shards * sizeof(Shard));
+    for (i = 0; i < no_of_shards; ++i) {
+        if (no_of_shards == 1) {
+            strcpy(ch->shards[i].path, base);
+        } else {
+            sprintf(ch->shards[i].path, "%s.%d", base, i);
+        }
+        open_shard_or_die(ch->shards + i, i);
+    }
+    if (no_of_shards > 1) {     /* shards beyond the last would go unnoticed */
+        sprintf(extra_path, "%s.%d", base, no_of_shards);
+        if (access(extra_path, F_OK) == 0) {
+            fprintf(stderr, "[ERROR] '%s' exists: the database has more"
+                    " than '%d' shards\n", extra_path, no_of_shards);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+ * Opens the file of the shard with the given index, creating it if it does
+ * not exist yet, and loads its content in memory
+ */
+static void
+open_shard_or_die(Shard *sh, const int index)
+{
+    off_t size;
+    unsigned long gen, next_id, version;
+    char snap_path[MSG_PATHMAX];
+
+    sh->fd = open(sh->path, O_RDWR | O_CREAT, 0644);
+    if (sh->fd == -1) {
+        perror("[ERROR] open()");
+        exit(EXIT_FAILURE);
+    }
+    sh->board = empty_board;
+    sh->snap_size = 0;
+    snapshot_path(sh, snap_path);
+
+    lock_db_or_die(sh, F_WRLCK);
+    size = db_size_or_die(sh);
+    if (size == 0) {    /* any snapshot left around is not about this file  */
+        unlink(snap_path);
+        sh->board.next_id = index + 1;
+        write_db_header_or_die(sh);
+    } else if (!read_db_header(sh, &gen, &next_id, &version)) {
+        unlink(snap_path);
+        sh->board.next_id = index + 1;
+        convert_legacy_db_or_die(sh, size);
+    }
+    refresh_board_or_die(sh);
+    unlock_db_or_die(sh);
+    bel_arena_reset(&scratch);
+    if ((sh->board.next_id - (index + 1)) % no_of_shards != 0) {
+        fprintf(stderr, "[ERROR] '%s' was not created as shard %d of %d\n",
+                sh->path, index, no_of_shards);
+        exit(EXIT_FAILURE);
+    }
 }
 
 static void
 close_db(void)
 {
-    int fclose_res;
-    
-    fclose_res = fclose(db);
-    if (fclose_res == EOF) {
-        perror("[ERROR] fclose()");
+    int i, j;
+    Shard *sh;
+
+    for (i = 0; i < no_of_channels; ++i) {
+        for (j = 0; j < no_of_shards; ++j) {
+            sh = channels[i].shards + j;
+            free(sh->board.headers);
+            free(sh->board.heap);
+            if (close(sh->fd) == -1) {
+                perror("[ERROR] close()");
+                exit(EXIT_FAILURE);
+            }
+        }
+        free(channels[i].shards);
+    }
+    bel_arena_destroy(&scratch);
+    free(chunk_buf);
+    if (text_on_disk) bel_pagecache_destroy(&cache);
+}
+
+/*
+ * Databases written before the introduction of the header and of message
+ * IDs are made of bare "from, subject, body" records: give them IDs in order
+ * and rewrite them in the current format
+ */
+static void
+convert_legacy_db_or_die(Shard *sh, const off_t size)
+{
+    char *buf;
+
+    printf("[INFO] converting legacy database '%s'\n", sh->path);
+    buf = read_db_or_die(sh, 0, size);
+    if (parse_records(&sh->board, buf, size, 0, 1) != size) {
+        fprintf(stderr, "[ERROR] database is corrupted: exiting\n");
+        exit(EXIT_FAILURE);
+    }
+    rewrite_db_or_die(sh, buf);     /* records grow: not in place  */
+}
+
+/* Waits until a lock of the given type (F_RDLCK or F_WRLCK) is acquired  */
+static void
+lock_db_or_die(Shard *sh, const short type)
+{
+    lock_fd_or_die(sh->fd, type);
+}
+
+/* Same as lock_db_or_die(), on the whole file open on <fd>  */
+static void
+lock_fd_or_die(const int fd, const short type)
+{
+    struct flock fl;
+    int fcntl_res;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;     /* l_start = l_len = 0: whole file  */
+    do {
+        fcntl_res = fcntl(fd, F_SETLKW, &fl);
+    } while (fcntl_res == -1 && errno == EINTR);
+    if (fcntl_res == -1) {
+        perror("[ERROR] fcntl()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void
+unlock_db_or_die(Shard *sh)
+{
+    lock_db_or_die(sh, F_UNLCK);
+}
+
+/* Brings the in-memory boards of all the shards up to date  */
+static void
+refresh_all_or_die(void)
+{
+    int i;
+
+    for (i = 0; i < no_of_shards; ++i) {
+        lock_db_or_die(shards + i, F_RDLCK);
+        refresh_board_or_die(shards + i);
+        unlock_db_or_die(shards + i);
+    }
+    bel_arena_reset(&scratch);
+}
+
+
+int
+msg_select_channel(const char* const name)
+{
+    int i;
+
+    for (i = 0; i < no_of_channels; ++i) {
+        if (strcmp(channels[i].name, name) == 0) break;
+    }
+    if (i == no_of_channels) {
+        if (!is_valid_channel(name) || no_of_channels == MSG_MAX_CHANNELS
+                || !register_channel(name)) {
+            return 0;   /* false  */
+        }
+        open_channel_or_die(channels + i, name);
+        ++no_of_channels;
+        printf("[DEBUG] opened channel '%s'\n", name);
+    }
+    current_channel = i;
+    shards = channels[i].shards;
+    return 1;   /* true  */
+}
+
+
+const char*
+msg_channel(void)
+{
+    return channels[current_channel].name;
+}
+
+/* Returns 1 (true) if <name> is made of letters, digits, '-' and '_' only  */
+static int
+is_valid_channel(const char* const name)
+{
+    size_t i, len;
+
+    len = strlen(name);
+    if (len == 0 || len > MSG_CHANNEL_MAXLEN) return 0;
+    for (i = 0; i < len; ++i) {
+        if (!isalnum((unsigned char) name[i]) && name[i] != '-'
+                && name[i] != '_') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Adds <name> to the list of channels in <file>.channels, unless it is there
+ * already.
+ * Returns 0 (false) if it could not be added, the list being full
+ */
+static int
+register_channel(const char* const name)
+{
+    int fd, i, count, found = 0;
+    char path[MSG_PATHMAX], line[MSG_CHANNEL_MAXLEN + 2];
+    char names[MSG_MAX_CHANNELS][MSG_CHANNEL_MAXLEN + 1];
+
+    sprintf(path, "%s%s", db_path, CHANNELS_SUFFIX);
+    fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd == -1) {
+        perror("[ERROR] open()");
+        return 0;
+    }
+    lock_fd_or_die(fd, F_WRLCK);
+    count = load_registry(fd, names);
+    for (i = 0; i < count && !found; ++i) found = strcmp(names[i], name) == 0;
+    if (!found && count < MSG_MAX_CHANNELS - 1) {   /* but the default one */
+        sprintf(line, "%s\n", name);
+        found = write_full(fd, line, strlen(line));
+        if (!found) perror("[ERROR] write()");
+    } else if (!found) {
+        fprintf(stderr, "[WARN] too many channels: '%s' not created\n",
+                name);
+    }
+    if (close(fd) == -1) {  /* releases the lock  */
+        perror("[ERROR] close()");
         exit(EXIT_FAILURE);
-    }    
+    }
+    return found;
 }
 
+/*
+ * Opens the channels in <file>.channels that this process did not open yet,
+ * without selecting any of them
+ */
 static void
-truncate_db(void)
+open_registered_channels(void)
 {
-    close_db();
-    db = fopen_or_die(db_filepath, "wb");
-    close_db();
-    db = fopen_or_die(db_filepath, "ab+");
+    int fd, i, j, count;
+    char path[MSG_PATHMAX];
+    char names[MSG_MAX_CHANNELS][MSG_CHANNEL_MAXLEN + 1];
+
+    sprintf(path, "%s%s", db_path, CHANNELS_SUFFIX);
+    fd = open(path, O_RDONLY);
+    if (fd == -1) return;   /* no channels created yet  */
+    lock_fd_or_die(fd, F_RDLCK);
+    count = load_registry(fd, names);
+    if (close(fd) == -1) {
+        perror("[ERROR] close()");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < count && no_of_channels < MSG_MAX_CHANNELS; ++i) {
+        for (j = 0; j < no_of_channels; ++j) {
+            if (strcmp(channels[j].name, names[i]) == 0) break;
+        }
+        if (j < no_of_channels) continue;
+        open_channel_or_die(channels + no_of_channels, names[i]);
+        ++no_of_channels;
+    }
+}
+
+/*
+ * Reads the list of channels open on <fd> into <names>, skipping whatever is
+ * not a valid name. <names> has room for MSG_MAX_CHANNELS of them.
+ * Returns the number of names read
+ */
+static int
+load_registry(const int fd, char (*names)[MSG_CHANNEL_MAXLEN + 1])
+{
+    int count = 0;
+    ssize_t len;
+    char buf[CHANNELS_MAXLEN + 1], *line, *end;
+
+    do {
+        len = pread(fd, buf, CHANNELS_MAXLEN, 0);
+    } while (len == -1 && errno == EINTR);
+    if (len == -1) {
+        perror("[ERROR] pread()");
+        return 0;
+    }
+    buf[len] = '\0';
+    for (line = buf; count < MSG_MAX_CHANNELS && *line != '\0'; line = end) {
+        end = strchr(line, '\n');
+        if (end == NULL) break;     /* not a whole line  */
+        *end++ = '\0';
+        if (is_valid_channel(line)) strcpy(names[count++], line);
+    }
+    return count;
 }
 
 
 void
 msg_store(const Message msg)
 {
-    fseek(db, 0L, SEEK_END);
-    fprintf(db, "%s\n%s\n%s\n\n", msg.from, msg.subject, msg.body);
+    MsgWrite write = empty_msg_write;
+
+    write.kind = MSG_WRITE_STORE;
+    write.msg = msg;
+    msg_write_batch(&write, 1);
 }
 
 
 int
 msg_retrieve_some(Message* ret, const int count)
 {
-    int i;
-    Message *msg = NULL;
-    
-    fseek(db, 0L, SEEK_SET);
-    for (i = 0; i < count; ++i) {
-        msg = retrieve_one_or_die();
-        if (msg == NULL) break;
-        ret[i] = *msg;
-        free(msg);
-    }
-    return i;
-}
-
-static Message*
-retrieve_one_or_die(void)
-{
-    int fscanf_res = 0;
-    Message *msgptr;
-    
-    msgptr = calloc(1, sizeof(Message));
-    if (msgptr == NULL) return NULL;
-    fscanf_res = fscanf(db, "%[^\n]\n%[^\n]\n%[^\n]\n\n",
-            msgptr->from, msgptr->subject, msgptr->body);
-    printf("[TRACE] fscanf_res = '%d'\n", fscanf_res);
-    msg_trace(*msgptr);
-    if (fscanf_res == EOF) {
-        printf("[TRACE] reached End Of File\n");
-        return NULL;
-    } else if (fscanf_res != NO_OF_MSG_FIELDS) {
-        fprintf(stderr, "[ERROR] database is corrupted: exiting\n");
-        exit(EXIT_FAILURE);
+    return msg_retrieve_range(ret, 0, count);
+}
+
+int
+msg_retrieve_range(Message* ret, const long first, const int count)
+{
+    int i, n = 0;
+    size_t pos[MSG_MAX_SHARDS];
+    Shard *sh;
+    const MsgHeader *hdr;
+
+    /* text left on disk is read below, so the files must not change  */
+    for (i = 0; i < no_of_shards; ++i) {
+        lock_db_or_die(shards + i, F_RDLCK);
+        refresh_board_or_die(shards + i);
     }
-    return msgptr;
+    bel_arena_reset(&scratch);
+    if (first >= 0 && no_of_shards == 1) {  /* nothing to merge  */
+        sh = shards;
+        for (; n < count && (size_t) (first + n) < sh->board.count; ++n) {
+            header_tomessage(sh, sh->board.headers + first + n, ret + n);
+        }
+    } else if (first >= 0) {
+        skip_merged(first, pos);
+        for (; n < count; ++n) {
+            hdr = next_merged(pos, &sh);
+            if (hdr == NULL) break;
+            header_tomessage(sh, hdr, ret + n);
+        }
+    }
+    for (i = 0; i < no_of_shards; ++i) unlock_db_or_die(shards + i);
+    return n;
+}
+
+
+unsigned long
+msg_version(void)
+{
+    int i;
+    unsigned long version = 0;
+
+    /* each version only grows, so their sum changes whenever one does  */
+    refresh_all_or_die();
+    for (i = 0; i < no_of_shards; ++i) version += shards[i].board.version;
+    return version;
 }
 
 
 int
-msg_delete(const char username[FROM_MAXLEN], const int msgid)
-{
-    int i, msgcount;
-    Message messages[MSG_MAX_STORAGE];
-    char listbuf[MSG_TOSTRING_SIZE * MSG_MAX_STORAGE] = "";
-    
-    printf("[TRACE] msg_delete - msgid = '%d'\n", msgid);
-    msgcount = msg_retrieve_some(messages, MSG_MAX_STORAGE);
-    if (strcmp(username, messages[msgid - 1].from) != 0 /* not authorized  */
-            || msgid < 1 || msgid > msgcount) {         /* out of range  */
-        return 0;   /* false  */
-    }
-    for(i = msgid - 1; i < msgcount - 1; ++i) messages[i] = messages[i + 1];
-    msg_arraytostring(messages, msgcount - 1, listbuf);
-    truncate_db();
-    fseek(db, 0L, SEEK_SET);
-    fprintf(db, "%s", listbuf);
+msg_delete(const char* const username, const unsigned long msgid)
+{
+    MsgWrite write = empty_msg_write;
+
+    printf("[TRACE] msg_delete - msgid = '%lu'\n", msgid);
+    write.kind = MSG_WRITE_DELETE;
+    write.msg.id = msgid;
+    write.msg.from = username;
+    write.msg.from_len = strlen(username);
+    msg_write_batch(&write, 1);
+    return write.done;
+}
+
+
+void
+msg_write_batch(MsgWrite *writes, const int count)
+{
+    int i, k, in_shard, deleted;
+    size_t len, max_len;
+    char *buf;
+    Shard *sh;
+
+    for (i = 0; i < count; ++i) writes[i].done = 0;
+    for (k = 0; k < no_of_shards; ++k) {
+        for (i = 0, in_shard = 0, max_len = 0; i < count; ++i) {
+            if (write_shard(writes + i) != k) continue;
+            ++in_shard;
+            if (writes[i].kind == MSG_WRITE_STORE) {
+                max_len += RECORD_IDLINE_MAXLEN + writes[i].msg.from_len
+                        + writes[i].msg.subject_len + writes[i].msg.body_len
+                        + NO_OF_MSG_FIELDS + 2;
+            }
+        }
+        if (in_shard == 0) continue;
+
+        sh = shards + k;
+        lock_db_or_die(sh, F_WRLCK);
+        refresh_board_or_die(sh);
+        buf = bel_arena_alloc_or_die(&scratch, max_len + 1);
+        for (i = 0, len = 0, deleted = 0; i < count; ++i) {
+            if (write_shard(writes + i) != k) continue;
+            if (writes[i].kind == MSG_WRITE_STORE) {
+                len += store_on_board(&sh->board, &writes[i].msg, buf + len,
+                        sh->board.loaded_size + len);
+                writes[i].done = 1;
+            } else {
+                writes[i].done = mark_deleted_by(sh, &writes[i].msg);
+                deleted += writes[i].done;
+            }
+        }
+        if (len > 0) {
+            write_db_or_die(sh, buf, len, sh->board.loaded_size);
+            sh->board.loaded_size += len;
+        }
+        if (deleted > 0) {
+            log_deletions_or_die(sh);   /* writes the header too  */
+        } else if (len > 0) {
+            write_db_header_or_die(sh);
+        }
+        unlock_db_or_die(sh);
+        bel_arena_reset(&scratch);
+    }
+}
+
+
+void
+msg_next_ids(unsigned long next_ids[MSG_MAX_SHARDS])
+{
+    int k;
+    Shard *sh;
+
+    for (k = 0; k < no_of_shards; ++k) {
+        sh = shards + k;
+        lock_db_or_die(sh, F_RDLCK);
+        refresh_board_or_die(sh);
+        unlock_db_or_die(sh);
+        next_ids[k] = sh->board.next_id;
+    }
+    bel_arena_reset(&scratch);
+}
+
+
+void
+msg_write_batch_applied(MsgWrite *writes, const int count,
+        const unsigned long* const next_ids)
+{
+    int i, k;
+    unsigned long next_id[MSG_MAX_SHARDS], id;
+
+    msg_next_ids(next_id);
+    for (k = 0; k < no_of_shards; ++k) {
+        if (next_id[k] == next_ids[k]) continue;    /* nothing made it  */
+        for (i = 0, id = next_ids[k]; i < count; ++i) {
+            if (writes[i].kind != MSG_WRITE_STORE
+                    || write_shard(writes + i) != k) {
+                continue;
+            }
+            writes[i].msg.id = id;
+            writes[i].done = 1;
+            id += no_of_shards;
+        }
+    }
+}
+
+/* Returns the shard <write> belongs to, or -1 if none  */
+static int
+write_shard(const MsgWrite* const write)
+{
+    const Message *msg = &write->msg;
+
+    if (write->kind == MSG_WRITE_STORE) {
+        return hash_name(msg->from, msg->from_len) % no_of_shards;
+    }
+    return msg->id == 0 ? -1 : (int) ((msg->id - 1) % no_of_shards);
+}
+
+/*
+ * Appends <msg> to <board>, assigning it the next ID and the current time,
+ * and writes its record into <buf>, which goes to offset <pos> of the file.
+ * To be called while holding a write lock.
+ * Returns the length of the record
+ */
+static size_t
+store_on_board(Board *board, Message *msg, char *buf, const off_t pos)
+{
+    size_t len, text_len;
+    Field from, subject, body;
+
+    from.ptr = msg->from;         from.len = msg->from_len;
+    subject.ptr = msg->subject;   subject.len = msg->subject_len;
+    body.ptr = msg->body;         body.len = msg->body_len;
+
+    msg->id = board->next_id;
+    msg->ctime = time(NULL);
+    len = record_tostring(msg, buf);
+    text_len = from.len + subject.len + body.len + NO_OF_MSG_FIELDS;
+    append_to_board(board, msg->id, msg->ctime, msg->expires,
+            pos + len - text_len - 1, from, subject, body);
+    board->next_id += no_of_shards;
+    ++board->version;
+    return len;
+}
+
+/*
+ * Marks the message with the ID of <msg> as deleted, if it is from the user
+ * in <msg>. To be called while holding a write lock.
+ * Returns 1 (true) on success and 0 (false) on failure
+ */
+static int
+mark_deleted_by(Shard *sh, const Message* const msg)
+{
+    long idx;
+    const MsgHeader *hdr;
+    Board *board = &sh->board;
+
+    idx = find_by_id(board, msg->id);
+    if (idx == -1) return 0;    /* false: no such message  */
+    hdr = board->headers + idx;
+    if (hdr->text_off == DEAD_TEXT_OFF) return 0;   /* deleted already  */
+    if (hdr->from_hash != hash_name(msg->from, msg->from_len)
+            || hdr->from_len != msg->from_len
+            || memcmp(load_text(sh, hdr, hdr->from_len), msg->from,
+                msg->from_len) != 0) {
+        return 0;   /* false: not authorized  */
+    }
+    mark_dead(board, idx);
     return 1;   /* true  */
 }
 
 
-static FILE*
-fopen_or_die(const char* const file_path, const char* const mode)
+int
+msg_expire(const RetentionPolicy* const policy, const int batch)
+{
+    int i;
+    size_t total = 0;
+    time_t now;
+
+    now = time(NULL);
+    open_registered_channels();
+    for (i = 0; i < no_of_channels; ++i) {
+        total += expire_shards(channels[i].shards, policy, now, batch);
+    }
+    if (total > 0) printf("[DEBUG] expired '%lu' messages\n",
+            (unsigned long) total);
+    return total;
+}
+
+/* Does the job of msg_expire() for the shards of a single channel  */
+static size_t
+expire_shards(Shard *shs, const RetentionPolicy* const policy,
+        const time_t now, const int batch)
+{
+    int i;
+    size_t removed, total = 0;
+    Shard *sh;
+
+    for (i = 0; i < no_of_shards; ++i) {
+        sh = shs + i;
+        lock_db_or_die(sh, F_WRLCK);
+        refresh_board_or_die(sh);
+        removed = expire_from_board(&sh->board, policy, now, batch);
+        if (removed > 0) log_deletions_or_die(sh);
+        unlock_db_or_die(sh);
+        bel_arena_reset(&scratch);
+        total += removed;
+    }
+    return total;
+}
+
+
+void
+msg_snapshot(void)
+{
+    int i;
+
+    open_registered_channels();
+    for (i = 0; i < no_of_channels; ++i) snapshot_shards(channels[i].shards);
+}
+
+/* Does the job of msg_snapshot() for the shards of a single channel  */
+static void
+snapshot_shards(Shard *shs)
+{
+    int i;
+    off_t tail, min_tail;
+    Shard *sh;
+
+    for (i = 0; i < no_of_shards; ++i) {
+        sh = shs + i;
+        lock_db_or_die(sh, F_RDLCK);
+        refresh_board_or_die(sh);
+        unlock_db_or_die(sh);
+        bel_arena_reset(&scratch);
+
+        /* no lock needed from now on: the file only grows within a gen  */
+        tail = sh->board.loaded_size - sh->snap_size;
+        min_tail = sh->board.loaded_size / SNAPSHOT_TAIL_RATIO;
+        if (min_tail < SNAPSHOT_MIN_TAIL) min_tail = SNAPSHOT_MIN_TAIL;
+        if (sh->snap_size == 0 || sh->snap_gen != sh->board.gen
+                || tail >= min_tail) {
+            write_snapshot(sh);
+        }
+    }
+}
+
+
+
+int
+msg_shard_count(void)
+{
+    return no_of_shards;
+}
+
+
+int
+msg_log_read(const int shard, MsgLogPosition *pos, MsgLogChange *change)
 {
-    FILE* fp;
-    
-    fp = fopen(file_path, mode);
-    if (fp == NULL) {
-        perror("[ERROR] fopen()");
+    off_t size;
+    unsigned long gen;
+    Shard *sh = channels[0].shards + shard;     /* the default channel  */
+
+    bel_arena_reset(&scratch);  /* the last change is not needed anymore  */
+    *change = empty_log_change;
+    change->shard = shard;
+    lock_db_or_die(sh, F_RDLCK);
+    if (!read_db_header(sh, &gen, &change->next_id, &change->version)) {
+        fprintf(stderr, "[ERROR] database header is corrupted: exiting\n");
+        exit(EXIT_FAILURE);
+    }
+    size = db_size_or_die(sh);
+    if (pos->offset == 0 || pos->gen != gen
+            || pos->offset > (unsigned long) size) {
+        change->reset = 1;
+        pos->gen = gen;
+        pos->offset = DB_HEADER_LEN;
+    }
+    change->len = size - pos->offset;
+    if (change->len > MSG_LOG_CHANGE_MAXLEN) {
+        change->data = read_db_or_die(sh, pos->offset, MSG_LOG_CHANGE_MAXLEN);
+        change->len = whole_records_len(change->data, MSG_LOG_CHANGE_MAXLEN);
+        if (change->len == 0) {     /* no record is that long  */
+            fprintf(stderr, "[ERROR] database is corrupted: exiting\n");
+            exit(EXIT_FAILURE);
+        }
+    } else if (change->len > 0) {
+        change->data = read_db_or_die(sh, pos->offset, change->len);
+    }
+    unlock_db_or_die(sh);
+    pos->offset += change->len;
+    return change->reset || change->len > 0;
+}
+
+/*
+ * Returns the length of the whole records (and tombstones) at the start of
+ * buf[0..len), up to the first one cut short by the end of the buffer
+ */
+static size_t
+whole_records_len(const char* const buf, const size_t len)
+{
+    const char *p = buf, *whole = buf, *newline;
+    const char* const end = buf + len;
+    int lines = 0, nlines = 0;
+
+    while ((newline = memchr(p, '\n', end - p)) != NULL) {
+        if (lines == 0) nlines = *p == '-' ? 2 : NO_OF_MSG_FIELDS + 2;
+        p = newline + 1;
+        if (++lines == nlines) {    /* the empty line closing it  */
+            whole = p;
+            lines = 0;
+        }
+    }
+    return whole - buf;
+}
+
+
+void
+msg_log_apply_or_die(const MsgLogChange* const change)
+{
+    off_t end;
+    Shard *sh;
+    Board *board;
+
+    if (change->shard < 0 || change->shard >= no_of_shards) {
+        fprintf(stderr, "[ERROR] change to unknown shard '%d'\n",
+                change->shard);
+        exit(EXIT_FAILURE);
+    }
+    sh = channels[0].shards + change->shard;
+    board = &sh->board;
+    lock_db_or_die(sh, F_WRLCK);
+    refresh_board_or_die(sh);
+    end = board->loaded_size;
+    if (change->reset) {    /* a new generation tells the others to reload  */
+        printf("[INFO] starting over '%s' from the primary\n", sh->path);
+        ++board->gen;
+        board->loaded = 0;
+        end = DB_HEADER_LEN;
+        write_db_header_or_die(sh);     /* first: see rewrite_db_or_die() */
+        if (ftruncate(sh->fd, end) == -1) {
+            perror("[ERROR] ftruncate()");
+            exit(EXIT_FAILURE);
+        }
+    }
+    write_db_or_die(sh, change->data, change->len, end);
+    board->next_id = change->next_id;
+    board->version = change->version;
+    write_db_header_or_die(sh);
+    refresh_board_or_die(sh);
+    unlock_db_or_die(sh);
+    bel_arena_reset(&scratch);
+}
+
+/*
+ * Brings the in-memory board up to date with the file, parsing its tail a
+ * chunk at a time. To be called while holding a lock on the database
+ */
+static void
+refresh_board_or_die(Shard *sh)
+{
+    off_t size;
+    size_t len, chunk = LOG_CHUNK;
+    long parsed;
+    char *buf;
+    unsigned long gen, next_id, version;
+    Board *board = &sh->board;
+
+    if (!read_db_header(sh, &gen, &next_id, &version)) {
+        fprintf(stderr, "[ERROR] database header is corrupted: exiting\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!board->loaded || gen != board->gen) {  /* rewritten: start over  */
+        board->count = 0;
+        board->heap_len = 0;
+        board->heap_dead = 0;
+        board->expiring = 0;
+        board->log_dead = 0;
+        board->loaded_size = DB_HEADER_LEN;
+        board->loaded = 1;
+        if (load_snapshot(sh, gen)) {
+            printf("[DEBUG] loaded snapshot of '%s', generation '%lu'\n",
+                    sh->path, gen);
+        } else {
+            printf("[DEBUG] (re)loading '%s', generation '%lu'\n",
+                    sh->path, gen);
+        }
+    }
+    board->gen = gen;
+    board->next_id = next_id;
+    board->version = version;
+
+    size = db_size_or_die(sh);
+    while (board->loaded_size < size) {
+        len = size - board->loaded_size;
+        if (len > chunk) len = chunk;
+        buf = read_chunk_or_die(sh, board->loaded_size, len);
+        parsed = parse_records(board, buf, len, board->loaded_size, 0);
+        if (parsed == -1 || (parsed == 0
+                    && (off_t) len == size - board->loaded_size)) {
+            fprintf(stderr, "[ERROR] database is corrupted: exiting\n");
+            exit(EXIT_FAILURE);
+        }
+        if (parsed == 0) chunk *= 2;    /* a record longer than a chunk  */
+        board->loaded_size += parsed;
+    }
+}
+
+/*
+ * Reads the header of the database file.
+ * Returns 0 (false) if there is no valid header, 1 (true) otherwise
+ */
+static int
+read_db_header(Shard *sh, unsigned long *gen, unsigned long *next_id,
+        unsigned long *version)
+{
+    char buf[DB_HEADER_LEN + 1] = "";
+    ssize_t pread_res;
+
+    pread_res = pread(sh->fd, buf, DB_HEADER_LEN, 0);
+    if (pread_res != DB_HEADER_LEN) return 0;
+    if (strncmp(buf, DB_MAGIC, DB_MAGIC_LEN) != 0) return 0;
+    return sscanf(buf + DB_MAGIC_LEN, "%lu %lu %lu", gen, next_id, version)
+            == 3;
+}
+
+static void
+write_db_header_or_die(Shard *sh)
+{
+    char buf[DB_HEADER_LEN + 1];
+    Board *board = &sh->board;
+
+    sprintf(buf, DB_HEADER_FORMAT, board->gen, board->next_id, board->version);
+    write_db_or_die(sh, buf, DB_HEADER_LEN, 0);
+}
+
+/*
+ * Replaces the whole content of the file with the messages in the board.
+ * With the text on disk, it comes from <old_log> (the whole file before the
+ * rewrite) if given, or else from the file itself.
+ * The header goes first: a rewrite cut short must leave no snapshot of the
+ * old generation usable, as it points to records since overwritten
+ */
+static void
+rewrite_db_or_die(Shard *sh, const char* const old_log)
+{
+    off_t end;
+    Board *board = &sh->board;
+
+    write_db_header_or_die(sh);
+    end = text_on_disk ? squeeze_log_or_die(sh, old_log)
+            : dump_board_or_die(sh);
+    if (ftruncate(sh->fd, end) == -1) {
+        perror("[ERROR] ftruncate()");
+        exit(EXIT_FAILURE);
+    }
+    board->loaded_size = end;
+    board->log_dead = 0;
+}
+
+/*
+ * Writes the records of the board, text from the heap, after the database
+ * header. Returns where they end
+ */
+static off_t
+dump_board_or_die(Shard *sh)
+{
+    size_t i, len, buf_len = 0, max_len;
+    char *buf;
+    Message msg;
+    MsgHeader *hdr;
+    Board *board = &sh->board;
+
+    max_len = board->count * (RECORD_IDLINE_MAXLEN + NO_OF_MSG_FIELDS + 2)
+            + board->heap_len;
+    buf = bel_arena_alloc_or_die(&scratch, max_len + 1);
+    for (i = 0, hdr = board->headers; i < board->count; ++i, ++hdr) {
+        header_tomessage(sh, hdr, &msg);
+        len = record_tostring(&msg, buf + buf_len);
+        hdr->text_pos = DB_HEADER_LEN + buf_len + len - text_size(hdr) - 1;
+        buf_len += len;
+    }
+    write_db_or_die(sh, buf, buf_len, DB_HEADER_LEN);
+    return DB_HEADER_LEN + buf_len;
+}
+
+/*
+ * Moves the records of the board, text from <old_log> or from the file, to
+ * the start of the file, a chunk at a time. Records keep their length and
+ * order, so they only move backwards, and no record is overwritten before
+ * having been read. Returns where they end
+ */
+static off_t
+squeeze_log_or_die(Shard *sh, const char* const old_log)
+{
+    size_t i, len = 0, cap = LOG_CHUNK, size, text_len;
+    off_t end = DB_HEADER_LEN;
+    char *buf;
+    MsgHeader *hdr;
+    Board *board = &sh->board;
+
+    buf = bel_arena_alloc_or_die(&scratch, cap);
+    for (i = 0, hdr = board->headers; i < board->count; ++i, ++hdr) {
+        size = record_size(hdr);
+        if (len + size > cap) {
+            write_db_or_die(sh, buf, len, end);
+            end += len;
+            len = 0;
+            if (size > cap) {
+                cap = size;
+                buf = bel_arena_alloc_or_die(&scratch, cap);
+            }
+        }
+        text_len = text_size(hdr);
+        len += idline_tostring(hdr->id, hdr->ctime, hdr->expires, buf + len);
+        if (old_log != NULL) {
+            memcpy(buf + len, old_log + hdr->text_pos, text_len);
+        } else if (!read_full(sh->fd, buf + len, text_len, hdr->text_pos)) {
+            perror("[ERROR] pread()");
+            exit(EXIT_FAILURE);
+        }
+        hdr->text_pos = end + len;
+        len += text_len;
+        buf[len++] = '\n';
+    }
+    write_db_or_die(sh, buf, len, end);
+    return end + len;
+}
+
+/* Returns <len> bytes of the file starting at <offset>, in scratch memory  */
+static char*
+read_db_or_die(Shard *sh, const off_t offset, const size_t len)
+{
+    char *buf;
+
+    buf = bel_arena_alloc_or_die(&scratch, len);
+    if (!read_full(sh->fd, buf, len, offset)) {
+        perror("[ERROR] pread()");
+        exit(EXIT_FAILURE);
+    }
+    return buf;
+}
+
+/*
+ * Same as read_db_or_die(), but into a buffer that the next call reuses,
+ * so that parsing the whole log never holds more than a chunk of it
+ */
+static char*
+read_chunk_or_die(Shard *sh, const off_t offset, const size_t len)
+{
+    if (len > chunk_cap) {
+        chunk_cap = len;
+        chunk_buf = realloc_or_die(chunk_buf, chunk_cap);
+    }
+    if (!read_full(sh->fd, chunk_buf, len, offset)) {
+        perror("[ERROR] pread()");
+        exit(EXIT_FAILURE);
+    }
+    return chunk_buf;
+}
+
+static void
+write_db_or_die(Shard *sh, const char* const buf, const size_t len,
+        const off_t offset)
+{
+    size_t done = 0;
+    ssize_t pwrite_res;
+
+    while (done < len) {
+        pwrite_res = pwrite(sh->fd, buf + done, len - done, offset + done);
+        if (pwrite_res == -1 && errno == EINTR) continue;
+        if (pwrite_res == -1) {
+            perror("[ERROR] pwrite()");
+            exit(EXIT_FAILURE);
+        }
+        done += pwrite_res;
+    }
+}
+
+static off_t
+db_size_or_die(Shard *sh)
+{
+    struct stat st;
+
+    if (fstat(sh->fd, &st) == -1) {
+        perror("[ERROR] fstat()");
+        exit(EXIT_FAILURE);
+    }
+    return st.st_size;
+}
+
+/*
+ * Reads exactly <len> bytes of <fd>, starting at <offset>.
+ * Returns 0 (false) on errors and on end of file
+ */
+static int
+read_full(const int fd, void *buf, const size_t len, const off_t offset)
+{
+    size_t done = 0;
+    ssize_t pread_res;
+
+    while (done < len) {
+        pread_res = pread(fd, (char*) buf + done, len - done, offset + done);
+        if (pread_res == -1 && errno == EINTR) continue;
+        if (pread_res <= 0) return 0;
+        done += pread_res;
+    }
+    return 1;
+}
+
+/* Writes all the <len> bytes of <buf>. Returns 0 (false) on errors  */
+static int
+write_full(const int fd, const void *buf, const size_t len)
+{
+    size_t done = 0;
+    ssize_t write_res;
+
+    while (done < len) {
+        write_res = write(fd, (const char*) buf + done, len - done);
+        if (write_res == -1 && errno == EINTR) continue;
+        if (write_res == -1) return 0;
+        done += write_res;
+    }
+    return 1;
+}
+
+
+/*
+ * Fills the (empty) board of <sh> from its snapshot, if there is one of
+ * generation <gen>. The tail of the log is then up to the caller.
+ * Returns 0 (false) if no usable snapshot was found
+ */
+static int
+load_snapshot(Shard *sh, const unsigned long gen)
+{
+    char path[MSG_PATHMAX];
+    int fd, ok;
+    struct stat st;
+    SnapshotHeader snap;
+    Board *board = &sh->board;
+
+    snapshot_path(sh, path);
+    fd = open(path, O_RDONLY);
+    if (fd == -1) return 0;
+    ok = fstat(fd, &st) == 0 && read_full(fd, &snap, sizeof(snap), 0)
+            && is_usable_snapshot(sh, &snap, gen, st.st_size);
+    if (ok && snap.count > board->capacity) {
+        board->capacity = snap.count;
+        board->headers = realloc_or_die(board->headers,
+                board->capacity * sizeof(MsgHeader));
+        bel_hugepages_advise(board->headers,
+                board->capacity * sizeof(MsgHeader));
+    }
+    if (ok && !text_on_disk && snap.heap_len > board->heap_cap) {
+        board->heap_cap = snap.heap_len;
+        board->heap = realloc_or_die(board->heap, board->heap_cap);
+        bel_hugepages_advise(board->heap, board->heap_cap);
+    }
+    ok = ok && read_full(fd, board->headers, snap.count * sizeof(MsgHeader),
+                    sizeof(snap))
+            && (text_on_disk || read_full(fd, board->heap, snap.heap_len,
+                    sizeof(snap) + snap.count * sizeof(MsgHeader)));
+    if (close(fd) == -1) perror("[WARN] close()");
+    if (!ok) return 0;
+
+    board->count = snap.count;
+    board->heap_len = text_on_disk ? 0 : snap.heap_len;
+    board->expiring = snap.expiring;
+    board->log_dead = snap.log_dead;
+    board->loaded_size = snap.loaded_size;
+    sh->snap_gen = gen;
+    sh->snap_size = snap.loaded_size;
+    return 1;
+}
+
+/*
+ * Returns 1 (true) if <snap>, from a file of <size> bytes, was written on a
+ * machine like this one and covers a prefix of generation <gen> of the log,
+ * with the text too unless it is left on disk
+ */
+static int
+is_usable_snapshot(Shard *sh, const SnapshotHeader* const snap,
+        const unsigned long gen, const off_t size)
+{
+    return memcmp(snap->magic, SNAPSHOT_MAGIC, sizeof(snap->magic)) == 0
+            && snap->one == 1 && snap->header_size == sizeof(MsgHeader)
+            && snap->gen == gen
+            && (text_on_disk || snap->heap_len > 0 || snap->count == 0)
+            && snap->loaded_size >= DB_HEADER_LEN
+            && (off_t) snap->loaded_size <= db_size_or_die(sh)
+            && size == (off_t) (sizeof(*snap)
+                    + snap->count * sizeof(MsgHeader) + snap->heap_len);
+}
+
+/*
+ * Dumps the board of <sh> to a new snapshot, replacing the old one only once
+ * complete. Snapshots are just a cache: failures are reported and ignored
+ */
+static void
+write_snapshot(Shard *sh)
+{
+    char path[MSG_PATHMAX], tmp_path[MSG_PATHMAX + 32];
+    int fd, ok;
+    SnapshotHeader snap;
+    Board *board = &sh->board;
+
+    if (board->heap_dead > 0) compact_heap(board);
+    memset(&snap, 0, sizeof(snap));
+    memcpy(snap.magic, SNAPSHOT_MAGIC, sizeof(snap.magic));
+    snap.one = 1;
+    snap.header_size = sizeof(MsgHeader);
+    snap.gen = board->gen;
+    snap.loaded_size = board->loaded_size;
+    snap.log_dead = board->log_dead;
+    snap.count = board->count;
+    snap.heap_len = board->heap_len;
+    snap.expiring = board->expiring;
+
+    snapshot_path(sh, path);
+    sprintf(tmp_path, "%s.%ld", path, (long) getpid());
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("[WARN] open()");
+        return;
+    }
+    ok = write_full(fd, &snap, sizeof(snap))
+            && write_full(fd, board->headers, board->count * sizeof(MsgHeader))
+            && write_full(fd, board->heap, board->heap_len);
+    if (close(fd) == -1) ok = 0;
+    if (!ok || rename(tmp_path, path) == -1) {
+        perror("[WARN] cannot write snapshot");
+        unlink(tmp_path);
+        return;
+    }
+    sh->snap_gen = board->gen;
+    sh->snap_size = board->loaded_size;
+    printf("[DEBUG] snapshot of '%s' taken, '%lu' messages\n", sh->path,
+            (unsigned long) board->count);
+}
+
+static void
+snapshot_path(const Shard* const sh, char *path)
+{
+    sprintf(path, "%s" SNAPSHOT_SUFFIX, sh->path);
+}
+
+
+/*
+ * Applies to the board all the whole records found in buf[0..len), which was
+ * read from offset <base> of the file. <legacy> records lack the "<id>
+ * <creation time>" line, and there are no tombstones among them.
+ * Returns the length of the records applied, up to the first one cut short
+ * by the end of the buffer, or -1 if the buffer is malformed
+ */
+static long
+parse_records(Board *board, const char *buf, const size_t len,
+        const off_t base, const int legacy)
+{
+    int i, nlines;
+    const char *start = buf, *record, *end, *newline;
+    Field lines[NO_OF_MSG_FIELDS + 1];
+    unsigned long id, created, expires;
+    Field idline, ctimeline, expiresline;
+    size_t marked = 0;
+
+    nlines = legacy ? NO_OF_MSG_FIELDS : NO_OF_MSG_FIELDS + 1;
+    for (end = buf + len; buf < end; ++buf) {   /* ++buf skips empty line  */
+        if (!legacy && *buf == '-') {
+            newline = memchr(buf, '\n', end - buf);
+            if (newline == NULL || newline + 1 == end) break;
+            buf = parse_tombstone(board, buf, end, &marked);
+            if (buf == NULL) return -1;
+            continue;
+        }
+        record = buf;
+        for (i = 0; i < nlines; ++i) {
+            newline = memchr(buf, '\n', end - buf);
+            if (newline == NULL) break;
+            lines[i].ptr = buf;
+            lines[i].len = newline - buf;
+            buf = newline + 1;
+        }
+        if (i < nlines || buf == end) {     /* cut short  */
+            buf = record;
+            break;
+        }
+        if (*buf != '\n') return -1;
+        if (legacy) {
+            id = board->next_id;
+            created = 0;
+            expires = 0;
+        } else {
+            newline = memchr(lines[0].ptr, ' ', lines[0].len);
+            if (newline == NULL) return -1;
+            idline.ptr = lines[0].ptr;
+            idline.len = newline - lines[0].ptr;
+            ctimeline.ptr = newline + 1;
+            ctimeline.len = lines[0].len - idline.len - 1;
+            expires = 0;
+            newline = memchr(ctimeline.ptr, ' ', ctimeline.len);
+            if (newline != NULL) {
+                expiresline.ptr = newline + 1;
+                expiresline.len = ctimeline.len - (newline + 1 - ctimeline.ptr);
+                ctimeline.len = newline - ctimeline.ptr;
+                if (!parse_ulong(expiresline, &expires)) return -1;
+            }
+            if (!parse_ulong(idline, &id)) return -1;
+            if (!parse_ulong(ctimeline, &created)) return -1;
+        }
+        if (lines[nlines - 3].len >= FROM_MAXLEN) return -1;
+        append_to_board(board, id, (time_t) created, (time_t) expires,
+                base + (lines[nlines - 3].ptr - start), lines[nlines - 3],
+                lines[nlines - 2], lines[nlines - 1]);
+        if (id >= board->next_id) board->next_id = id + no_of_shards;
+    }
+    if (marked > 0) sweep_dead(board);
+    return buf - start;
+}
+
+/*
+ * Marks as dead the message named by the tombstone starting at <buf>,
+ * counting it in <marked>. Sweeping is left to the caller, so that a long
+ * run of tombstones costs a single pass over the board.
+ * Returns where the empty line closing the tombstone is, or NULL if the
+ * tombstone is malformed
+ */
+static const char*
+parse_tombstone(Board *board, const char *buf, const char* const end,
+        size_t *marked)
+{
+    const char *newline;
+    Field idline;
+    unsigned long id;
+    long idx;
+
+    newline = memchr(buf, '\n', end - buf);
+    if (newline == NULL || newline + 1 == end || newline[1] != '\n') {
+        return NULL;
+    }
+    idline.ptr = buf + 1;
+    idline.len = newline - idline.ptr;
+    if (!parse_ulong(idline, &id)) return NULL;
+    board->log_dead += newline + 2 - buf;
+    idx = find_by_id(board, id);
+    if (idx != -1 && board->headers[idx].text_off != DEAD_TEXT_OFF) {
+        mark_dead(board, idx);
+        ++*marked;
+    }
+    return newline + 1;
+}
+
+/* Returns 0 (false) if <field> is not made of decimal digits only  */
+static int
+parse_ulong(const Field field, unsigned long *value)
+{
+    size_t i;
+
+    if (field.len == 0 || field.len > MSGID_MAXCHARS) return 0;
+    *value = 0;
+    for (i = 0; i < field.len; ++i) {
+        if (field.ptr[i] < '0' || field.ptr[i] > '9') return 0;
+        *value = *value * 10 + (field.ptr[i] - '0');
+    }
+    return 1;
+}
+
+/* Writes the textual record of <msg> into <buf>, returning its length  */
+static size_t
+record_tostring(const Message* const msg, char *buf)
+{
+    size_t len;
+
+    len = idline_tostring(msg->id, msg->ctime, msg->expires, buf);
+    memcpy(buf + len, msg->from, msg->from_len);
+    len += msg->from_len;
+    buf[len++] = '\n';
+    memcpy(buf + len, msg->subject, msg->subject_len);
+    len += msg->subject_len;
+    buf[len++] = '\n';
+    memcpy(buf + len, msg->body, msg->body_len);
+    len += msg->body_len;
+    buf[len++] = '\n';
+    buf[len++] = '\n';
+    return len;
+}
+
+/* Writes the "<id> <creation time>[ <expiry time>]" line of a record  */
+static size_t
+idline_tostring(const unsigned long id, const time_t created,
+        const time_t expires, char *buf)
+{
+    if (expires == 0) {
+        return sprintf(buf, "%lu %lu\n", id, (unsigned long) created);
+    }
+    return sprintf(buf, "%lu %lu %lu\n", id, (unsigned long) created,
+            (unsigned long) expires);
+}
+
+/* Returns the length of the textual record of <hdr>, without writing it  */
+static size_t
+record_size(const MsgHeader *hdr)
+{
+    size_t size;
+
+    size = ulong_digits(hdr->id) + 1 + ulong_digits(hdr->ctime) + 1
+            + hdr->from_len + hdr->subject_len + hdr->body_len
+            + NO_OF_MSG_FIELDS + 1;
+    if (hdr->expires != 0) size += 1 + ulong_digits(hdr->expires);
+    return size;
+}
+
+/* Returns the length of the text of <hdr>, one terminator per field  */
+static size_t
+text_size(const MsgHeader *hdr)
+{
+    return hdr->from_len + hdr->subject_len + hdr->body_len
+            + NO_OF_MSG_FIELDS;
+}
+
+static size_t
+ulong_digits(unsigned long value)
+{
+    size_t digits = 1;
+
+    while (value >= 10) {
+        value /= 10;
+        ++digits;
+    }
+    return digits;
+}
+
+
+/*
+ * Appends a message to <board>, its text being at <text_pos> in the file.
+ * The text is copied to the heap, unless it is left on disk
+ */
+static void
+append_to_board(Board *board, const unsigned long id, const time_t created,
+        const time_t expires, const off_t text_pos,
+        const Field from, const Field subject, const Field body)
+{
+    MsgHeader *hdr;
+    char *text;
+    size_t text_len;
+
+    /* the headers and the heap are scanned whole: back them with huge pages */
+    if (board->count == board->capacity) {
+        board->capacity = board->capacity ? board->capacity * 2 : 64;
+        board->headers = realloc_or_die(board->headers,
+                board->capacity * sizeof(MsgHeader));
+        bel_hugepages_advise(board->headers,
+                board->capacity * sizeof(MsgHeader));
+    }
+    text_len = from.len + subject.len + body.len + NO_OF_MSG_FIELDS;
+    if (!text_on_disk && board->heap_len + text_len > board->heap_cap) {
+        do {
+            board->heap_cap = board->heap_cap ? board->heap_cap * 2 : 4096;
+        } while (board->heap_len + text_len > board->heap_cap);
+        board->heap = realloc_or_die(board->heap, board->heap_cap);
+        bel_hugepages_advise(board->heap, board->heap_cap);
+    }
+
+    hdr = board->headers + board->count++;
+    hdr->id = id;
+    hdr->from_hash = hash_name(from.ptr, from.len);
+    hdr->ctime = created;
+    hdr->expires = expires;
+    if (expires != 0) ++board->expiring;
+    hdr->text_off = text_on_disk ? 0 : board->heap_len;
+    hdr->text_pos = text_pos;
+    hdr->from_len = from.len;
+    hdr->subject_len = subject.len;
+    hdr->body_len = body.len;
+    if (text_on_disk) return;
+
+    text = board->heap + board->heap_len;
+    memcpy(text, from.ptr, from.len);
+    text[from.len] = '\0';
+    text += from.len + 1;
+    memcpy(text, subject.ptr, subject.len);
+    text[subject.len] = '\0';
+    text += subject.len + 1;
+    memcpy(text, body.ptr, body.len);
+    text[body.len] = '\0';
+    board->heap_len += text_len;
+}
+
+/*
+ * Marks the message at <idx> as deleted. It stays in the board, still
+ * findable by ID, until sweep_dead() is called
+ */
+static void
+mark_dead(Board *board, const size_t idx)
+{
+    MsgHeader *hdr;
+
+    hdr = board->headers + idx;
+    board->log_dead += record_size(hdr);
+    hdr->text_off = DEAD_TEXT_OFF;
+}
+
+/*
+ * Drops the messages marked as deleted from the board, in a single pass,
+ * squeezing the heap once it is mostly made of dead text
+ */
+static void
+sweep_dead(Board *board)
+{
+    size_t i, kept;
+    const MsgHeader *hdr;
+
+    for (i = 0, kept = 0, hdr = board->headers; i < board->count; ++i, ++hdr) {
+        if (hdr->text_off != DEAD_TEXT_OFF) {
+            board->headers[kept++] = *hdr;
+            continue;
+        }
+        if (!text_on_disk) board->heap_dead += text_size(hdr);
+        if (hdr->expires != 0) --board->expiring;
+    }
+    board->count = kept;
+    if (board->heap_dead > board->heap_len / 2) compact_heap(board);
+}
+
+/*
+ * Appends a tombstone to the log for every message marked as deleted, then
+ * drops them from the board. The file is rewritten instead once it is mostly
+ * made of deleted records. To be called while holding a write lock
+ */
+static void
+log_deletions_or_die(Shard *sh)
+{
+    size_t i, len = 0;
+    char *buf;
+    const MsgHeader *hdr;
+    Board *board = &sh->board;
+
+    buf = bel_arena_alloc_or_die(&scratch, board->count * TOMBSTONE_MAXLEN);
+    for (i = 0, hdr = board->headers; i < board->count; ++i, ++hdr) {
+        if (hdr->text_off == DEAD_TEXT_OFF) {
+            len += sprintf(buf + len, "-%lu\n\n", hdr->id);
+        }
+    }
+    sweep_dead(board);
+    ++board->version;
+    if (board->log_dead + len > (size_t) board->loaded_size / 2) {
+        ++board->gen;
+        rewrite_db_or_die(sh, NULL);
+        return;
+    }
+    write_db_or_die(sh, buf, len, board->loaded_size);
+    board->loaded_size += len;
+    board->log_dead += len;
+    write_db_header_or_die(sh);
+}
+
+/*
+ * Marks as dead at most <batch> messages of <board>, first the oldest ones
+ * that break <policy>, then the ones past their own expiry time. Limits on
+ * count and bytes are split evenly among the shards, and bytes are the ones
+ * of live records.
+ * Returns the number of marked messages
+ */
+static size_t
+expire_from_board(Board *board, const RetentionPolicy* const policy,
+        const time_t now, const int batch)
+{
+    size_t i, removed = 0, count, bytes, max_count, max_bytes;
+    MsgHeader *hdr;
+
+    max_count = (policy->max_count + no_of_shards - 1) / no_of_shards;
+    max_bytes = (policy->max_bytes + no_of_shards - 1) / no_of_shards;
+    count = board->count;
+    bytes = board->loaded_size - DB_HEADER_LEN - board->log_dead;
+
+    /* IDs grow with time, so the messages breaking the policy come first  */
+    for (i = 0, hdr = board->headers; i < board->count
+            && removed < (size_t) batch; ++i, ++hdr) {
+        if ((policy->max_age == 0 || hdr->ctime + policy->max_age > now)
+                && (max_count == 0 || count <= max_count)
+                && (max_bytes == 0 || bytes <= max_bytes)) {
+            break;
+        }
+        --count;
+        bytes -= record_size(hdr);
+        mark_dead(board, i);
+        ++removed;
+    }
+    for (; board->expiring > 0 && i < board->count
+            && removed < (size_t) batch; ++i, ++hdr) {
+        if (hdr->expires != 0 && hdr->expires <= now) {
+            mark_dead(board, i);
+            ++removed;
+        }
+    }
+    return removed;
+}
+
+/* Squeezes out of the heap the text of the deleted messages  */
+static void
+compact_heap(Board *board)
+{
+    size_t i, text_len, heap_len = 0;
+    MsgHeader *hdr;
+
+    printf("[DEBUG] compacting heap, '%lu' dead bytes\n",
+            (unsigned long) board->heap_dead);
+    for (i = 0, hdr = board->headers; i < board->count; ++i, ++hdr) {
+        text_len = text_size(hdr);
+        memmove(board->heap + heap_len, board->heap + hdr->text_off, text_len);
+        hdr->text_off = heap_len;
+        heap_len += text_len;
+    }
+    board->heap_len = heap_len;
+    board->heap_dead = 0;
+}
+
+/*
+ * IDs are handed out in increasing order and records are never reordered,
+ * so the headers are sorted by ID.
+ * Returns the index of the message with the given ID, or -1 if not found
+ */
+static long
+find_by_id(const Board *board, const unsigned long id)
+{
+    size_t low = 0, high = board->count, mid;
+
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (board->headers[mid].id == id) return mid;
+        if (board->headers[mid].id < id) low = mid + 1; else high = mid;
+    }
+    return -1;
+}
+
+/* Returns the index of the first message with an ID not less than <id>  */
+static size_t
+lower_bound(const Board *board, const unsigned long id)
+{
+    size_t low = 0, high = board->count, mid;
+
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (board->headers[mid].id < id) low = mid + 1; else high = mid;
+    }
+    return low;
+}
+
+/*
+ * Sets <pos> to the positions, one per shard, that skip the first <first>
+ * messages in ID order. That is where the (<first> + 1)-th smallest ID would
+ * be, which is found by bisecting on the ID value itself: no message has to
+ * be visited
+ */
+static void
+skip_merged(const long first, size_t *pos)
+{
+    int i;
+    unsigned long low = 0, high = 0, mid;
+    size_t below;
+
+    for (i = 0; i < no_of_shards; ++i) {
+        if (shards[i].board.next_id > high) high = shards[i].board.next_id;
+    }
+    while (low < high) {    /* smallest ID with more than <first> below it  */
+        mid = low + (high - low) / 2;
+        below = 0;
+        for (i = 0; i < no_of_shards; ++i) {
+            below += lower_bound(&shards[i].board, mid + 1);
+        }
+        if (below > (size_t) first) high = mid; else low = mid + 1;
+    }
+    for (i = 0; i < no_of_shards; ++i) {
+        pos[i] = lower_bound(&shards[i].board, low);
+    }
+}
+
+/*
+ * Returns the message with the smallest ID among the ones at <pos>, moving
+ * past it, and saves the shard it belongs to in <from>.
+ * Returns NULL when all the shards are exhausted
+ */
+static const MsgHeader*
+next_merged(size_t *pos, Shard **from)
+{
+    int i, best = -1;
+    const Board *board;
+
+    for (i = 0; i < no_of_shards; ++i) {
+        board = &shards[i].board;
+        if (pos[i] < board->count && (best == -1 || board->headers[pos[i]].id
+                < shards[best].board.headers[pos[best]].id)) {
+            best = i;
+        }
+    }
+    if (best == -1) return NULL;
+    *from = shards + best;
+    return shards[best].board.headers + pos[best]++;
+}
+
+static void
+header_tomessage(Shard *sh, const MsgHeader *hdr, Message *msg)
+{
+    const char *text;
+
+    text = load_text(sh, hdr, text_size(hdr));
+    msg->id = hdr->id;
+    msg->ctime = hdr->ctime;
+    msg->expires = hdr->expires;
+    msg->from = text;
+    msg->from_len = hdr->from_len;
+    text += hdr->from_len + 1;
+    msg->subject = text;
+    msg->subject_len = hdr->subject_len;
+    text += hdr->subject_len + 1;
+    msg->body = text;
+    msg->body_len = hdr->body_len;
+}
+
+/*
+ * Returns the first <len> bytes of the text of <hdr>, fields '\0'-terminated
+ * as in the heap. Text left on disk is read into scratch memory, through the
+ * cache: to be called while holding a lock
+ */
+static const char*
+load_text(Shard *sh, const MsgHeader *hdr, const size_t len)
+{
+    char *text;
+    size_t sep;
+
+    if (!text_on_disk) return sh->board.heap + hdr->text_off;
+    text = bel_arena_alloc_or_die(&scratch, len + 1);
+    if (!bel_pagecache_read(&cache, sh->fd, sh->board.gen, hdr->text_pos, len,
+                text)) {
+        fprintf(stderr, "[ERROR] database is corrupted: exiting\n");
+        exit(EXIT_FAILURE);
+    }
+    sep = hdr->from_len;    /* newlines in the file, terminators here  */
+    if (sep < len) text[sep] = '\0';
+    sep += 1 + hdr->subject_len;
+    if (sep < len) text[sep] = '\0';
+    sep += 1 + hdr->body_len;
+    if (sep < len) text[sep] = '\0';
+    return text;
+}
+
+/* FNV-1a, so that ownership checks rarely need to look at the heap  */
+static unsigned long
+hash_name(const char *name, const size_t len)
+{
+    size_t i;
+    unsigned long hash = 2166136261UL;
+
+    for (i = 0; i < len; ++i) {
+        hash ^= (unsigned char) name[i];
+        hash = (hash * 16777619UL) & 0xffffffffUL;
+    }
+    return hash;
+}
+
+static void*
+realloc_or_die(void *ptr, const size_t size)
+{
+    void *new_ptr;
+
+    new_ptr = realloc(ptr, size);
+    if (new_ptr == NULL) {
+        perror("[FATAL] realloc()");
         exit(EXIT_FAILURE);
     }
-    return fp;
+    return new_ptr;
 }
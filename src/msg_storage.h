@@ -2,38 +2,144 @@
 #define MSGSTORAGE_H_INCLUDED
 
 #include <stdio.h>
-
-/* Maximum number of messages that can be stored in the database  */
-#define MSG_MAX_STORAGE 16
+#include <time.h>
 
 #define FROM_MAXLEN 32
-#define TXT_MAXLEN 128
-#define MSG_TOSTRING_SIZE FROM_MAXLEN + TXT_MAXLEN * 2
 
+/* Most shards the database can be split in  */
+#define MSG_MAX_SHARDS 64
+
+/* Most channels a database can have, the default one included  */
+#define MSG_MAX_CHANNELS 64
+
+/* Longest name of a channel  */
+#define MSG_CHANNEL_MAXLEN 31
+
+/* Longest textual form of a message ID  */
+#define MSGID_MAXCHARS 20
+
+/* Longest change to a log, as read by msg_log_read()  */
+#define MSG_LOG_CHANGE_MAXLEN (1024 * 1024)
+
+/*
+ * A message, as seen from the outside of the storage. The text fields are
+ * '\0'-terminated, but their lengths are also given so that nobody needs to
+ * scan them. Messages returned by the storage point to its own memory, and
+ * are only valid until the next storage operation
+ */
 typedef struct {
-    char from[FROM_MAXLEN];
-    char subject[TXT_MAXLEN];
-    char body[TXT_MAXLEN];
+    unsigned long id;   /* assigned by the storage, never reused  */
+    time_t ctime;       /* creation time, assigned by the storage  */
+    time_t expires;     /* when it is to be dropped, 0 for never  */
+    const char *from;
+    const char *subject;
+    const char *body;
+    size_t from_len;
+    size_t subject_len;
+    size_t body_len;
 } Message;
 static const Message empty_message;
 
+/* Limits on what the database keeps. Zero means no limit  */
+typedef struct {
+    long max_age;               /* seconds since creation  */
+    unsigned long max_count;    /* messages  */
+    unsigned long max_bytes;    /* size of the database files  */
+} RetentionPolicy;
+static const RetentionPolicy empty_retention_policy;
+
+/* A change to the database, for msg_write_batch()  */
+typedef struct {
+    int kind;
+        #define MSG_WRITE_STORE     0
+        #define MSG_WRITE_DELETE    1
+    Message msg;    /* to store; to delete, its ID and the user asking  */
+    int done;       /* outcome: 1 (true) if it was applied  */
+} MsgWrite;
+static const MsgWrite empty_msg_write;
+
+/* How far a replica got in the log of one shard of its primary  */
+typedef struct {
+    unsigned long gen;      /* generation of the log on the primary  */
+    unsigned long offset;   /* bytes of it replicated, 0 for none yet  */
+} MsgLogPosition;
+static const MsgLogPosition empty_log_position;
+
+/* A change to the log of a shard, as shipped from a primary to a replica  */
+typedef struct {
+    int shard;
+    int reset;              /* the log was rewritten: start over  */
+    unsigned long next_id;  /* database header after the change  */
+    unsigned long version;
+    const char *data;       /* records and tombstones, as stored  */
+    size_t len;
+} MsgLogChange;
+static const MsgLogChange empty_log_change;
+
 
 /* Prints the given message (for debugging purposes)  */
 extern void msg_trace(const Message msg);
 
-/* Writes a Message array <msg> of <array_size> elements into <buf>  */
-extern void
+/*
+ * Returns the size of the buffer needed by msg_arraytostring() for the
+ * Message array <msg> of <array_size> elements, terminator included
+ */
+extern size_t
+msg_tostring_size(const Message* msg, const int array_size);
+
+/*
+ * Writes a Message array <msg> of <array_size> elements into <buf>.
+ * Returns the length of the resulting string
+ */
+extern size_t
 msg_arraytostring(const Message* msg, const int array_size, char *buf);
 
 
 /*
- * Creates the database file at the specified location if it does not exist
- * yet. To be called before any store or retrieve operation.
+ * Leaves the text of messages on disk instead of keeping all of it in memory,
+ * reading it on demand through a cache of at most <bytes> (per process): only
+ * a small fixed-size header per message stays resident. To be called before
+ * opening the database, if at all
+ */
+extern void msg_set_cache_budget(const size_t bytes);
+
+/*
+ * Opens the database file at the specified location, creating it if it does
+ * not exist yet, and loads its content in memory. To be called before any
+ * store or retrieve operation.
  * Exits on failure
  */
 extern void msg_init_db_or_die(const char* const);
 
-/* Stores <msg> in the last position of the database  */
+/*
+ * Same as msg_init_db_or_die(), but splitting the database in <count> shards
+ * (up to MSG_MAX_SHARDS), one file each: <file_path>.0, <file_path>.1 and so
+ * on. One shard means just <file_path>. The number of shards of an existing
+ * database cannot be changed.
+ * Exits on failure
+ */
+extern void msg_init_sharded_db_or_die(const char* const, const int count);
+
+/*
+ * Selects the channel with the given name, made of up to MSG_CHANNEL_MAXLEN
+ * letters, digits, '-' and '_', for all the operations that follow: they
+ * only see and change the messages of that channel. The channel is created,
+ * with files <file_path>-<name> and its shards, the first time anybody
+ * selects it. The empty name is the default channel, which is selected when
+ * the database is opened.
+ * Returns 0 (false) if the name is invalid, or if there are MSG_MAX_CHANNELS
+ * channels already
+ */
+extern int msg_select_channel(const char* const name);
+
+/* Returns the name of the selected channel  */
+extern const char* msg_channel(void);
+
+/*
+ * Stores <msg> in the last position of the database, assigning it a new ID
+ * and creation time (the ones in <msg> are ignored). The text fields must not
+ * contain newlines
+ */
 extern void msg_store(const Message msg);
 
 /*
@@ -44,9 +150,93 @@ extern void msg_store(const Message msg);
 extern int msg_retrieve_some(Message* buf, const int count);
 
 /*
- * Deletes the nth message from the database if it is from the given user.
+ * Same as msg_retrieve_some(), but skipping the first <first> Messages in the
+ * database
+ */
+extern int
+msg_retrieve_range(Message* buf, const long first, const int count);
+
+/*
+ * Returns the current version of the database, which changes whenever a
+ * message is stored or deleted. Retrievals made after this call see content
+ * at least as recent as the returned version
+ */
+extern unsigned long msg_version(void);
+
+/*
+ * Deletes the message with the given ID from the database if it is from the
+ * given user.
  * Returns 1 (true) on success and 0 (false) on failure.
  */
-int msg_delete(const char[FROM_MAXLEN], const int);
+extern int msg_delete(const char* const, const unsigned long);
+
+/*
+ * Applies <count> stores and deletions at once, taking the lock of each shard
+ * involved, and writing to it, only once for all of them. Like msg_store(),
+ * stores get a new ID and creation time, which are written back into their
+ * Message; like msg_delete(), deletions only succeed for messages of the user
+ * in their <from>. The outcome of each write goes into its <done>
+ */
+extern void msg_write_batch(MsgWrite *writes, const int count);
+
+/*
+ * Fills <next_ids> with the ID that the next message stored in each shard of
+ * the selected channel will get, as msg_write_batch_applied() needs them
+ */
+extern void msg_next_ids(unsigned long next_ids[MSG_MAX_SHARDS]);
+
+/*
+ * Recovery of a msg_write_batch() of <count> writes cut short by a crash,
+ * which started when the shards had the next IDs in <next_ids>: marks as done,
+ * with the ID they got, the stores that made it to the files, so that they are
+ * not applied again. The stores of a shard are written all at once, and made
+ * it all or not at all. Deletions are left undone: applying them again does no
+ * harm
+ */
+extern void msg_write_batch_applied(MsgWrite *writes, const int count,
+        const unsigned long* const next_ids);
+
+/*
+ * Deletes up to <batch> messages per shard among the ones past their expiry
+ * time or breaking <policy>, oldest first, in every channel: each channel is
+ * held to the whole policy on its own. Meant to be called periodically,
+ * by a single process.
+ * Returns the number of deleted messages
+ */
+extern int msg_expire(const RetentionPolicy* const policy, const int batch);
+
+/*
+ * Takes a binary snapshot of every shard whose log has grown enough since its
+ * last one, so that loading it again is quick. Meant to be called
+ * periodically, by a single process. Failures are not fatal
+ */
+extern void msg_snapshot(void);
+
+
+/*
+ * Replication, which only concerns the default channel, whatever channel is
+ * selected.
+ * Returns the number of shards of the database, the same in every channel
+ */
+extern int msg_shard_count(void);
+
+/*
+ * Primary side of replication: fills <change> with whatever was written to
+ * the given shard past <pos>, and moves <pos> past it. Changes stop at
+ * MSG_LOG_CHANGE_MAXLEN bytes, on a record boundary, so that a long log is
+ * read in several calls, the first one only being a reset. The data points
+ * to storage memory, valid until the next storage operation.
+ * Returns 0 (false) if there was nothing new
+ */
+extern int msg_log_read(const int shard, MsgLogPosition *pos,
+        MsgLogChange *change);
+
+/*
+ * Replica side of replication: appends <change> to the log of its shard,
+ * which becomes a copy of the one of the primary (but for the generation,
+ * which stays local).
+ * Exits on failure, and on malformed changes
+ */
+extern void msg_log_apply_or_die(const MsgLogChange* const change);
 
 #endif	/* MSGSTORAGE_H_INCLUDED */